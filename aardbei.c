@@ -1,36 +1,31 @@
 // TODO:
 // 	complete opcodes
 //	v9958 emulation
-//	full uart emulation
-//	make the audio timing fixed.........
-// 	mmap flash and eeprom
-// 	cli args parsing
 // 	cleaner debug output
 // 	refresh register
-// 	gdb integration
 // 	factor out the code into multiple files
 // 	make documentation n stuff
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
+#include <string.h>
+#include <unistd.h>
 #include <allegro5/allegro.h>
 #include "allegro5/allegro_audio.h"
-#include <ayemu.h>
-#include "v9958.h"
+#include "aardbei.h"
+#include "batch.h"
 
 //#define DEBUG
 //#define DEBUG_IO
-//#define DEBUG_AY
 #define STRICT
 
-#define CPU_RATE 3579545
-#define AUDIO_RATE 44100
-#define AUDIO_DEPTH ALLEGRO_AUDIO_DEPTH_INT16
-#define AUDIO_CHANNELS ALLEGRO_CHANNEL_CONF_2
-#define AUDIO_BUFFER_FRAGS 2
-#define SAMPLES_PER_BUFFER 1024
-#define BUFFER_LENGTH (SAMPLES_PER_BUFFER * 2 * 2)
+#define UART_SERVICE_CYCLES (CPU_RATE / 100)
+#define MEMORY_SYNC_CYCLES CPU_RATE
+#define DEBUG_POLL_CYCLES (CPU_RATE / 100)
+#define DEFAULT_STATE_FILE "aardbei.state"
 
 
 
@@ -45,218 +40,421 @@ long int nanos() {
 
 
 
-/* CPU STATE AND REGISTERS */
+/* SYSTEM */
 
-struct RegisterSet {
-	union {
-		uint16_t af;
-		struct {
-			uint8_t f;
-			uint8_t a;
-		};
-	};
-	union {
-		uint16_t bc;
-		struct {
-			uint8_t c;
-			uint8_t b;
-		};
-	};
-	union {
-		uint16_t de;
-		struct {
-			uint8_t e;
-			uint8_t d;
-		};
-	};
-	union {
-		uint16_t hl;
-		struct {
-			uint8_t l;
-			uint8_t h;
-		};
-	};
-};
+// how long this many cycles take in nanoseconds
+long int cyclesToNanos(uint64_t cycles) {
+	return cycles / CPU_RATE * 1000000000
+		+ cycles % CPU_RATE * 1000000000 / CPU_RATE;
+}
 
-struct Registers {
-	struct RegisterSet main;
-	struct RegisterSet alt;
-	uint8_t i;
-	uint8_t r;
-	union {
-		uint16_t ix;
-		struct {
-			uint8_t ixl;
-			uint8_t ixh;
-		};
-	};
-	union {
-		uint16_t iy;
-		struct {
-			uint8_t iyl;
-			uint8_t iyh;
-		};
-	};
-	uint16_t sp;
-	uint16_t pc;
-};
+// return the amount of emulated nanoseconds passed since the system has started
+long int systemNanos(struct System *system) {
+	return cyclesToNanos(system->cycles);
+}
 
-struct CPUState {
-	struct Registers regs;
-};
+// how many cycles the cpu should have run after this many nanoseconds
+long int nanosToCycles(long int nanos) {
+	return nanos / 1000000000 * CPU_RATE
+		+ nanos % 1000000000 * CPU_RATE / 1000000000;
+}
+
+// when the nth audio fragment is due
+uint64_t fragmentCycle(uint64_t fragment) {
+	return fragment * SAMPLES_PER_BUFFER * CPU_RATE / AUDIO_RATE;
+}
 
+// the audio thread renders a fragment once the cpu is past its end
+// or renders it itself when it's going to a file
+void audioEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	if(system->peripherals.sound.wav) renderWav(&system->peripherals.sound, when);
+	else syncSound(&system->peripherals.sound, when);
+	system->audioFragments++;
+	schedule(&system->scheduler, fragmentCycle(system->audioFragments),
+			audioEvent, system);
+}
 
+// the frame ends in vblank
+void frameEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	runCommand(&system->peripherals.vdc, when);
+	system->peripherals.vdc.flags |= VDC_VBLANK;
+	draw(&system->peripherals.vdc);
+	if(system->rewind) snapshot(system->rewind, system);
+	schedule(&system->scheduler, when + VDC_FRAME_CYCLES, frameEvent, system);
+}
 
+// write back whatever the cpu saved to the eeprom
+void memoryEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	syncMemory(&system->memory);
+	schedule(&system->scheduler, when + MEMORY_SYNC_CYCLES, memoryEvent, system);
+}
 
-/* MEMORY */
+// the uart's host end is only written to and read from this often
+void uartEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	serviceUART(&system->peripherals.uart, when);
+	scheduleUARTChange(system, when);
+	schedule(&system->scheduler, when + UART_SERVICE_CYCLES, uartEvent, system);
+}
 
-#define EEPROM_SIZE (1024*8)
-#define RAM_SIZE    (1024*24)
-#define BANK_SIZE   (1024*16)
-#define FLASH_SIZE  (1024*512)
+// a byte the uart was sending or receiving is done, so what it interrupts
+// on may have changed. it's only scheduled while it has interrupts on
+void uartChangeEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	system->uartChangeEvent = NO_EVENT;
+	syncUART(&system->peripherals.uart, when);
+	scheduleUARTChange(system, when);
+}
 
-#define EEPROM_BASE (1024*56)
-#define RAM_BASE    (1024*32)
-#define BANK_BASE   (1024*16)
+// returns nonzero if an event was scheduled
+int scheduleUARTChange(struct System *system, uint64_t now) {
+	struct UART *uart = &system->peripherals.uart;
+	if(!uart->interrupts) return 0;
+	uint64_t next = uartChange(uart);
+	if(next <= now || next >= system->uartChangeEvent) return 0;
+	reschedule(&system->scheduler, next, uartChangeEvent, system);
+	system->uartChangeEvent = next;
+	return 1;
+}
 
-struct Memory {
-	uint8_t eeprom[EEPROM_SIZE]; // mmap this?
-	uint8_t ram[RAM_SIZE];
-	uint8_t flash[FLASH_SIZE]; // mmap this?
-	uint8_t flashBank;
-};
+// see whether gdb attached or wants the cpu stopped, runUntil() stops it
+void debugEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	pollDebugger(system);
+	schedule(&system->scheduler, when + DEBUG_POLL_CYCLES, debugEvent, system);
+}
 
-uint8_t *addressDecode(struct Memory *memory, uint16_t addr) {
-	if(addr < BANK_BASE) // zero-page
-		return &memory->flash[addr];
-	else if(addr < RAM_BASE) // selected bank of flash
-		return &memory->flash[addr - BANK_SIZE*memory->flashBank];
-	else if(addr < EEPROM_BASE) // ram
-		return &memory->ram[addr - RAM_BASE];
-	else // eeprom
-		return &memory->eeprom[addr - EEPROM_BASE];
+// the vdc's command engine should be done by now, it only ever runs
+// when something looks so this makes its last writes land on time
+void commandEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	system->commandEvent = NO_EVENT;
+	runCommand(&system->peripherals.vdc, when);
+	scheduleCommand(system);
 }
 
+// returns nonzero if a command event was scheduled
+int scheduleCommand(struct System *system) {
+	uint64_t done = commandDone(&system->peripherals.vdc);
+	if(done >= system->commandEvent) return 0;
+	reschedule(&system->scheduler, done, commandEvent, system);
+	system->commandEvent = done;
+	return 1;
+}
 
+// the vdc got to the line its line interrupt is on, or to where it was
+// before r19 or r23 moved it later
+void lineEvent(void *data, uint64_t when) {
+	struct System *system = data;
+	struct VDC *vdc = &system->peripherals.vdc;
+	system->lineEvent = NO_EVENT;
+	if(nextLine(vdc, when - 1) == when) vdc->flags |= VDC_LINE;
+	scheduleLine(system, when);
+}
 
-/* IO */
+// returns nonzero if the line interrupt is now due sooner
+int scheduleLine(struct System *system, uint64_t now) {
+	uint64_t next = nextLine(&system->peripherals.vdc, now);
+	if(next >= system->lineEvent) return 0;
+	reschedule(&system->scheduler, next, lineEvent, system);
+	system->lineEvent = next;
+	return 1;
+}
 
-struct AY {
-	ayemu_ay_t ay;
-	uint8_t regs[14];
-	uint8_t latch;
-	ALLEGRO_AUDIO_STREAM *stream;
-	ALLEGRO_EVENT_QUEUE *queue;
-};
+// the clock jumped (a state was loaded), put the periodic events back
+// in line with it
+void rescheduleEvents(struct System *system) {
+	uint64_t now = system->cycles;
+	initScheduler(&system->scheduler);
+	if(listening(&system->peripherals.sound)) {
+		system->audioFragments = now * AUDIO_RATE / CPU_RATE / SAMPLES_PER_BUFFER;
+		schedule(&system->scheduler, fragmentCycle(system->audioFragments + 1),
+				audioEvent, system);
+	}
+	schedule(&system->scheduler, (now / VDC_FRAME_CYCLES + 1) * VDC_FRAME_CYCLES,
+			frameEvent, system);
+	schedule(&system->scheduler, (now / MEMORY_SYNC_CYCLES + 1) * MEMORY_SYNC_CYCLES,
+			memoryEvent, system);
+	schedule(&system->scheduler, now + UART_SERVICE_CYCLES, uartEvent, system);
+	if(system->debugger)
+		schedule(&system->scheduler, now + DEBUG_POLL_CYCLES, debugEvent, system);
+	system->commandEvent = NO_EVENT;
+	scheduleCommand(system);
+	system->lineEvent = NO_EVENT;
+	scheduleLine(system, now);
+	system->uartChangeEvent = NO_EVENT;
+	scheduleUARTChange(system, now);
+}
 
-struct Peripherals {
-	struct AY ay1;
-	struct AY ay2;
-	struct VDC vdc;
-};
+struct System *newSystem(int headless) {
+	struct System *system = calloc(1, sizeof(struct System));
+	system->cycles = 0;
+	system->headless = headless;
+	system->cpu.lazy.op = FLAGS_NONE;
+	system->stop.pcSentinel = -1;
+	initSound(&system->peripherals.sound, headless);
+	initVDC(&system->peripherals.vdc, headless);
+	initUART(&system->peripherals.uart);
+	initMemory(&system->memory);
+	initScheduler(&system->scheduler);
+	if(!headless) schedule(&system->scheduler, fragmentCycle(1), audioEvent, system);
+	schedule(&system->scheduler, VDC_FRAME_CYCLES, frameEvent, system);
+	schedule(&system->scheduler, MEMORY_SYNC_CYCLES, memoryEvent, system);
+	schedule(&system->scheduler, UART_SERVICE_CYCLES, uartEvent, system);
+	system->commandEvent = NO_EVENT;
+	system->lineEvent = NO_EVENT;
+	scheduleLine(system, 0);
+	system->uartChangeEvent = NO_EVENT;
+	return system;
+}
 
-void printAYRegisters(ayemu_ay_t *a) {
-	printf("\nAY REGS: A=%04d B=%04d C=%04d N=%02d R7=[%d%d%d%d%d%d] "
-			"\n   VOLS: A=%04d B=%04d C=%04d ENVFREQ=%d STYLE %d",
-			a->regs.tone_a, a->regs.tone_b, a->regs.tone_c, a->regs.noise,
-			a->regs.R7_tone_a, a->regs.R7_tone_b, a->regs.R7_tone_c,
-			a->regs.R7_noise_a, a->regs.R7_noise_b, a->regs.R7_noise_c,
-			a->regs.vol_a, a->regs.vol_b, a->regs.vol_c,
-			a->regs.env_freq, a->regs.env_style);
+void destroySystem(struct System *system) {
+	destroySound(&system->peripherals.sound);
+	destroyVDC(&system->peripherals.vdc);
+	destroyUART(&system->peripherals.uart);
+	destroyMemory(&system->memory);
+	if(system->rewind) destroyRewind(system->rewind);
+	if(system->blocks) destroyBlockCache(system->blocks);
+	if(system->shadow) destroySystem(system->shadow);
+	if(system->profile) destroyProfile(system->profile);
+	if(system->trace) destroyTrace(system->trace);
+	if(system->debugger) destroyDebugger(system->debugger);
+	if(system->recording) destroyRecording(system->recording);
+	free(system->stop.uartTail);
+	free(system);
 }
 
-void play(struct AY *ay) {
-	ALLEGRO_EVENT event;
-	while(al_get_next_event(ay->queue, &event)) {
-		if(event.type == ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT) {
-			uint8_t *buffer = al_get_audio_stream_fragment(ay->stream);
-			if(!buffer) continue;
-			ayemu_ay_t *a = &ay->ay;
-			ayemu_set_regs(a, ay->regs);
-			ayemu_gen_sound(a, buffer, BUFFER_LENGTH);
-			if(!al_set_audio_stream_fragment(ay->stream, buffer)) {
-				fprintf(stderr, "Error setting stream fragment buffer\n");
-				exit(1);
-			}
-#ifdef DEBUG_AY
-			printAYRegisters(a);
-#endif
-		}
+// a copy of the system that only ever interprets, for checking
+// compiled code against with -d
+struct System *newShadow(struct System *system) {
+	struct System *shadow = newSystem(1);
+	shadow->cpu = system->cpu;
+	shadow->cycles = system->cycles;
+	struct Memory *memory = &shadow->memory;
+	memcpy(memory->flash, system->memory.flash, FLASH_SIZE);
+	memcpy(memory->eeprom, system->memory.eeprom, EEPROM_SIZE);
+	memcpy(memory->ram, system->memory.ram, RAM_SIZE);
+	setFlashBank(memory, system->memory.flashBank);
+	for(int i = 0; i < AY_CHIPS; i++) {
+		struct AY *from = &system->peripherals.sound.chips[i];
+		struct AY *to = &shadow->peripherals.sound.chips[i];
+		to->latch = from->latch;
+		memcpy(to->regs, from->regs, AY_REGS);
 	}
+	struct VDC *vdc = &shadow->peripherals.vdc;
+	*vdc = system->peripherals.vdc;
+	vdc->renderer = NULL;
+	struct UART *uart = &shadow->peripherals.uart;
+	*uart = system->peripherals.uart;
+	// a shadow's uart goes nowhere
+	uart->out = uart->in = uart->listener = -1;
+	uart->path = NULL;
+	uart->sink = NULL;
+	uart->source = NULL;
+	uart->tap = NULL;
+	rescheduleEvents(shadow);
+	return shadow;
 }
 
-void initAY(struct AY* ay) {
-	ayemu_init(&ay->ay);
-	ay->stream = al_create_audio_stream(
-			AUDIO_BUFFER_FRAGS,
-			SAMPLES_PER_BUFFER,
-			AUDIO_RATE,
-			AUDIO_DEPTH,
-			AUDIO_CHANNELS);
-	if(!ay->stream)
-		fprintf(stderr, "Could not create audio stream\n");
-	else if (!al_attach_audio_stream_to_mixer(ay->stream, al_get_default_mixer()))
-		fprintf(stderr, "Could not attach audio stream to mixer\n");
-	else {
-		ay->queue = al_create_event_queue();
-		al_register_event_source(ay->queue, al_get_audio_stream_event_source(ay->stream));
-		return;
-	}
-	exit(1);
+void setUARTPattern(struct System *system, const char *pattern) {
+	struct StopConditions *stop = &system->stop;
+	stop->uartPattern = pattern;
+	stop->uartPatternLength = strlen(pattern);
+	stop->uartTail = calloc(stop->uartPatternLength + 1, 1);
 }
 
-void destroyAY(struct AY* ay) {
-	al_drain_audio_stream(ay->stream);
-	al_destroy_event_queue(ay->queue);
-	al_destroy_audio_stream(ay->stream);
+// whether a run has hit its pc sentinel or uart pattern, or can't go on
+int stopped(struct System *system) {
+	return system->cpu.regs.pc == system->stop.pcSentinel
+		|| system->stop.uartMatched
+		|| system->stop.killed
+		|| system->stop.crashed
+		|| system->stop.diverged;
 }
 
+// watch the uart output for the stop pattern
+void matchUART(struct System *system, uint8_t data) {
+	struct StopConditions *stop = &system->stop;
+	if(!stop->uartPattern || !stop->uartPatternLength) return;
+	memmove(stop->uartTail, stop->uartTail+1, stop->uartPatternLength-1);
+	stop->uartTail[stop->uartPatternLength-1] = data;
+	if(!memcmp(stop->uartTail, stop->uartPattern, stop->uartPatternLength))
+		stop->uartMatched = 1;
+}
 
 
-/* SYSTEM */
 
-struct System {
-	struct CPUState cpu;
-	struct Memory memory;
-	struct Peripherals peripherals;
-	int cycles;
-};
+/* INTERRUPTS */
 
-// return the amount of emulated nanoseconds passed since the system has started
-long int systemNanos(struct System *system) {
-	return (long)1000000000 * system->cycles / CPU_RATE;
+// the im 2 vector of the highest priority source holding INT low, -1 if
+// none is
+int pendingInterrupt(struct System *system) {
+	int vdc = vdcInterrupt(&system->peripherals.vdc);
+	struct UART *uart = &system->peripherals.uart;
+	if(vdc & VDC_LINE) return VECTOR_LINE;
+	if(vdc & VDC_VBLANK) return VECTOR_VBLANK;
+	if(!(uart->interrupts & UART_INT_NMI) && uartInterrupt(uart)) return VECTOR_UART;
+	return -1;
 }
 
-struct System *newSystem() {
-	struct System *system = malloc(sizeof(struct System));
-	system->cycles = 0;
-	initAY(&system->peripherals.ay1);
-	initAY(&system->peripherals.ay2);
-	initVDC(&system->peripherals.vdc);
-	return system;
+// the uart is the only thing that can be wired to the nmi. a real z80 takes
+// one on the line's rising edge, this takes one while it's high and then
+// not again until retn, which comes to the same for a handler that deals
+// with what it was interrupted for
+int nmiDue(struct System *system) {
+	struct UART *uart = &system->peripherals.uart;
+	return !system->cpu.interrupts.inNMI && uart->interrupts & UART_INT_NMI
+		&& uartInterrupt(uart);
 }
 
-void destroySystem(struct System *system) {
-	destroyAY(&system->peripherals.ay1);
-	destroyAY(&system->peripherals.ay2);
-	destroyVDC(&system->peripherals.vdc);
-	free(system);
+// whether takeInterrupts() has something to take, so the slice should end
+int interruptDue(struct System *system) {
+	return (system->cpu.interrupts.iff1 && pendingInterrupt(system) >= 0)
+		|| nmiDue(system);
+}
+
+// the accesses the cpu makes outside of any instruction, traced and
+// watched like the ones in them
+uint8_t interruptRead(struct System *system, uint16_t addr) {
+	uint8_t data = system->memory.readPages[addr >> PAGE_SHIFT][addr & PAGE_MASK];
+	if(system->trace) traceData(system->trace, TRACE_READ, system->cycles, addr, data);
+	if(system->debugger) watchHit(system->debugger, 0, addr);
+	return data;
+}
+
+void pushByte(struct System *system, uint8_t data) {
+	struct Memory *memory = &system->memory;
+	uint16_t addr = --system->cpu.regs.sp;
+	uint8_t *page = memory->writePages[addr >> PAGE_SHIFT];
+	if(page) page[addr & PAGE_MASK] = data;
+	else writeTrap(memory, addr, data);
+	if(system->trace) traceData(system->trace, TRACE_WRITE, system->cycles, addr, data);
+	if(system->debugger) watchHit(system->debugger, 1, addr);
+}
+
+// push the pc and jump, taking cycles
+void enterInterrupt(struct System *system, uint16_t addr, int cycles) {
+	struct CPUState *cpu = &system->cpu;
+	struct Trace *trace = system->trace;
+	if(trace) {
+		struct TraceRecord *record = traceRecord(trace, TRACE_INTERRUPT, system->cycles);
+		record->addr = addr;
+		record->words[0] = cpu->regs.pc;
+	}
+	system->cycles += cycles;
+	pushByte(system, cpu->regs.pc >> 8);
+	pushByte(system, cpu->regs.pc);
+	if(system->profile)
+		profileInterrupt(system->profile, &system->memory, addr, cpu->regs.sp, cycles);
+	if(trace) {
+		getFlags(cpu);
+		traceRegs(trace, system->cycles, &cpu->regs, cpu->regs.sp);
+	}
+	cpu->regs.pc = addr;
+	cpu->interrupts.halted = 0;
+}
+
+// take an nmi or an interrupt if one is due, returns nonzero if it did.
+// only events and instructions that end the slice early can make one due,
+// so this only has to be done between slices and they're still taken at
+// exactly the right instruction
+int takeInterrupts(struct System *system) {
+	struct Interrupts *interrupts = &system->cpu.interrupts;
+	if(nmiDue(system)) {
+		interrupts->inNMI = 1;
+		interrupts->iff1 = 0;
+		enterInterrupt(system, 0x66, 11);
+		return 1;
+	}
+	if(!interrupts->iff1 || system->cycles == interrupts->eiDone) return 0;
+	int vector = pendingInterrupt(system);
+	if(vector < 0) return 0;
+	interrupts->iff1 = interrupts->iff2 = 0;
+	if(interrupts->mode == 2) {
+		uint16_t table = system->cpu.regs.i << 8 | vector;
+		uint16_t addr = interruptRead(system, table)
+			| interruptRead(system, table+1) << 8;
+		enterInterrupt(system, addr, 19);
+	} else enterInterrupt(system, 0x38, 13);
+	return 1;
 }
 
 
 
 /* CPU CONTROL */
 
-#define C_FLAG  (1)
-#define N_FLAG  (1 << 1)
-#define PV_FLAG (1 << 2)
-#define H_FLAG  (1 << 4)
-#define Z_FLAG  (1 << 6)
-#define S_FLAG  (1 << 7)
+uint8_t szpFlags[256];
+uint8_t incFlags[256];
+uint8_t decFlags[256];
+uint8_t addFlags[2][256][256]; // [carry in][pre][post]
+uint8_t subFlags[2][256][256]; // [borrow in][pre][post]
+
+void initFlagTables() {
+	for(int n = 0; n < 256; n++) {
+		int sz = (n & S_FLAG) | (n ? 0 : Z_FLAG);
+		int p = n;
+		p ^= p >> 4;
+		p ^= p >> 2;
+		p ^= p >> 1;
+		szpFlags[n] = sz | ((p & 1) ? 0 : PV_FLAG);
+		incFlags[n] = sz
+			| ((n & 0xf) == 0x0 ? H_FLAG : 0)
+			| (n == 0x80 ? PV_FLAG : 0);
+		decFlags[n] = sz | N_FLAG
+			| ((n & 0xf) == 0xf ? H_FLAG : 0)
+			| (n == 0x7f ? PV_FLAG : 0);
+	}
+	for(int c = 0; c < 2; c++)
+		for(int pre = 0; pre < 256; pre++)
+			for(int post = 0; post < 256; post++) {
+				int sz = szpFlags[post] & (S_FLAG | Z_FLAG);
+				// recover the operand from the result
+				int val = (post - pre - c) & 0xff;
+				addFlags[c][pre][post] = sz
+					| (pre + val + c > 0xff ? C_FLAG : 0)
+					| ((pre & 0xf) + (val & 0xf) + c > 0xf ? H_FLAG : 0)
+					| (~(pre ^ val) & (pre ^ post) & 0x80 ? PV_FLAG : 0);
+				val = (pre - post - c) & 0xff;
+				subFlags[c][pre][post] = sz | N_FLAG
+					| (pre - val - c < 0 ? C_FLAG : 0)
+					| ((pre & 0xf) - (val & 0xf) - c < 0 ? H_FLAG : 0)
+					| ((pre ^ val) & (pre ^ post) & 0x80 ? PV_FLAG : 0);
+			}
+}
+
+// bring F up to date and return it
+uint8_t getFlags(struct CPUState *cpu) {
+	struct LazyFlags *lazy = &cpu->lazy;
+	switch(lazy->op) {
+		case FLAGS_NONE:
+			return cpu->regs.main.f;
+		case FLAGS_ADD:
+			cpu->regs.main.f = addFlags[lazy->carry][lazy->pre][lazy->post];
+			break;
+		case FLAGS_SUB:
+			cpu->regs.main.f = subFlags[lazy->carry][lazy->pre][lazy->post];
+			break;
+		case FLAGS_INC:
+			cpu->regs.main.f = incFlags[lazy->post] | lazy->keep;
+			break;
+		case FLAGS_DEC:
+			cpu->regs.main.f = decFlags[lazy->post] | lazy->keep;
+			break;
+		case FLAGS_LOGIC:
+			cpu->regs.main.f = szpFlags[lazy->post];
+			break;
+		case FLAGS_AND:
+			cpu->regs.main.f = szpFlags[lazy->post] | H_FLAG;
+			break;
+	}
+	lazy->op = FLAGS_NONE;
+	return cpu->regs.main.f;
+}
 
-#define GET_FLAG(F)   ((cpu->regs.main.f & F) != 0)
-#define SET_FLAG(F)   (cpu->regs.main.f |= F)
-#define RESET_FLAG(F) (cpu->regs.main.f &= ~F)
+#define GET_FLAG(F)   ((getFlags(cpu) & F) != 0)
 
 #define GET_C  GET_FLAG(C_FLAG)
 #define GET_N  GET_FLAG(N_FLAG)
@@ -265,24 +463,25 @@ void destroySystem(struct System *system) {
 #define GET_Z  GET_FLAG(Z_FLAG)
 #define GET_S  GET_FLAG(S_FLAG)
 
-#define SET_C(N)  ((N) ? SET_FLAG(C_FLAG)  : RESET_FLAG(C_FLAG))
-#define SET_N(N)  ((N) ? SET_FLAG(N_FLAG)  : RESET_FLAG(N_FLAG))
-#define SET_PV(N) ((N) ? SET_FLAG(PV_FLAG) : RESET_FLAG(PV_FLAG))
-#define SET_H(N)  ((N) ? SET_FLAG(H_FLAG)  : RESET_FLAG(H_FLAG))
-#define SET_Z(N)  ((N) ? SET_FLAG(Z_FLAG)  : RESET_FLAG(Z_FLAG))
-#define SET_S(N)  ((N) ? SET_FLAG(S_FLAG)  : RESET_FLAG(S_FLAG))
-
-#define SET_CARRY(PRE, POST)       SET_C(carry(PRE, POST, 7))
-#define SET_BORROW(PRE, POST)      SET_C(borrow(PRE, POST, 7))
-#define SET_ADD                    SET_N(0)
-#define SET_SUBTRACT               SET_N(1)
-#define SET_PARITY(VALUE)          SET_PV(parity(VALUE))
-#define SET_OVERFLOW(PRE, POST)    SET_PV(carry(PRE, POST, 7))
-#define SET_UNDERFLOW(PRE, POST)   SET_PV(borrow(PRE, POST, 7))
-#define SET_HALF_CARRY(PRE, POST)  SET_H(carry(PRE, POST, 3))
-#define SET_HALF_BORROW(PRE, POST) SET_H(borrow(PRE, POST, 3))
-#define SET_ZERO(VALUE)            SET_Z(!VALUE)
-#define SET_SIGNED(VALUE)          SET_S(VALUE & (1 << 7))
+// overwrite all of F at once
+#define SET_F(VALUE) (cpu->lazy.op = FLAGS_NONE, cpu->regs.main.f = (VALUE))
+
+// record an op so its flags can be worked out later
+#define LAZY_FLAGS(OP, PRE, POST, CARRY) (  \
+		cpu->lazy.op = (OP),        \
+		cpu->lazy.pre = (PRE),      \
+		cpu->lazy.post = (POST),    \
+		cpu->lazy.carry = (CARRY))
+
+#define FLAGS_ADD8(PRE, POST, CARRY) LAZY_FLAGS(FLAGS_ADD, PRE, POST, CARRY)
+#define FLAGS_SUB8(PRE, POST, CARRY) LAZY_FLAGS(FLAGS_SUB, PRE, POST, CARRY)
+#define FLAGS_LOGIC8(POST)           LAZY_FLAGS(FLAGS_LOGIC, 0, POST, 0)
+#define FLAGS_AND8(POST)             LAZY_FLAGS(FLAGS_AND, 0, POST, 0)
+// inc and dec leave the carry alone so that has to be kept from before
+#define FLAGS_INC8(POST) (cpu->lazy.keep = getFlags(cpu) & C_FLAG, \
+		LAZY_FLAGS(FLAGS_INC, 0, POST, 0))
+#define FLAGS_DEC8(POST) (cpu->lazy.keep = getFlags(cpu) & C_FLAG, \
+		LAZY_FLAGS(FLAGS_DEC, 0, POST, 0))
 
 // print the state of the cpu for debug or whatever
 void printState(struct CPUState *cpu) {
@@ -309,93 +508,124 @@ void printState(struct CPUState *cpu) {
 }
 
 // log n T cycles
-void cycles(int cycles, struct System *system) {
-	system->cycles += cycles;
+static inline void cycles(int cycles, struct Core *core) {
+	core->cycles += cycles;
+}
+
+// stop the current time slice after this instruction
+static inline void endSlice(struct Core *core) {
+	core->end = core->cycles;
 }
 
-void out(struct System *system, uint16_t port, uint8_t data) {
+// write the locals back so the rest of the system can see them
+static inline void syncCore(struct Core *core) {
+	core->cpu->regs.pc = core->pc;
+	core->cpu->regs.sp = core->sp;
+	core->system->cycles = core->cycles;
+}
+
+// returns nonzero if the cpu should stop for the rest of the slice
+// because something was scheduled or a stop condition was hit
+int out(struct System *system, uint64_t cycles, uint16_t port, uint8_t data) {
 	struct Peripherals *peripherals = &system->peripherals;
-	cycles(4, system);
 #ifdef DEBUG_IO
 	printf("\n[OUT] @0x%04x = 0x%02x", port, data);
 #endif
-	// ay 1
-	if(port == 0)
-		peripherals->ay1.latch = data;
-	else if(port == 1)
-		peripherals->ay1.regs[peripherals->ay1.latch] = data;
-	// ay 2
-	else if(port == 2)
-		peripherals->ay2.latch = data;
-	else if(port == 3)
-		peripherals->ay2.regs[peripherals->ay2.latch] = data;
+	// ay 1 and 2
+	if(port < 4 && !(port & 1))
+		ayLatch(&peripherals->sound, port >> 1, data);
+	else if(port < 4)
+		ayWrite(&peripherals->sound, cycles, port >> 1, data);
 	// vdc
-	else if(port >= 4 && port < 8)
-		vdcWrite(&peripherals->vdc, port-4, data);
+	else if(port >= 4 && port < 8) {
+		vdcWrite(&peripherals->vdc, cycles, port-4, data);
+		// a register can move the line interrupt or enable one that's waiting
+		return scheduleCommand(system) | (port != 4 && scheduleLine(system, cycles))
+			| interruptDue(system);
+	}
 	// uart
-	else if(port == 8)
-		putchar(data);
-	else fprintf(stderr, "Writing to undefined I/O port 0x%04x\n", port);
+	else if(port == 8) {
+		uartWrite(&peripherals->uart, cycles, data);
+		matchUART(system, data);
+		return system->stop.uartMatched | scheduleUARTChange(system, cycles);
+	} else if(port == 9) {
+		uartEnable(&peripherals->uart, cycles, data);
+		scheduleUARTChange(system, cycles);
+		return interruptDue(system);
+	} else fprintf(stderr, "Writing to undefined I/O port 0x%04x\n", port);
+	return 0;
 }
 
-uint8_t in(struct System *system, uint16_t port) {
+uint8_t in(struct System *system, uint64_t cycles, uint16_t port) {
 	struct Peripherals *peripherals = &system->peripherals;
-	cycles(4, system);
 #ifdef DEBUG_IO
 	printf("\n[IN] @0x%04x", port);
 #endif
-	// ay 1
-	if(port == 0)
-		fprintf(stderr, "Reading from read-only I/O port 0x%04x\n", port);
-	else if(port == 1)
-		return peripherals->ay1.regs[peripherals->ay1.latch];
-	// ay 2
-	else if(port == 2)
+	// ay 1 and 2
+	if(port < 4 && !(port & 1))
 		fprintf(stderr, "Reading from read-only I/O port 0x%04x\n", port);
-	else if(port == 3)
-		return peripherals->ay2.regs[peripherals->ay2.latch];
+	else if(port < 4)
+		return ayRead(&peripherals->sound, port >> 1);
 	// vdc
 	else if(port >= 4 && port < 8)
-		return vdcRead(&peripherals->vdc, port-4);
-	// uart
-	else if(port == 8)
-		fprintf(stderr, "Reading from read-only I/O port 0x%04x\n", port);
-	else fprintf(stderr, "Reading from undefined I/O port 0x%04x\n", port);
+		return vdcRead(&peripherals->vdc, cycles, port-4);
+	// uart, reading it can change when it next interrupts
+	else if(port == 8 || port == 9) {
+		uint8_t data = port == 8 ? uartRead(&peripherals->uart, cycles)
+			: uartStatus(&peripherals->uart, cycles);
+		scheduleUARTChange(system, cycles);
+		return data;
+	} else fprintf(stderr, "Reading from undefined I/O port 0x%04x\n", port);
 	return 0;
 }
 
-void writeByte(struct System *system, uint16_t addr, uint8_t data) {
-	cycles(3, system);
-	if(addr < RAM_BASE) // flash bank latch
-		system->memory.flashBank = data;
-	else *addressDecode(&system->memory, addr) = data;
+// the first cycle after an in() of port at cycles gave value that doing it
+// again could give something else or change something, cycles if that's
+// straight away. events aren't counted, nothing waits past the slice
+uint64_t portQuiet(struct System *system, uint16_t port, uint8_t value,
+		uint64_t cycles) {
+	struct Peripherals *peripherals = &system->peripherals;
+	if(port < 4 && (port & 1))
+		return ayRead(&peripherals->sound, port >> 1) == value ? NO_EVENT : cycles;
+	else if(port >= 4 && port < 8)
+		return vdcQuiet(&peripherals->vdc, port-4, value, cycles);
+	else if(port == 8 || port == 9)
+		return uartQuiet(&peripherals->uart, port == 9, value, cycles);
+	return cycles;
 }
 
-uint8_t readByte(struct System *system, uint16_t addr) {
-	cycles(3, system);
-	return *addressDecode(&system->memory, addr);
+// kept out of line so the accesses below stay small when not tracing
+// or watching, a watchpoint stops the cpu right after the instruction
+static void __attribute__((noinline, cold)) watchAccess(struct Core *core,
+		int type, uint16_t addr, uint8_t data) {
+	struct Debugger *debugger = core->system->debugger;
+	if(core->trace) traceData(core->trace, type, core->cycles, addr, data);
+	if(debugger && watchHit(debugger, type == TRACE_WRITE, addr)) endSlice(core);
 }
 
-uint16_t readWord(struct System *system, uint16_t addr) {
-	cycles(6, system);
-	return *addressDecode(&system->memory, addr);
+// memory accesses, their T cycles are counted with the rest of the
+// instruction's when it's decoded
+static inline void writeByte(struct Core *core, uint16_t addr, uint8_t data) {
+	uint8_t *page = core->memory->writePages[addr >> PAGE_SHIFT];
+	if(__builtin_expect(core->watching, 0))
+		watchAccess(core, TRACE_WRITE, addr, data);
+	if(page) page[addr & PAGE_MASK] = data;
+	else writeTrap(core->memory, addr, data);
 }
 
-uint8_t fetchByte(struct System *system) {
-	return readByte(system, system->cpu.regs.pc++);
+static inline uint8_t readByte(struct Core *core, uint16_t addr) {
+	uint8_t data = core->memory->readPages[addr >> PAGE_SHIFT][addr & PAGE_MASK];
+	if(__builtin_expect(core->watching, 0))
+		watchAccess(core, TRACE_READ, addr, data);
+	return data;
 }
 
-uint16_t fetchWord(struct System *system) {
-	uint8_t low = fetchByte(system);
-	uint8_t high = fetchByte(system);
+static inline uint16_t readWord(struct Core *core, uint16_t addr) {
+	uint8_t low = readByte(core, addr);
+	uint8_t high = readByte(core, addr+1);
 	return low + (high << 8);
 }
 
-uint8_t fetchOpcode(struct System *system) {
-	cycles(1, system);
-	return fetchByte(system);
-}
-
 void swapByte(uint8_t *a, uint8_t *b) {
 	uint8_t tmp = *a;
 	*a = *b;
@@ -414,377 +644,583 @@ void swapRegs(struct CPUState *cpu) {
 	cpu->regs.alt = tmp;
 }
 
-int parity(int n) {
-	int parity = 0;
-	while(n) {
-		parity = !parity;
-		n &= n - 1;
+// strictly, that's the end of the run, but only this system's
+void unknownOpcode(struct Core *core, int opcode) {
+	fprintf(stderr, "[WARNING] Unknown opcode: 0x%x\n", opcode);
+#ifdef STRICT
+	core->system->stop.crashed = 1;
+	endSlice(core);
+#endif
+}
+
+// move on to the next op, each handler ends with this so the jump to
+// the next one is its own rather than all going through one switch
+#ifdef DEBUG
+#define NEXT_OP()                                                         \
+	if(next == last) {                                                \
+		core->pc = pc;                                            \
+		return;                                                   \
+	}                                                                 \
+	printf("\n@addr 0x%04x: got op 0x%03x", pc, next->id);            \
+	op = next++;                                                      \
+	pc = op->next;                                                    \
+	goto *op->handler;
+#else
+#define NEXT_OP()                                                         \
+	if(next == last) {                                                \
+		core->pc = pc;                                            \
+		return;                                                   \
+	}                                                                 \
+	op = next++;                                                      \
+	pc = op->next;                                                    \
+	goto *op->handler;
+#endif
+
+// run count decoded instructions, their cycles have to be counted first
+// only the last of them can be io so it still happens at the right time
+// with no core it fills in the ops' handler pointers instead, they're
+// the addresses of the labels below so only this can know them
+static void runOps(struct Core *core, struct Op *ops, int count) {
+	static const void *handlers[OP_IDS] = {
+		[0 ... OP_IDS-1] = &&unknown,
+		[0x00] = &&x00, [0x01] = &&x01, [0x02] = &&x02, [0x03] = &&x03,
+		[0x04] = &&x04, [0x05] = &&x05, [0x06] = &&x06, [0x07] = &&x07,
+		[0x08] = &&x08, [0x09] = &&x09, [0x0a] = &&x0a, [0x0b] = &&x0b,
+		[0x0c] = &&x0c, [0x0d] = &&x0d, [0x0e] = &&x0e, [0x0f] = &&x0f,
+		[0x11] = &&x11, [0x17] = &&x17, [0x1f] = &&x1f, [0x31] = &&x31,
+		[0x3c] = &&x3c, [0x3d] = &&x3d, [0x3e] = &&x3e,
+		[0x47] = &&x47, [0x4f] = &&x4f,
+		[0x60] = &&x60, [0x67] = &&x67, [0x69] = &&x69, [0x6f] = &&x6f,
+		[0x76] = &&x76,
+		[0x78] = &&x78, [0x79] = &&x79, [0x7a] = &&x7a, [0x7b] = &&x7b,
+		[0xb7] = &&xb7,
+		[0xc2] = &&xc2, [0xc3] = &&xc3, [0xc6] = &&xc6, [0xc9] = &&xc9,
+		[0xca] = &&xca, [0xcd] = &&xcd,
+		[0xd3] = &&xd3, [0xdb] = &&xdb, [0xe6] = &&xe6,
+		[0xf1] = &&xf1, [0xf3] = &&xf3, [0xf5] = &&xf5, [0xfb] = &&xfb,
+		[0xfe] = &&xfe,
+		[ID_CB | 0x1a] = &&xcb1a, [ID_CB | 0x1b] = &&xcb1b,
+		[ID_DD | 0x21] = &&xdd21, [ID_DD | 0x23] = &&xdd23,
+		[ID_DD | 0x7c] = &&xdd7c, [ID_DD | 0x7d] = &&xdd7d,
+		[ID_DD | 0x7e] = &&xdd7e,
+		[ID_ED | 0x45] = &&xed45, [ID_ED | 0x46] = &&xed46,
+		[ID_ED | 0x47] = &&xed47, [ID_ED | 0x4d] = &&xed4d,
+		[ID_ED | 0x52] = &&xed52, [ID_ED | 0x56] = &&xed56,
+		[ID_ED | 0x57] = &&xed57, [ID_ED | 0x5e] = &&xed5e,
+	};
+	if(!core) {
+		for(int i = 0; i < count; i++)
+			ops[i].handler = handlers[ops[i].id];
+		return;
 	}
-	return parity;
+
+	struct CPUState *cpu = core->cpu;
+	struct Op *op, *next = ops, *last = ops + count;
+	uint16_t pc = core->pc;
+	int pre, post, c, arg;
+	NEXT_OP();
+
+	// all the opcodes lol
+	x00: // nop
+		NEXT_OP();
+	x01: // ld bc,**
+		cpu->regs.main.bc = op->arg;
+		NEXT_OP();
+	x02: // ld (bc),a
+		writeByte(core, cpu->regs.main.bc, cpu->regs.main.a);
+		NEXT_OP();
+	x03: // inc bc
+		cpu->regs.main.bc++;
+		NEXT_OP();
+	x04: // inc b
+		post = ++cpu->regs.main.b;
+		FLAGS_INC8(post);
+		NEXT_OP();
+	x05: // dec b
+		post = --cpu->regs.main.b;
+		FLAGS_DEC8(post);
+		NEXT_OP();
+	x06: // ld b,*
+		cpu->regs.main.b = op->arg;
+		NEXT_OP();
+	x07: // rlca
+		c = (cpu->regs.main.a & (1 << 7)) >> 7;
+		cpu->regs.main.a <<= 1;
+		cpu->regs.main.a |= c;
+		SET_F((getFlags(cpu) & (S_FLAG | Z_FLAG | PV_FLAG)) | c);
+		NEXT_OP();
+	x08: // ex af,af'
+		getFlags(cpu);
+		swapWord(&cpu->regs.main.af, &cpu->regs.alt.af);
+		NEXT_OP();
+	x09: // add hl,bc
+		pre = cpu->regs.main.hl;
+		arg = cpu->regs.main.bc;
+		post = pre + arg;
+		cpu->regs.main.hl = post;
+		SET_F((getFlags(cpu) & (S_FLAG | Z_FLAG | PV_FLAG))
+			| (post > 0xffff ? C_FLAG : 0)
+			| ((pre ^ arg ^ post) & 0x1000 ? H_FLAG : 0));
+		NEXT_OP();
+	x0a: // ld a,(bc)
+		cpu->regs.main.a = readByte(core, cpu->regs.main.bc);
+		NEXT_OP();
+	x0b: // dec bc
+		cpu->regs.main.bc--;
+		NEXT_OP();
+	x0c: // inc c
+		post = ++cpu->regs.main.c;
+		FLAGS_INC8(post);
+		NEXT_OP();
+	x0d: // dec c
+		post = --cpu->regs.main.c;
+		FLAGS_DEC8(post);
+		NEXT_OP();
+	x0e: // ld c,*
+		cpu->regs.main.c = op->arg;
+		NEXT_OP();
+	x0f: // rrca
+		c = cpu->regs.main.a & 1;
+		cpu->regs.main.a >>= 1;
+		cpu->regs.main.a |= c << 7;
+		SET_F((getFlags(cpu) & (S_FLAG | Z_FLAG | PV_FLAG)) | c);
+		NEXT_OP();
+	x11: // ld de,**
+		cpu->regs.main.de = op->arg;
+		NEXT_OP();
+	x17: // rla
+		c = (cpu->regs.main.a & (1 << 7)) >> 7;
+		cpu->regs.main.a <<= 1;
+		cpu->regs.main.a |= GET_C;
+		SET_F((getFlags(cpu) & (S_FLAG | Z_FLAG | PV_FLAG)) | c);
+		NEXT_OP();
+	x1f: // rra
+		c = cpu->regs.main.a & 1;
+		cpu->regs.main.a >>= 1;
+		cpu->regs.main.a |= GET_C << 7;
+		SET_F((getFlags(cpu) & (S_FLAG | Z_FLAG | PV_FLAG)) | c);
+		NEXT_OP();
+	x31: // ld sp,**
+		core->sp = op->arg;
+		NEXT_OP();
+	x3c: // inc a
+		post = ++cpu->regs.main.a;
+		FLAGS_INC8(post);
+		NEXT_OP();
+	x3d: // dec a
+		post = --cpu->regs.main.a;
+		FLAGS_DEC8(post);
+		NEXT_OP();
+	x3e: // ld a,*
+		cpu->regs.main.a = op->arg;
+		NEXT_OP();
+	x47: // ld b,a
+		cpu->regs.main.b = cpu->regs.main.a;
+		NEXT_OP();
+	x4f: // ld c,a
+		cpu->regs.main.c = cpu->regs.main.a;
+		NEXT_OP();
+	x60: // ld h,b
+		cpu->regs.main.h = cpu->regs.main.b;
+		NEXT_OP();
+	x67: // ld h,a
+		cpu->regs.main.h = cpu->regs.main.a;
+		NEXT_OP();
+	x69: // ld l,c
+		cpu->regs.main.l = cpu->regs.main.c;
+		NEXT_OP();
+	x6f: // ld l,a
+		cpu->regs.main.l = cpu->regs.main.a;
+		NEXT_OP();
+	x76: // halt
+		// nops from here until an interrupt, see runCycles()
+		cpu->interrupts.halted = 1;
+		endSlice(core);
+		NEXT_OP();
+	x78: // ld a,b
+		cpu->regs.main.a = cpu->regs.main.b;
+		NEXT_OP();
+	x79: // ld a,c
+		cpu->regs.main.a = cpu->regs.main.c;
+		NEXT_OP();
+	x7a: // ld a,d
+		cpu->regs.main.a = cpu->regs.main.d;
+		NEXT_OP();
+	x7b: // ld a,e
+		cpu->regs.main.a = cpu->regs.main.e;
+		NEXT_OP();
+	xb7: // or a
+		pre = cpu->regs.main.a;
+		post = pre | pre;
+		cpu->regs.main.a = post;
+		FLAGS_LOGIC8(post);
+		NEXT_OP();
+	xc2: // jp nz,**
+		if(!GET_Z) pc = op->arg;
+		NEXT_OP();
+	xc3: // jp **
+		pc = op->arg;
+		NEXT_OP();
+	xc6: // add a,*
+		pre = cpu->regs.main.a;
+		cpu->regs.main.a += op->arg;
+		post = cpu->regs.main.a;
+		FLAGS_ADD8(pre, post, 0);
+		NEXT_OP();
+	xc9: // ret
+		pc = readWord(core, core->sp);
+		core->sp += 2;
+		NEXT_OP();
+	xca: // jp z,**
+		if(GET_Z) pc = op->arg;
+		NEXT_OP();
+	xcb1a: // rr d
+		c = cpu->regs.main.d & 1;
+		cpu->regs.main.d >>= 1;
+		cpu->regs.main.d |= GET_C << 7;
+		post = cpu->regs.main.d;
+		SET_F(szpFlags[post] | c);
+		NEXT_OP();
+	xcb1b: // rr e
+		c = cpu->regs.main.e & 1;
+		cpu->regs.main.e >>= 1;
+		cpu->regs.main.e |= GET_C << 7;
+		post = cpu->regs.main.e;
+		SET_F(szpFlags[post] | c);
+		NEXT_OP();
+	xcd: // call **
+		writeByte(core, --core->sp, pc >> 8);
+		writeByte(core, --core->sp, pc);
+		pc = op->arg;
+		NEXT_OP();
+	xd3: // out (*),a
+		if(out(core->system, core->cycles, op->arg, cpu->regs.main.a))
+			endSlice(core);
+		NEXT_OP();
+	xdb: // in a,(*)
+		cpu->regs.main.a = in(core->system, core->cycles, op->arg);
+		// reading the uart can bring its next interrupt closer
+		if(nextEvent(&core->system->scheduler) < core->end) endSlice(core);
+		NEXT_OP();
+	xdd21: // ld ix,**
+		cpu->regs.ix = op->arg;
+		NEXT_OP();
+	xdd23: // inc ix
+		cpu->regs.ix++;
+		NEXT_OP();
+	xdd7c: // ld a,ixh
+		cpu->regs.main.a = cpu->regs.ixh;
+		NEXT_OP();
+	xdd7d: // ld a,ixl
+		cpu->regs.main.a = cpu->regs.ixl;
+		NEXT_OP();
+	xdd7e: // ld a,(ix+*)
+		cpu->regs.main.a = readByte(core, op->arg + cpu->regs.ix);
+		NEXT_OP();
+	xe6: // and *
+		pre = cpu->regs.main.a;
+		post = pre & op->arg;
+		cpu->regs.main.a = post;
+		FLAGS_AND8(post);
+		NEXT_OP();
+	xed45: // retn
+		cpu->interrupts.inNMI = 0;
+		// and the rest is the same as reti
+	xed4d: // reti
+		pc = readWord(core, core->sp);
+		core->sp += 2;
+		cpu->interrupts.iff1 = cpu->interrupts.iff2;
+		if(interruptDue(core->system)) endSlice(core);
+		NEXT_OP();
+	xed46: // im 0
+		cpu->interrupts.mode = 0;
+		NEXT_OP();
+	xed47: // ld i,a
+		cpu->regs.i = cpu->regs.main.a;
+		NEXT_OP();
+	xed52: // sbc hl,de
+		pre = cpu->regs.main.hl;
+		arg = cpu->regs.main.de;
+		post = pre - arg - GET_C;
+		cpu->regs.main.hl = post;
+		SET_F(N_FLAG
+			| (post < 0 ? C_FLAG : 0)
+			| ((pre ^ arg ^ post) & 0x1000 ? H_FLAG : 0)
+			| ((pre ^ arg) & (pre ^ post) & 0x8000 ? PV_FLAG : 0)
+			| (post & 0xffff ? 0 : Z_FLAG)
+			| (post & 0x8000 ? S_FLAG : 0));
+		NEXT_OP();
+	xed56: // im 1
+		cpu->interrupts.mode = 1;
+		NEXT_OP();
+	xed57: // ld a,i
+		c = getFlags(cpu) & C_FLAG;
+		post = cpu->regs.main.a = cpu->regs.i;
+		SET_F(c | (szpFlags[post] & (S_FLAG | Z_FLAG))
+			| (cpu->interrupts.iff2 ? PV_FLAG : 0));
+		NEXT_OP();
+	xed5e: // im 2
+		cpu->interrupts.mode = 2;
+		NEXT_OP();
+	xf1: // pop af
+		cpu->regs.main.f = readByte(core, core->sp++);
+		cpu->regs.main.a = readByte(core, core->sp++);
+		cpu->lazy.op = FLAGS_NONE;
+		NEXT_OP();
+	xf3: // di
+		cpu->interrupts.iff1 = cpu->interrupts.iff2 = 0;
+		NEXT_OP();
+	xf5: // push af
+		getFlags(cpu);
+		writeByte(core, --core->sp, cpu->regs.main.a);
+		writeByte(core, --core->sp, cpu->regs.main.f);
+		NEXT_OP();
+	xfb: // ei
+		cpu->interrupts.iff1 = cpu->interrupts.iff2 = 1;
+		cpu->interrupts.eiDone = core->cycles;
+		// anything waiting gets taken right after the next instruction
+		if(core->end > core->cycles + 1 && interruptDue(core->system))
+			core->end = core->cycles + 1;
+		NEXT_OP();
+	xfe: // cp *
+		pre = cpu->regs.main.a;
+		post = (pre - op->arg) & 0xff;
+		FLAGS_SUB8(pre, post, 0);
+		NEXT_OP();
+	unknown:
+		unknownOpcode(core, op->arg);
+		NEXT_OP();
 }
 
-// test to see if a carry occurred on some bit
-int carry(int pre, int post, int bit) {
-	int mask = 1 << bit;
-	return (pre & mask) & ~(post & mask);
+void threadOps(struct Op *ops, int count) {
+	runOps(NULL, ops, count);
 }
 
-// test to see if a borrow occurred on some bit
-int borrow(int pre, int post, int bit) {
-	int mask = 1 << bit;
-	return ~(pre & mask) & (post & mask);
+// run one op for compiled code that can't do it itself
+void interpretOp(struct Core *core, struct Op *op) {
+	runOps(core, op, 1);
 }
 
-void unknownOpcode(int opcode) {
-	fprintf(stderr, "[WARNING] Unknown opcode: 0x%x\n", opcode);
-#ifdef STRICT
-	exit(1);
-#endif
+// runOp() for when the op is being profiled or traced, the host time
+// io takes is profiled too
+static void watchOp(struct Core *core, struct Op *op) {
+	struct CPUState *cpu = core->cpu;
+	int io = op->id == 0xd3 || op->id == 0xdb;
+	uint64_t start = core->cycles - op->cycles;
+	if(core->trace && !core->trace->started) {
+		// what they all are to begin with
+		getFlags(cpu);
+		traceRegs(core->trace, start, &cpu->regs, core->sp);
+	}
+	if(core->trace) traceOp(core->trace, core->memory, start, core->pc, op->next);
+	if(core->profile) profileOp(core->profile, core->memory, core->pc, core->sp, op);
+	if(io && core->profile) {
+		long int host = nanos();
+		runOps(core, op, 1);
+		profilePort(core->profile, op, nanos() - host);
+	} else runOps(core, op, 1);
+	if(!core->trace) return;
+	if(io) traceData(core->trace, op->id == 0xdb ? TRACE_IN : TRACE_OUT,
+			core->cycles, op->arg, cpu->regs.main.a);
+	getFlags(cpu);
+	traceRegs(core->trace, core->cycles, &cpu->regs, core->sp);
 }
 
-// perform one instruction cycle
-void step(struct System *system) {
-	struct CPUState *cpu = &system->cpu;
-	uint8_t opcode = fetchOpcode(system);
-#ifdef DEBUG
-	printf("\nT cycle %i:\n", system->cycles);
-	printf("@addr 0x%04x: got opcode 0x%02x", cpu->regs.pc-1, opcode);
-#endif
+// perform one op on its own
+static inline void runOp(struct Core *core, struct Op *op) {
+	cycles(op->cycles, core);
+	if(core->profile || core->trace) watchOp(core, op);
+	else runOps(core, op, 1);
+}
 
-	int pre, post, c, extendedByte, arg;
-	// switch all the opcodes lol
-	switch(opcode) {
-		case 0x00: // nop
-			break;
-		case 0x01: // ld bc,**
-			cpu->regs.main.bc = fetchWord(system);
-			break;
-		case 0x02: // ld (bc),a
-			writeByte(system, cpu->regs.main.bc, cpu->regs.main.a);
-			break;
-		case 0x03: // inc bc
-			cycles(2, system);
-			cpu->regs.main.bc++;
-			break;
-		case 0x04: // inc b
-			pre = cpu->regs.main.b;
-			post = ++cpu->regs.main.b;
-			SET_ADD;
-			SET_OVERFLOW(pre, post);
-			SET_HALF_CARRY(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x05: // dec b
-			pre = cpu->regs.main.b;
-			post = --cpu->regs.main.b;
-			SET_SUBTRACT;
-			SET_UNDERFLOW(pre, post);
-			SET_HALF_BORROW(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x06: // ld b,*
-			cpu->regs.main.b = fetchByte(system);
-			break;
-		case 0x07: // rlca
-			c = (cpu->regs.main.a & (1 << 7)) >> 7;
-			cpu->regs.main.a <<= 1;
-			cpu->regs.main.a |= c;
-			SET_C(c);
-			SET_H(0);
-			SET_N(0);
-			break;
-		case 0x08: // ex af,af'
-			swapWord(&cpu->regs.main.af, &cpu->regs.alt.af);
-			break;
-		case 0x09: // add hl,bc
-			cycles(7, system);
-			pre = cpu->regs.main.h | cpu->regs.main.b;
-			cpu->regs.main.hl += cpu->regs.main.bc;
-			post = cpu->regs.main.h;
-			SET_CARRY(pre, post);
-			SET_HALF_CARRY(pre, post);
-			SET_ADD;
-			break;
-		case 0x0a: // ld a,(bc)
-			cpu->regs.main.a = readByte(system, cpu->regs.main.bc);
-			break;
-		case 0x0b: // dec bc
-			cycles(2, system);
-			cpu->regs.main.bc--;
-			break;
-		case 0x0c: // inc c
-			pre = cpu->regs.main.c;
-			post = ++cpu->regs.main.c;
-			SET_ADD;
-			SET_OVERFLOW(pre, post);
-			SET_HALF_CARRY(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x0d: // dec c
-			pre = cpu->regs.main.c;
-			post = --cpu->regs.main.c;
-			SET_SUBTRACT;
-			SET_UNDERFLOW(pre, post);
-			SET_HALF_BORROW(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x0e: // ld c,*
-			cpu->regs.main.c = fetchByte(system);
-			break;
-		case 0x0f: // rrca
-			c = cpu->regs.main.a & 1;
-			cpu->regs.main.a >>= 1;
-			cpu->regs.main.a |= c << 7;
-			SET_C(c);
-			SET_H(0);
-			SET_N(0);
-			break;
-		case 0x11: // ld de,**
-			cpu->regs.main.de = fetchWord(system);
-			break;
-		case 0x17: // rla
-			c = (cpu->regs.main.a & (1 << 7)) >> 7;
-			cpu->regs.main.a <<= 1;
-			cpu->regs.main.a |= GET_C;
-			SET_C(c);
-			SET_H(0);
-			SET_N(0);
-			break;
-		case 0x1f: // rra
-			c = cpu->regs.main.a & 1;
-			cpu->regs.main.a >>= 1;
-			cpu->regs.main.a |= GET_C << 7;
-			SET_C(c);
-			SET_H(0);
-			SET_N(0);
-			break;
-		case 0x3c: // inc a
-			pre = cpu->regs.main.a;
-			post = ++cpu->regs.main.a;
-			SET_ADD;
-			SET_OVERFLOW(pre, post);
-			SET_HALF_CARRY(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x3d: // dec a
-			pre = cpu->regs.main.a;
-			post = --cpu->regs.main.a;
-			SET_SUBTRACT;
-			SET_UNDERFLOW(pre, post);
-			SET_HALF_BORROW(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0x3e: // ld a,*
-			cpu->regs.main.a = fetchByte(system);
-			break;
-		case 0x47: // ld b,a
-			cpu->regs.main.b = cpu->regs.main.a;
-			break;
-		case 0x4f: // ld c,a
-			cpu->regs.main.c = cpu->regs.main.a;
-			break;
-		case 0x60: // ld h,b
-			cpu->regs.main.h = cpu->regs.main.b;
-			break;
-		case 0x67: // ld h,a
-			cpu->regs.main.h = cpu->regs.main.a;
-			break;
-		case 0x69: // ld l,c
-			cpu->regs.main.l = cpu->regs.main.c;
-			break;
-		case 0x6f: // ld l,a
-			cpu->regs.main.l = cpu->regs.main.a;
-			break;
-		case 0x78: // ld a,b
-			cpu->regs.main.a = cpu->regs.main.b;
-			break;
-		case 0x79: // ld a,c
-			cpu->regs.main.a = cpu->regs.main.c;
-			break;
-		case 0x7a: // ld a,d
-			cpu->regs.main.a = cpu->regs.main.d;
-			break;
-		case 0x7b: // ld a,e
-			cpu->regs.main.a = cpu->regs.main.e;
-			break;
-		case 0xb7: // or a
-			pre = cpu->regs.main.a;
-			post = pre | pre;
-			cpu->regs.main.a = post;
-			SET_C(0);
-			SET_H(0);
-			SET_N(0);
-			SET_PARITY(post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0xc2: // jp nz,**
-			arg = fetchWord(system);
-			if(!GET_Z) cpu->regs.pc = arg;
-			break;
-		case 0xc3: // jp **
-			cpu->regs.pc = fetchWord(system);
-			break;
-		case 0xc6: // add a,*
-			pre = cpu->regs.main.a;
-			cpu->regs.main.a += fetchByte(system);
-			post = cpu->regs.main.a;
-			SET_CARRY(pre, post);
-			SET_HALF_CARRY(pre, post);
-			SET_ADD;
-			SET_OVERFLOW(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0xca: // jp z,**
-			arg = fetchWord(system);
-			if(GET_Z) cpu->regs.pc = arg;
-			break;
-		case 0xcb: // bits
-			extendedByte = fetchOpcode(system);
+// decode and perform one instruction, what the cpu does without a block cache
+static inline void execute(struct Core *core) {
+	struct Op op;
+	decodeOp(core->memory, core->pc, &op);
+	threadOps(&op, 1);
+	runOp(core, &op);
 #ifdef DEBUG
-			printf("%02x", extendedByte);
-#endif
-			// switch the extended byte lol
-			switch(extendedByte) {
-				case 0x1a: // rr d
-					c = cpu->regs.main.d & 1;
-					cpu->regs.main.d >>= 1;
-					cpu->regs.main.d |= GET_C << 7;
-					post = cpu->regs.main.d;
-					SET_C(c);
-					SET_H(0);
-					SET_N(0);
-					SET_PARITY(post);
-					SET_ZERO(post);
-					SET_SIGNED(post);
-					break;
-				case 0x1b: // rr e
-					c = cpu->regs.main.e & 1;
-					cpu->regs.main.e >>= 1;
-					cpu->regs.main.e |= GET_C << 7;
-					post = cpu->regs.main.e;
-					SET_C(c);
-					SET_H(0);
-					SET_N(0);
-					SET_PARITY(post);
-					SET_ZERO(post);
-					SET_SIGNED(post);
-					break;
-				default: unknownOpcode((opcode << 8) | extendedByte);
-			}
-			break;
-		case 0xd3: // out (*),a
-			out(system, fetchByte(system), cpu->regs.main.a);	
-			break;
-		case 0xdd: // ix
-			extendedByte = fetchOpcode(system);
-#ifdef DEBUG
-			printf("%02x", extendedByte);
-#endif
-			// switch the extended byte lol
-			switch(extendedByte) {
-				case 0x21: // ld ix,**
-					cpu->regs.ix = fetchWord(system);
-					break;
-				case 0x23: // inc ix
-					cycles(2, system);
-					cpu->regs.ix++;
-					break;
-				case 0x7c: // ld a,ixh
-					cpu->regs.main.a = cpu->regs.ixh;
-					break;
-				case 0x7d: // ld a,ixl
-					cpu->regs.main.a = cpu->regs.ixl;
-					break;
-				case 0x7e: // ld a,(ix+*)
-					cycles(5, system);
-					cpu->regs.main.a = readByte(system,
-							fetchByte(system)
-							+ cpu->regs.ix);
-					break;
-				default: unknownOpcode((opcode << 8) | extendedByte);
-			}
-			break;
-		case 0xe6: // and *
-			pre = cpu->regs.main.a;
-			post = pre & fetchByte(system);
-			cpu->regs.main.a = post;
-			SET_C(0);
-			SET_H(1);
-			SET_N(0);
-			SET_PARITY(post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
-			break;
-		case 0xed: // extd
-			extendedByte = fetchOpcode(system);
-#ifdef DEBUG
-			printf("%02x", extendedByte);
+	printf("\n");
+	syncCore(core);
+	printState(core->cpu);
 #endif
-			// switch the extended byte lol
-			switch(extendedByte) {
-				case 0x52: // sbc hl,de
-					cycles(7, system);
-					pre = cpu->regs.main.h;
-					cpu->regs.main.hl -= cpu->regs.main.de
-						+ GET_C;
-					post = cpu->regs.main.h;
-					SET_BORROW(pre, post);
-					SET_HALF_BORROW(pre, post);
-					SET_SUBTRACT;
-					SET_UNDERFLOW(pre, post);
-					SET_ZERO(post);
-					SET_SIGNED(post);
-					break;
-				default: unknownOpcode((opcode << 8) | extendedByte);
-			}
-			break;
-		case 0xf3: // di
-			// TODO: actually di
-			// right now this is just my debug opcode lol
-			printf("-----------\n\n");
-			break;
-		case 0xfb: // ei
-			// TODO: actually ei
-			// right now this is just my debug opcode lol
-			printState(cpu);
-			break;
-		case 0xfe: // cp *
-			pre = cpu->regs.main.a;
-			post = pre - fetchByte(system);
-			SET_BORROW(pre, post);
-			SET_HALF_BORROW(pre, post);
-			SET_SUBTRACT;
-			SET_UNDERFLOW(pre, post);
-			SET_ZERO(post);
-			SET_SIGNED(post);
+}
+
+// -d: catch the shadow up after a compiled block and make sure it
+// got exactly the same result interpreting
+void checkShadow(struct Core *core, struct Block *block) {
+	struct System *system = core->system;
+	struct System *shadow = system->shadow;
+	syncCore(core);
+	// it has its own events so it takes the same interrupts
+	runUntil(shadow, system->cycles);
+	getFlags(&system->cpu);
+	getFlags(&shadow->cpu);
+	int same = shadow->cycles == system->cycles
+		&& !memcmp(&shadow->cpu.regs, &system->cpu.regs, sizeof(struct Registers));
+	for(int i = 0; i < block->length && same; i++) {
+		if(!(block->ops[i].flags & OP_WRITES)) continue;
+		same = shadow->memory.flashBank == system->memory.flashBank
+			&& !memcmp(shadow->memory.ram, system->memory.ram, RAM_SIZE)
+			&& !memcmp(shadow->memory.eeprom, system->memory.eeprom, EEPROM_SIZE);
+		break;
+	}
+	if(same) return;
+	fprintf(stderr, "The compiled block at 0x%04x disagrees with the interpreter"
+			" after %" PRIu64 " cycles\n", block->pc, system->cycles);
+	printf("\ncompiled:\n");
+	printState(&system->cpu);
+	printf("interpreted (%" PRIu64 " cycles):\n", shadow->cycles);
+	printState(&shadow->cpu);
+	exit(1);
+}
+
+// run a cached block, all in one go if it fits in what's left of the slice
+// and doesn't have the pc sentinel partway through
+// it gets compiled once it has been run like that often enough
+// profiling, tracing and watchpoints need to see every op so they never
+// run in one go
+static inline void runBlock(struct Core *core, struct BlockCache *cache,
+		struct Block *block, int stopPC) {
+	if(core->cycles + block->cycles <= core->end && !core->profile && !core->watching
+			&& (stopPC <= block->pc || stopPC >= block->pc + block->size)) {
+		cycles(block->cycles, core);
+		if(block->native) {
+			block->native(core, core->cpu, core->memory);
+			if(core->system->shadow) checkShadow(core, block);
+			return;
+		}
+		runOps(core, block->ops, block->length);
+		if(cache->jit && ++block->runs == JIT_THRESHOLD && block->key != NO_BLOCK)
+			compileBlock(cache->jit, cache, block);
+		return;
+	}
+	for(int i = 0; i < block->length; i++) {
+		runOp(core, &block->ops[i]);
+		if(core->cycles >= core->end || core->pc == stopPC) return;
+	}
+}
+
+
+
+// go round a loop of period cycles waiting on port as many more times as it
+// would before the port could read differently or the slice ends. the last
+// in() is done for real, everything it catches up with would have been the
+// same after all the ones before
+static void skipPolls(struct Core *core, uint16_t port, uint64_t period) {
+	struct System *system = core->system;
+	if(core->cycles >= core->end) return;
+	uint64_t until = portQuiet(system, port, core->cpu->regs.main.a, core->cycles);
+	if(until <= core->cycles) return;
+	if(--until > core->end) until = core->end;
+	uint64_t times = (until - core->cycles) / period;
+	if(!times) return;
+	core->cycles += times * period;
+	in(system, core->cycles, port);
+	if(nextEvent(&system->scheduler) < core->end) endSlice(core);
+}
+
+// a block ending in an in just ran. if the cpu is just as it was the last
+// time it did, with nothing written or sent out since, it's in a loop that
+// goes round the same way until the port reads something else
+static void __attribute__((noinline)) watchPoll(struct Core *core, struct Block *block) {
+	struct Op *op = &block->ops[block->length - 1];
+	struct Poll *poll = &core->poll;
+	struct CPUState *cpu = core->cpu;
+	// cut short by the end of the slice
+	if(core->pc != op->next) {
+		poll->pc = -1;
+		return;
+	}
+	getFlags(cpu);
+	struct Registers regs = cpu->regs;
+	regs.pc = core->pc;
+	regs.sp = core->sp;
+	struct Interrupts *interrupts = &cpu->interrupts;
+	if(poll->pc == block->pc && !(poll->effects & (OP_WRITES | OP_OUT))
+			&& !memcmp(&regs, &poll->regs, sizeof(regs))
+			&& interrupts->iff1 == poll->interrupts.iff1
+			&& interrupts->iff2 == poll->interrupts.iff2
+			&& interrupts->mode == poll->interrupts.mode
+			&& interrupts->inNMI == poll->interrupts.inNMI
+			&& interrupts->eiDone == poll->interrupts.eiDone)
+		skipPolls(core, op->arg, core->cycles - poll->cycles);
+	poll->pc = block->pc;
+	poll->effects = 0;
+	poll->cycles = core->cycles;
+	poll->regs = regs;
+	poll->interrupts = *interrupts;
+}
+
+// run the cpu for a time slice of at least budget T cycles
+// or until it reaches the pc sentinel or stops for the debugger
+// returns the number of cycles actually run
+long int runCycles(struct System *system, long int budget) {
+	// a halted cpu only does nops until it's interrupted, and that can't
+	// happen until the slice is over, so skip straight there
+	if(system->cpu.interrupts.halted) {
+		long int nops = (budget + 3) / 4;
+		system->cycles += nops * 4;
+		return nops * 4;
+	}
+	int stopPC = system->stop.pcSentinel;
+	struct BlockCache *cache = system->blocks;
+	struct Debugger *debugger = system->debugger;
+	struct AddressSet *breaks = debugger && debugger->breaks.total
+		? &debugger->breaks : NULL;
+	struct Core core;
+	core.system = system;
+	core.cpu = &system->cpu;
+	core.memory = &system->memory;
+	core.pc = system->cpu.regs.pc;
+	core.sp = system->cpu.regs.sp;
+	core.profile = system->profile;
+	core.trace = system->trace;
+	core.watching = core.trace
+		|| (debugger && (debugger->reads.total || debugger->writes.total));
+	core.cycles = system->cycles;
+	core.end = core.cycles + budget;
+	core.poll.pc = -1;
+	core.poll.effects = 0;
+	// waiting loops are only looked for in whole blocks
+	int polls = cache && !core.profile && !core.watching;
+	uint64_t start = core.cycles;
+	while(core.cycles < core.end) {
+		if(cache) {
+			struct Block *block = lookupBlock(cache, core.memory, core.pc);
+			runBlock(&core, cache, block, stopPC);
+			core.poll.effects |= block->flags;
+			if(polls && block->flags & OP_IN) watchPoll(&core, block);
+		} else execute(&core);
+		if(core.pc == stopPC) break;
+		if(breaks && inSet(breaks, core.pc)) {
+			debugger->stop = DEBUG_BREAK;
 			break;
-		default: unknownOpcode(opcode);
+		}
 	}
-#ifdef DEBUG
-	printf("\n");
-	printState(cpu);
-#endif
+	syncCore(&core);
+	return core.cycles - start;
 }
 
+// perform exactly one instruction
+void step(struct System *system) {
+	int stopPC = system->stop.pcSentinel;
+	system->stop.pcSentinel = -1;
+	runCycles(system, 1);
+	system->stop.pcSentinel = stopPC;
+}
 
 
-/* ENTRY POINT */
 
-struct System *mainSystem;
+/* ENTRY POINT */
 
 void initAllegro() {
 	if(!al_init())
 		fprintf(stderr, "Could not initialize Allegro\n");
 	else if(!al_install_audio())
 		fprintf(stderr, "Could not initialize Allegro audio\n");
+	else if(!al_install_keyboard())
+		fprintf(stderr, "Could not initialize Allegro keyboard\n");
 	else {
 		al_reserve_samples(0);
 		return;
@@ -792,51 +1228,383 @@ void initAllegro() {
 	exit(1);
 }
 
-// load a file into memory
-void load(const char filename[], int size, uint8_t *destination) {
-	FILE *fp = fopen(filename, "r");
-	fread(destination, sizeof(uint8_t), size, fp);
-	fclose(fp);
+struct Options {
+	const char *rom;
+	const char *eeprom;
+	int headless;
+	uint64_t cycleLimit;
+	int pcSentinel;
+	const char *uartPattern;
+	const char *stateFile;
+	const char *loadFile;
+	int rewindSeconds;
+	int interpret;
+	int jit;
+	int lockstep;
+	const char *profileFile;
+	const char *traceFile;
+	const char *debugAddress;
+	int debugWait;
+	const char *uartDevice;
+	int baud;
+	const char *manifest;
+	const char *recordFile;
+	const char *replayFile;
+	const char *panning;
+	const char *wavFile;
+};
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"usage: %s [-Hijd] [-c cycles] [-p pc] [-u pattern] [-e eeprom]\n"
+			"       [-s state] [-l state] [-r seconds] [-P report] [-t trace]\n"
+			"       [-g port | -G port] [-S uart] [-b baud] [-w log | -R log]\n"
+			"       [-m panning] [-a wav] [rom]\n"
+			"       %s [-ij] -B manifest\n"
+			"  -H          headless: no display or audio, run as fast as possible\n"
+			"  -i          decode every instruction as it runs, no block cache\n"
+			"  -j          compile hot blocks to native code\n"
+			"  -d          like -j but check every compiled block against the\n"
+			"              interpreter as it goes\n"
+			"  -c cycles   stop after this many T cycles\n"
+			"  -p pc       stop when the pc reaches this address\n"
+			"  -u pattern  stop once the uart has sent this string\n"
+			"  -e eeprom   keep the eeprom in this file across runs\n"
+			"  -s state    save state here with F5 (or at exit when headless)\n"
+			"  -l state    load this state at start\n"
+			"  -r seconds  keep this much rewind history, hold backspace to rewind\n"
+			"  -P report   profile the cpu, write where it spent its time here\n"
+			"              at exit and its call stacks to report.folded\n"
+			"  -t trace    record every instruction, register change, memory\n"
+			"              access and io to this file, see tools/tracedump.c\n"
+			"  -g port     let gdb attach on this localhost port (or unix\n"
+			"              socket if it isn't a number) at any time\n"
+			"  -G port     same but wait for gdb before starting\n"
+			"  -S uart     connect the uart to a new pty with pty, a unix\n"
+			"              socket with unix:path or a file to write to\n"
+			"              instead of stdout\n"
+			"  -b baud     send and receive at this rate rather than at once\n"
+			"  -w log      record everything that comes into the machine here\n"
+			"  -R log      replay a recording headless and check it comes out\n"
+			"              the same\n"
+			"  -m panning  where the ay channels go: abc, acb, bac, bca, cab,\n"
+			"              cba or mono, or one per chip like abc,cba\n"
+			"  -a wav      run headless and render the sound to this file\n"
+			"  -B manifest run every rom in the manifest headless, several at\n"
+			"              once, and report which passed\n",
+			name, name);
+	exit(1);
+}
+
+void parseArgs(struct Options *options, int argc, char *argv[]) {
+	options->rom = "test/music.rom";
+	options->eeprom = NULL;
+	options->headless = 0;
+	options->cycleLimit = 0;
+	options->pcSentinel = -1;
+	options->uartPattern = NULL;
+	options->stateFile = NULL;
+	options->loadFile = NULL;
+	options->rewindSeconds = 0;
+	options->interpret = 0;
+	options->jit = 0;
+	options->lockstep = 0;
+	options->profileFile = NULL;
+	options->traceFile = NULL;
+	options->debugAddress = NULL;
+	options->debugWait = 0;
+	options->uartDevice = NULL;
+	options->baud = 0;
+	options->manifest = NULL;
+	options->recordFile = NULL;
+	options->replayFile = NULL;
+	options->panning = NULL;
+	options->wavFile = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "Hijdc:p:u:e:s:l:r:P:t:g:G:S:b:B:w:R:m:a:")) != -1) {
+		switch(opt) {
+			case 'H': options->headless = 1; break;
+			case 'i': options->interpret = 1; break;
+			case 'j': options->jit = 1; break;
+			case 'd': options->jit = options->lockstep = 1; break;
+			case 'c': options->cycleLimit = strtoull(optarg, NULL, 0); break;
+			case 'p': options->pcSentinel = strtol(optarg, NULL, 0) & 0xffff; break;
+			case 'u': options->uartPattern = optarg; break;
+			case 'e': options->eeprom = optarg; break;
+			case 's': options->stateFile = optarg; break;
+			case 'l': options->loadFile = optarg; break;
+			case 'r': options->rewindSeconds = atoi(optarg); break;
+			case 'P': options->profileFile = optarg; break;
+			case 't': options->traceFile = optarg; break;
+			case 'g': options->debugAddress = optarg; break;
+			case 'G': options->debugAddress = optarg; options->debugWait = 1; break;
+			case 'S': options->uartDevice = optarg; break;
+			case 'b': options->baud = atoi(optarg); break;
+			case 'B': options->manifest = optarg; break;
+			case 'w': options->recordFile = optarg; break;
+			case 'R': options->replayFile = optarg; options->headless = 1; break;
+			case 'm': options->panning = optarg; break;
+			case 'a': options->wavFile = optarg; options->headless = 1; break;
+			default: usage(argv[0]);
+		}
+	}
+	if(optind < argc) options->rom = argv[optind++];
+	if(optind < argc || (options->recordFile && options->replayFile)) usage(argv[0]);
 }
 
-void init() {
-	initAllegro();
-	mainSystem = newSystem();
+struct System *init(struct Options *options) {
+	if(!options->headless) initAllegro();
+	struct System *system = newSystem(options->headless);
+	if(options->panning && setPanning(&system->peripherals.sound, options->panning)) {
+		fprintf(stderr, "Unknown panning %s\n", options->panning);
+		exit(1);
+	}
+	system->stop.cycleLimit = options->cycleLimit;
+	system->stop.pcSentinel = options->pcSentinel;
+	if(options->uartPattern) setUARTPattern(system, options->uartPattern);
+	openUART(&system->peripherals.uart, options->uartDevice, options->baud);
+	if(!options->interpret) system->blocks = newBlockCache(threadOps);
+	if(options->jit && system->blocks) system->blocks->jit = newJIT();
+
+	// map in the program and save data, a replay brings its own eeprom
+	loadMemory(&system->memory, options->rom,
+			options->replayFile ? NULL : options->eeprom);
+
+	if(options->rewindSeconds > 0)
+		system->rewind = newRewind(
+				(uint64_t)options->rewindSeconds * CPU_RATE / VDC_FRAME_CYCLES);
+	if(options->loadFile && loadState(system, options->loadFile)) exit(1);
+	if(options->wavFile) {
+		recordWav(&system->peripherals.sound, options->wavFile, system->cycles);
+		rescheduleEvents(system);
+	}
+	if(options->lockstep) system->shadow = newShadow(system);
+	if(options->profileFile) system->profile = newProfile(options->profileFile);
+	if(options->traceFile) system->trace = newTrace(options->traceFile);
+	if(options->debugAddress) {
+		struct Debugger *debugger = newDebugger(options->debugAddress, options->debugWait);
+		system->debugger = debugger;
+		if(system->blocks) system->blocks->breaks = &debugger->breaks;
+		schedule(&system->scheduler, system->cycles + DEBUG_POLL_CYCLES,
+				debugEvent, system);
+	}
+	if(options->recordFile)
+		system->recording = newRecording(options->recordFile, system);
+	if(options->replayFile) {
+		system->recording = openReplay(options->replayFile, system);
+		uint64_t end = system->recording->end;
+		if(!system->stop.cycleLimit || system->stop.cycleLimit > end)
+			system->stop.cycleLimit = end;
+	}
+	return system;
+}
 
-	// load the program and save data
-	// TODO: parse args to load different files than defaults
-	// TODO: mmap instead? ? ? 
-	load("test/music.rom", FLASH_SIZE, mainSystem->memory.flash);
+void quit(struct System *system) {
+	int headless = system->headless;
+	destroySystem(system);
+	if(!headless) al_uninstall_audio();
 }
 
-void quit() {
-	destroySystem(mainSystem);
-	al_uninstall_audio();
+// run the system until it catches up with now, stopping for each event
+// to take any interrupt it raised, and for as long as gdb wants it stopped
+void runUntil(struct System *system, uint64_t now) {
+	while(system->cycles < now && !stopped(system)) {
+		if(system->debugger && system->debugger->stop) {
+			debugStop(system);
+			continue;
+		}
+		// the handler's first instruction can be where it has to stop
+		if(takeInterrupts(system)) {
+			struct Debugger *debugger = system->debugger;
+			if(debugger && !debugger->stop && inSet(&debugger->breaks, system->cpu.regs.pc))
+				debugger->stop = DEBUG_BREAK;
+			if(stopped(system) || (debugger && debugger->stop)) continue;
+		}
+		struct Recording *recording = system->recording;
+		uint64_t deadline = nextEvent(&system->scheduler);
+		if(recording && recording->due < deadline) deadline = recording->due;
+		// an ei just before holds one off for another instruction
+		if(system->cycles == system->cpu.interrupts.eiDone && interruptDue(system))
+			deadline = system->cycles + 1;
+		if(deadline > now) deadline = now;
+		if(deadline > system->cycles)
+			runCycles(system, deadline - system->cycles);
+		runEvents(&system->scheduler, system->cycles);
+		if(recording && system->cycles >= recording->due)
+			syncRecording(recording, system);
+	}
 }
 
-void systemLoop() {
+// keys, the window close button and the window needing a repaint
+ALLEGRO_EVENT_QUEUE *initInput(struct System *system) {
+	ALLEGRO_EVENT_QUEUE *queue = al_create_event_queue();
+	if(!queue) {
+		fprintf(stderr, "Could not create Allegro event queue\n");
+		exit(1);
+	}
+	al_register_event_source(queue, al_get_keyboard_event_source());
+	al_register_event_source(queue,
+			al_get_display_event_source(system->peripherals.vdc.renderer->display));
+	return queue;
+}
+
+// what the user asked for since last time
+struct Input {
+	int quit;
+	int rewinding; // backspace is held
+};
+
+void pollInput(struct System *system, ALLEGRO_EVENT_QUEUE *queue,
+		struct Input *input, const char *stateFile) {
+	ALLEGRO_EVENT event;
+	while(al_get_next_event(queue, &event)) {
+		if(event.type == ALLEGRO_EVENT_DISPLAY_CLOSE) input->quit = 1;
+		else if(event.type == ALLEGRO_EVENT_DISPLAY_EXPOSE
+				|| event.type == ALLEGRO_EVENT_DISPLAY_SWITCH_IN)
+			invalidateScreen(&system->peripherals.vdc);
+		else if(event.type == ALLEGRO_EVENT_KEY_DOWN) {
+			switch(event.keyboard.keycode) {
+				case ALLEGRO_KEY_F5: saveState(system, stateFile); break;
+				case ALLEGRO_KEY_F7: {
+					uint64_t cycles = system->cycles;
+					if(!loadState(system, stateFile) && system->recording)
+						recordState(system->recording, system, cycles);
+					break;
+				}
+				case ALLEGRO_KEY_BACKSPACE: input->rewinding = 1; break;
+			}
+		} else if(event.type == ALLEGRO_EVENT_KEY_UP
+				&& event.keyboard.keycode == ALLEGRO_KEY_BACKSPACE)
+			input->rewinding = 0;
+	}
+}
+
+void sleepNanos(long int wait) {
+	if(wait <= 0) return;
+	struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+	nanosleep(&ts, NULL);
+}
+
+void systemLoop(struct System *system, const char *stateFile) {
+	ALLEGRO_EVENT_QUEUE *queue = initInput(system);
+	struct Input input = { 0 };
+	if(!stateFile) stateFile = DEFAULT_STATE_FILE;
+	startSound(&system->peripherals.sound);
+	startRenderer(system->peripherals.vdc.renderer);
 	long int startNanos = nanos();
-	while(1) {
-		// cpu
+	uint64_t rewoundFrom = NO_EVENT; // where rewinding started, if it has
+	while(!input.quit && !system->stop.killed && !system->stop.crashed) {
+		pollInput(system, queue, &input, stateFile);
+
+		// step back a frame at a time while backspace is held
+		if(input.rewinding && system->rewind) {
+			uint64_t cycles = system->cycles;
+			if(rewindSystem(system->rewind, system, 1) > 0) {
+				draw(&system->peripherals.vdc);
+				if(rewoundFrom == NO_EVENT) rewoundFrom = cycles;
+			}
+			sleepNanos(cyclesToNanos(VDC_FRAME_CYCLES));
+		}
+		// a recording only needs where it ended up
+		if(!input.rewinding && rewoundFrom != NO_EVENT) {
+			if(system->recording) recordState(system->recording, system, rewoundFrom);
+			rewoundFrom = NO_EVENT;
+		}
+
+		// the clock may have jumped, carry on in realtime from wherever it is
+		if(systemNanos(system) - (nanos()-startNanos) > cyclesToNanos(VDC_FRAME_CYCLES)
+				|| input.rewinding)
+			startNanos = nanos() - systemNanos(system);
+		if(input.rewinding) continue;
+
 		// gotta catch it up to realtime
-		while(systemNanos(mainSystem) < nanos()-startNanos)
-			step(mainSystem);
-
-		// ays
-		play(&mainSystem->peripherals.ay1);
-		play(&mainSystem->peripherals.ay2);
-
-		// uart
-		fflush(stdout);
-		
-		// vdc
-		draw(&mainSystem->peripherals.vdc);
+		runUntil(system, nanosToCycles(nanos()-startNanos));
+
+		// time spent stopped in the debugger isn't made up for
+		if(system->debugger && system->debugger->resumed) {
+			system->debugger->resumed = 0;
+			startNanos = nanos() - systemNanos(system);
+		}
+
+		// then there's nothing to do until the next event
+		sleepNanos(cyclesToNanos(nextEvent(&system->scheduler))
+				- (nanos()-startNanos));
+	}
+	al_destroy_event_queue(queue);
+}
+
+// the longest a headless run goes between checks of the stop conditions
+#define TURBO_SLICE 1000000
+
+// run flat out with no display or audio until a stop condition is hit
+// returns which one, see RUN_PC and co
+int runHeadless(struct System *system) {
+	struct StopConditions *stop = &system->stop;
+	while(1) {
+		uint64_t deadline = system->cycles + TURBO_SLICE;
+		if(stop->cycleLimit && stop->cycleLimit < deadline)
+			deadline = stop->cycleLimit;
+		runUntil(system, deadline);
+		if(system->cpu.regs.pc == stop->pcSentinel) return RUN_PC;
+		if(stop->uartMatched) return RUN_UART;
+		if(stop->killed) return RUN_KILLED;
+		if(stop->crashed) return RUN_CRASHED;
+		if(stop->diverged) return RUN_DIVERGED;
+		if(stop->cycleLimit && system->cycles >= stop->cycleLimit) return RUN_LIMIT;
+	}
+}
+
+// a headless run from the command line, saying how it ended
+// returns nonzero if it ended without hitting what it was waiting for
+int turboLoop(struct System *system) {
+	struct StopConditions *stop = &system->stop;
+	int waiting = stop->pcSentinel >= 0 || stop->uartPattern;
+	switch(runHeadless(system)) {
+		case RUN_PC:
+			fprintf(stderr, "Reached pc 0x%04x after %" PRIu64 " cycles\n",
+					stop->pcSentinel, system->cycles);
+			return 0;
+		case RUN_UART:
+			fprintf(stderr, "Matched uart pattern after %" PRIu64 " cycles\n",
+					system->cycles);
+			return 0;
+		case RUN_KILLED:
+			fprintf(stderr, "Killed by gdb after %" PRIu64 " cycles\n",
+					system->cycles);
+			return 0;
+		case RUN_CRASHED:
+			fprintf(stderr, "Stopped at an unknown opcode after %" PRIu64 " cycles\n",
+					system->cycles);
+			return 1;
+		case RUN_DIVERGED: // the recording has said why
+			return 1;
+		default:
+			fprintf(stderr, "Reached the cycle limit at %" PRIu64 " cycles\n",
+					system->cycles);
+			return waiting;
 	}
 }
 
 int main(int argc, char *argv[]) {
-	init();
-	systemLoop();
-	quit();
-	return 0;
+	struct Options options;
+	parseArgs(&options, argc, argv);
+	initFlagTables();
+	if(options.manifest) return runBatch(options.manifest, options.interpret, options.jit);
+	struct System *system = init(&options);
+	int status = 0;
+	if(options.headless) {
+		status = turboLoop(system);
+		if(options.stateFile && saveState(system, options.stateFile))
+			status = 1;
+	} else systemLoop(system, options.stateFile);
+	if(system->profile && writeProfile(system->profile))
+		status = 1;
+	if(system->stop.crashed) status = 1;
+	if(system->peripherals.sound.wav && finishWav(&system->peripherals.sound))
+		status = 1;
+	if(system->recording && finishRecording(system->recording, system))
+		status = 1;
+	fflush(stdout);
+	quit(system);
+	return status;
 }
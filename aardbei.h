@@ -0,0 +1,225 @@
+#ifndef AARDBEI_H
+#define AARDBEI_H
+
+#include <stdint.h>
+#include "v9958.h"
+#include "render.h"
+#include "sched.h"
+#include "ay.h"
+#include "uart.h"
+#include "memory.h"
+#include "savestate.h"
+#include "decode.h"
+#include "profile.h"
+#include "trace.h"
+#include "gdb.h"
+#include "record.h"
+
+/* CPU STATE AND REGISTERS */
+
+struct RegisterSet {
+	union {
+		uint16_t af;
+		struct {
+			uint8_t f;
+			uint8_t a;
+		};
+	};
+	union {
+		uint16_t bc;
+		struct {
+			uint8_t c;
+			uint8_t b;
+		};
+	};
+	union {
+		uint16_t de;
+		struct {
+			uint8_t e;
+			uint8_t d;
+		};
+	};
+	union {
+		uint16_t hl;
+		struct {
+			uint8_t l;
+			uint8_t h;
+		};
+	};
+};
+
+#define C_FLAG  (1)
+#define N_FLAG  (1 << 1)
+#define PV_FLAG (1 << 2)
+#define H_FLAG  (1 << 4)
+#define Z_FLAG  (1 << 6)
+#define S_FLAG  (1 << 7)
+
+struct Registers {
+	struct RegisterSet main;
+	struct RegisterSet alt;
+	uint8_t i;
+	uint8_t r;
+	union {
+		uint16_t ix;
+		struct {
+			uint8_t ixl;
+			uint8_t ixh;
+		};
+	};
+	union {
+		uint16_t iy;
+		struct {
+			uint8_t iyl;
+			uint8_t iyh;
+		};
+	};
+	uint16_t sp;
+	uint16_t pc;
+};
+
+// flags are evaluated lazily: alu ops only record their operands and result
+// and F is only worked out when something actually reads it (see getFlags())
+enum FlagOp {
+	FLAGS_NONE, // F in the register set is up to date
+	FLAGS_ADD,
+	FLAGS_SUB,
+	FLAGS_INC,
+	FLAGS_DEC,
+	FLAGS_LOGIC,
+	FLAGS_AND,
+};
+
+struct LazyFlags {
+	uint8_t op;
+	uint8_t pre;
+	uint8_t post;
+	uint8_t carry;
+	uint8_t keep; // bits of the old F the op leaves alone
+};
+
+// what the board's interrupt controller puts on the bus for im 2, for the
+// highest priority source holding INT low. im 0 gets 0xff off the pulled up
+// bus, so it's rst 38h just like im 1
+#define VECTOR_LINE   0x00
+#define VECTOR_VBLANK 0x02
+#define VECTOR_UART   0x04
+
+// interrupts are only taken between time slices, see takeInterrupts()
+struct Interrupts {
+	uint8_t iff1;
+	uint8_t iff2;
+	uint8_t mode;   // im 0, 1 or 2
+	uint8_t halted; // doing nops at a halt until something interrupts it
+	uint8_t inNMI;  // taken an nmi and not retn'd yet
+	uint64_t eiDone; // when the last ei finished, they hold off interrupts
+	                 // for one more instruction
+};
+
+struct CPUState {
+	struct Registers regs;
+	struct LazyFlags lazy;
+	struct Interrupts interrupts;
+};
+
+
+
+/* IO */
+
+struct Peripherals {
+	struct Sound sound;
+	struct VDC vdc;
+	struct UART uart;
+};
+
+
+
+/* SYSTEM */
+
+// when to stop a headless run, see runHeadless()
+struct StopConditions {
+	uint64_t cycleLimit;     // 0 for none
+	int pcSentinel;          // -1 for none
+	const char *uartPattern; // NULL for none
+	int uartPatternLength;
+	char *uartTail;          // the last uartPatternLength bytes sent
+	int uartMatched;
+	int killed;              // gdb asked for the run to end
+	int crashed;             // an unknown opcode, with STRICT
+	int diverged;            // a replay stopped matching its recording
+};
+
+// how a headless run ended
+enum RunResult {
+	RUN_PC,      // reached pcSentinel
+	RUN_UART,    // the uart sent uartPattern
+	RUN_KILLED,
+	RUN_CRASHED,
+	RUN_DIVERGED,
+	RUN_LIMIT,   // reached cycleLimit
+};
+
+struct System {
+	struct CPUState cpu;
+	struct Memory memory;
+	struct Peripherals peripherals;
+	struct StopConditions stop;
+	struct Scheduler scheduler;
+	int headless;
+	uint64_t cycles;
+	uint64_t audioFragments; // fragment boundaries passed so far
+	uint64_t commandEvent; // when the vdc command event is due, NO_EVENT if none is
+	uint64_t lineEvent;    // same for the vdc's next line interrupt
+	uint64_t uartChangeEvent; // and the uart's next byte with its interrupts on
+	struct Rewind *rewind; // NULL if rewinding is off
+	struct BlockCache *blocks; // NULL to decode every instruction as it runs
+	struct System *shadow; // interprets alongside to check the jit, see -d
+	struct Profile *profile; // NULL unless profiling, see -P
+	struct Trace *trace;     // NULL unless tracing, see -t
+	struct Debugger *debugger; // NULL unless gdb can attach, see -g
+	struct Recording *recording; // NULL unless recording or replaying, see -w
+};
+
+// the last time round what might be a loop waiting on a port, see watchPoll()
+struct Poll {
+	int pc;          // of the block ending in the in, -1 if there wasn't one
+	uint8_t effects; // OP_ flags of every block run since
+	uint64_t cycles;
+	struct Registers regs;
+	struct Interrupts interrupts;
+};
+
+// the hot part of the cpu state, kept in locals by runCycles() for the
+// length of a time slice and only written back to the system at the end
+struct Core {
+	struct System *system;
+	struct CPUState *cpu;
+	struct Memory *memory;
+	uint16_t pc;
+	uint16_t sp;
+	struct Profile *profile; // the system's, NULL unless profiling
+	struct Trace *trace;     // same
+	int watching; // tracing or gdb is watching memory, see watchAccess()
+	uint64_t cycles;
+	uint64_t end; // the slice runs until cycles reaches this
+	struct Poll poll;
+};
+
+long int nanos();
+struct System *newSystem(int);
+void destroySystem(struct System *);
+void setUARTPattern(struct System *, const char *);
+void initFlagTables();
+void threadOps(struct Op *, int);
+int runHeadless(struct System *);
+uint8_t getFlags(struct CPUState *);
+void rescheduleEvents(struct System *);
+int scheduleCommand(struct System *);
+int scheduleLine(struct System *, uint64_t);
+int scheduleUARTChange(struct System *, uint64_t);
+long int runCycles(struct System *, long int);
+void runUntil(struct System *, uint64_t);
+void interpretOp(struct Core *, struct Op *);
+void step(struct System *);
+
+#endif
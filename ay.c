@@ -0,0 +1,319 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ay.h"
+#include "sched.h"
+
+//#define DEBUG_AY
+
+void printAYRegisters(ayemu_ay_t *a) {
+	printf("\nAY REGS: A=%04d B=%04d C=%04d N=%02d R7=[%d%d%d%d%d%d] "
+			"\n   VOLS: A=%04d B=%04d C=%04d ENVFREQ=%d STYLE %d",
+			a->regs.tone_a, a->regs.tone_b, a->regs.tone_c, a->regs.noise,
+			a->regs.R7_tone_a, a->regs.R7_tone_b, a->regs.R7_tone_c,
+			a->regs.R7_noise_a, a->regs.R7_noise_b, a->regs.R7_noise_c,
+			a->regs.vol_a, a->regs.vol_b, a->regs.vol_c,
+			a->regs.env_freq, a->regs.env_style);
+}
+
+
+
+/* CPU SIDE */
+
+void ayLatch(struct Sound *sound, int chip, uint8_t data) {
+	sound->chips[chip].latch = data % AY_REGS;
+}
+
+// queue a write up for the audio thread
+// returns nonzero if it had to be dropped
+int pushWrite(struct Sound *sound, uint64_t cycles, int chip, int reg, uint8_t data) {
+	if(!listening(sound)) return 0;
+	struct AYRing *ring = &sound->ring;
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail == AY_RING_SIZE) {
+		if(!ring->overruns++)
+			fprintf(stderr, "AY write queue overrun, dropping writes\n");
+		return 1;
+	}
+	ring->writes[head % AY_RING_SIZE] = (struct AYWrite){
+		cycles, chip, reg, data };
+	atomic_store_explicit(&ring->head, head+1, memory_order_release);
+	return 0;
+}
+
+// write the latched register
+void ayWrite(struct Sound *sound, uint64_t cycles, int chip, uint8_t data) {
+	struct AY *ay = &sound->chips[chip];
+	ay->regs[ay->latch] = data;
+	pushWrite(sound, cycles, chip, ay->latch, data);
+}
+
+uint8_t ayRead(struct Sound *sound, int chip) {
+	struct AY *ay = &sound->chips[chip];
+	return ay->regs[ay->latch];
+}
+
+// let the audio thread know the cpu has got this far
+void syncSound(struct Sound *sound, uint64_t cycles) {
+	atomic_store_explicit(&sound->cycles, cycles, memory_order_release);
+}
+
+
+
+// the cpu jumped to another point in time (a state was loaded)
+// move the audio thread over to it and send it every register again
+void seekSound(struct Sound *sound, uint64_t cycles) {
+	if(!listening(sound)) return;
+	if(pushWrite(sound, cycles, AY_SEEK, 0, 0)) return;
+	atomic_fetch_add(&sound->seeks, 1);
+	for(int chip = 0; chip < AY_CHIPS; chip++)
+		for(int reg = 0; reg < AY_REGS; reg++)
+			pushWrite(sound, cycles, chip, reg, sound->chips[chip].regs[reg]);
+	syncSound(sound, cycles);
+}
+
+
+
+/* AUDIO THREAD */
+
+// when the nth sample is due
+uint64_t sampleCycle(uint64_t sample) {
+	return sample * CPU_RATE / AUDIO_RATE;
+}
+
+void applyWrite(struct AY *ay, struct AYWrite *write) {
+	ay->synthRegs[write->reg] = write->value;
+	if(write->reg >= 14) return; // io ports, not sound
+	// r13 = 255 tells ayemu to leave the envelope running
+	uint8_t regs[AY_REGS];
+	memcpy(regs, ay->synthRegs, sizeof(regs));
+	if(write->reg != 13) regs[13] = 0xff;
+	ayemu_set_regs(&ay->ay, regs);
+#ifdef DEBUG_AY
+	printAYRegisters(&ay->ay);
+#endif
+}
+
+void renderSamples(struct Sound *sound, int from, int to) {
+	if(to <= from) return;
+	for(int i = 0; i < AY_CHIPS; i++)
+		ayemu_gen_sound(&sound->chips[i].ay,
+				sound->chips[i].samples + from*2, (to-from)*4);
+}
+
+// add in to out, sticking at the limits rather than wrapping round
+void mixSamples(int16_t *out, const int16_t *in, int count) {
+	int i = 0;
+#ifdef __SSE2__
+	for(; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(out + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i), _mm_adds_epi16(a, b));
+	}
+#endif
+	for(; i < count; i++) {
+		int sum = out[i] + in[i];
+		out[i] = sum > INT16_MAX ? INT16_MAX : sum < INT16_MIN ? INT16_MIN : sum;
+	}
+}
+
+// wait until the cpu is past the end of the fragment
+// but give up after a while so a stalled cpu doesn't stall the audio
+void awaitCPU(struct Sound *sound, uint64_t end) {
+	for(int tries = 0; tries < 50; tries++) {
+		if(atomic_load_explicit(&sound->cycles, memory_order_acquire) >= end
+				|| !atomic_load(&sound->running))
+			return;
+		struct timespec ts = { 0, 200000 };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// throw away everything queued from before the last seek
+// and carry on rendering from where it went
+void seek(struct Sound *sound) {
+	struct AYRing *ring = &sound->ring;
+	while(atomic_load(&sound->seeks)) {
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		struct AYWrite *write = &ring->writes[tail % AY_RING_SIZE];
+		if(write->chip == AY_SEEK) {
+			sound->fragments = write->cycle * AUDIO_RATE / CPU_RATE
+				/ SAMPLES_PER_BUFFER;
+			atomic_fetch_sub(&sound->seeks, 1);
+		}
+		atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+	}
+}
+
+// render the next fragment of every chip, each register write landing
+// on the sample it was made at, and mix them into out
+void renderFragment(struct Sound *sound, int16_t *out) {
+	seek(sound);
+	uint64_t start = sampleCycle(sound->fragments * SAMPLES_PER_BUFFER);
+	uint64_t end = sampleCycle((sound->fragments+1) * SAMPLES_PER_BUFFER);
+	awaitCPU(sound, end);
+	struct AYRing *ring = &sound->ring;
+	int done = 0;
+	while(1) {
+		uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+		if(tail == head) break;
+		struct AYWrite *write = &ring->writes[tail % AY_RING_SIZE];
+		if(write->cycle >= end || write->chip == AY_SEEK) break;
+		// writes from before the fragment (a late cpu) land at its start
+		int at = 0;
+		if(write->cycle > start)
+			at = (write->cycle - start) * AUDIO_RATE / CPU_RATE;
+		if(at > SAMPLES_PER_BUFFER) at = SAMPLES_PER_BUFFER;
+		renderSamples(sound, done, at);
+		if(at > done) done = at;
+		applyWrite(&sound->chips[write->chip], write);
+		atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+	}
+	renderSamples(sound, done, SAMPLES_PER_BUFFER);
+	sound->fragments++;
+	memcpy(out, sound->chips[0].samples, sizeof(sound->chips[0].samples));
+	for(int i = 1; i < AY_CHIPS; i++)
+		mixSamples(out, sound->chips[i].samples, BUFFER_SAMPLES);
+}
+
+void *audioThread(void *data) {
+	struct Sound *sound = data;
+	while(atomic_load(&sound->running)) {
+		ALLEGRO_EVENT event;
+		if(!al_wait_for_event_timed(sound->queue, &event, 0.05)) continue;
+		if(event.type != ALLEGRO_EVENT_AUDIO_STREAM_FRAGMENT) continue;
+		int16_t *fragment = al_get_audio_stream_fragment(sound->stream);
+		if(!fragment) continue;
+		renderFragment(sound, fragment);
+		if(!al_set_audio_stream_fragment(sound->stream, fragment)) {
+			fprintf(stderr, "Error setting stream fragment buffer\n");
+			exit(1);
+		}
+	}
+	return NULL;
+}
+
+
+
+/* OFFLINE */
+
+// render to a wav file from this cycle on rather than to a stream, as the
+// cpu goes. the cpu isn't held back, see renderWav()
+void recordWav(struct Sound *sound, const char *filename, uint64_t cycles) {
+	sound->wav = openWav(filename, AUDIO_RATE, 2);
+	// starts the synth off with the registers as they are
+	seekSound(sound, cycles);
+}
+
+// with no stream asking for fragments, render every one the cpu is past
+void renderWav(struct Sound *sound, uint64_t cycles) {
+	int16_t fragment[BUFFER_SAMPLES];
+	syncSound(sound, cycles);
+	while(sampleCycle((sound->fragments + 1) * SAMPLES_PER_BUFFER) <= cycles) {
+		renderFragment(sound, fragment);
+		writeWav(sound->wav, fragment, BUFFER_SAMPLES);
+	}
+}
+
+// returns nonzero if the wav couldn't be written
+int finishWav(struct Sound *sound) {
+	int failed = closeWav(sound->wav);
+	sound->wav = NULL;
+	return failed;
+}
+
+
+
+/* SETUP */
+
+void initAY(struct AY* ay) {
+	ayemu_init(&ay->ay);
+	memset(ay->regs, 0, sizeof(ay->regs));
+	memset(ay->synthRegs, 0, sizeof(ay->synthRegs));
+	ay->latch = 0;
+}
+
+void initStream(struct Sound *sound) {
+	sound->stream = al_create_audio_stream(
+			AUDIO_BUFFER_FRAGS,
+			SAMPLES_PER_BUFFER,
+			AUDIO_RATE,
+			AUDIO_DEPTH,
+			AUDIO_CHANNELS);
+	if(!sound->stream)
+		fprintf(stderr, "Could not create audio stream\n");
+	else if (!al_attach_audio_stream_to_mixer(sound->stream, al_get_default_mixer()))
+		fprintf(stderr, "Could not attach audio stream to mixer\n");
+	else return;
+	exit(1);
+}
+
+// where each chip's channels go, a layout like abc (a left, b in the
+// middle, c right) or mono for every chip, or one per chip split by commas
+// returns nonzero if it isn't one
+int setPanning(struct Sound *sound, const char *panning) {
+	static const char *layouts[] = { "mono", "abc", "acb", "bac", "bca", "cab", "cba" };
+	static const ayemu_stereo_t types[] = {
+		AYEMU_MONO, AYEMU_ABC, AYEMU_ACB, AYEMU_BAC, AYEMU_BCA, AYEMU_CAB, AYEMU_CBA };
+	const char *layout = panning;
+	for(int chip = 0; chip < AY_CHIPS; chip++) {
+		int length = strcspn(layout, ",");
+		int found = -1;
+		for(int i = 0; i < (int)(sizeof(layouts) / sizeof(*layouts)); i++)
+			if((int)strlen(layouts[i]) == length && !strncmp(layout, layouts[i], length))
+				found = i;
+		if(found < 0) return 1;
+		ayemu_set_stereo(&sound->chips[chip].ay, types[found], NULL);
+		// the last layout given goes for the rest of the chips
+		if(layout[length] == ',') layout += length + 1;
+	}
+	return 0;
+}
+
+void initSound(struct Sound *sound, int headless) {
+	for(int i = 0; i < AY_CHIPS; i++)
+		initAY(&sound->chips[i]);
+	atomic_init(&sound->ring.head, 0);
+	atomic_init(&sound->ring.tail, 0);
+	sound->ring.overruns = 0;
+	atomic_init(&sound->running, 0);
+	atomic_init(&sound->cycles, 0);
+	atomic_init(&sound->seeks, 0);
+	sound->fragments = 0;
+	sound->stream = NULL;
+	sound->queue = NULL;
+	sound->wav = NULL;
+	if(headless) return;
+	initStream(sound);
+	sound->queue = al_create_event_queue();
+	al_register_event_source(sound->queue,
+			al_get_audio_stream_event_source(sound->stream));
+}
+
+void startSound(struct Sound *sound) {
+	if(!sound->queue) return;
+	atomic_store(&sound->running, 1);
+	if(pthread_create(&sound->thread, NULL, audioThread, sound)) {
+		fprintf(stderr, "Could not start the audio thread\n");
+		exit(1);
+	}
+}
+
+void destroySound(struct Sound *sound) {
+	if(atomic_load(&sound->running)) {
+		atomic_store(&sound->running, 0);
+		pthread_join(sound->thread, NULL);
+	}
+	if(sound->stream) {
+		al_drain_audio_stream(sound->stream);
+		al_destroy_audio_stream(sound->stream);
+	}
+	if(sound->queue) al_destroy_event_queue(sound->queue);
+}
@@ -0,0 +1,84 @@
+#ifndef AY_H
+#define AY_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <allegro5/allegro.h>
+#include <allegro5/allegro_audio.h>
+#include <ayemu.h>
+#include "wav.h"
+
+#define AUDIO_RATE 44100
+#define AUDIO_DEPTH ALLEGRO_AUDIO_DEPTH_INT16
+#define AUDIO_CHANNELS ALLEGRO_CHANNEL_CONF_2
+#define AUDIO_BUFFER_FRAGS 4
+#define SAMPLES_PER_BUFFER 256
+#define BUFFER_LENGTH (SAMPLES_PER_BUFFER * 2 * 2)
+#define BUFFER_SAMPLES (SAMPLES_PER_BUFFER * 2) // left and right
+
+#define AY_CHIPS 2
+#define AY_REGS 16
+#define AY_RING_SIZE 8192 // must be a power of two
+#define AY_SEEK 0xff // chip number marking a jump in time, see seekSound()
+
+// a register write, stamped with the cycle it happened on
+struct AYWrite {
+	uint64_t cycle;
+	uint8_t chip;
+	uint8_t reg;
+	uint8_t value;
+};
+
+// lock-free queue from the cpu (the only producer)
+// to the audio thread (the only consumer)
+struct AYRing {
+	struct AYWrite writes[AY_RING_SIZE];
+	_Atomic uint32_t head; // next slot the cpu fills
+	_Atomic uint32_t tail; // next slot the audio thread reads
+	int overruns;
+};
+
+struct AY {
+	ayemu_ay_t ay;
+	uint8_t regs[AY_REGS];      // as the cpu sees them
+	uint8_t latch;
+	uint8_t synthRegs[AY_REGS]; // as the synth has them, audio thread only
+	int16_t samples[BUFFER_SAMPLES]; // its part of the fragment being rendered
+};
+
+// every chip is rendered into its own buffer and they're mixed into one
+// stereo stream, see mixSamples()
+struct Sound {
+	struct AY chips[AY_CHIPS];
+	struct AYRing ring;
+	ALLEGRO_AUDIO_STREAM *stream;
+	ALLEGRO_EVENT_QUEUE *queue;
+	struct Wav *wav; // rendered to instead, see recordWav()
+	pthread_t thread;
+	atomic_int running;
+	_Atomic uint64_t cycles; // how far the cpu has got
+	atomic_int seeks;        // seek markers queued up but not yet reached
+	uint64_t fragments;      // rendered so far, audio thread only
+};
+
+// whether anything wants the sound rendered, otherwise writes go nowhere
+static inline int listening(struct Sound *sound) {
+	return sound->queue || sound->wav;
+}
+
+void initSound(struct Sound *, int);
+void startSound(struct Sound *);
+void destroySound(struct Sound *);
+void syncSound(struct Sound *, uint64_t);
+void seekSound(struct Sound *, uint64_t);
+int setPanning(struct Sound *, const char *);
+void recordWav(struct Sound *, const char *, uint64_t);
+void renderWav(struct Sound *, uint64_t);
+int finishWav(struct Sound *);
+
+void ayLatch(struct Sound *, int, uint8_t);
+void ayWrite(struct Sound *, uint64_t, int, uint8_t);
+uint8_t ayRead(struct Sound *, int);
+
+#endif
@@ -0,0 +1,294 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "aardbei.h"
+#include "batch.h"
+
+
+
+/* MANIFEST */
+
+// turn \n, \r, \t, \\ and \xNN into what they stand for, in place
+// returns nonzero if an escape is bad or would make a zero byte
+int unescape(char *text) {
+	char *out = text;
+	for(char *in = text; *in; in++) {
+		if(*in != '\\') {
+			*out++ = *in;
+			continue;
+		}
+		switch(*++in) {
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case '\\': *out++ = '\\'; break;
+			case 'x': {
+				if(!isxdigit((unsigned char)in[1]) || !isxdigit((unsigned char)in[2]))
+					return 1;
+				char hex[3] = { in[1], in[2], 0 };
+				*out = strtol(hex, NULL, 16);
+				if(!*out++) return 1;
+				in += 2;
+				break;
+			}
+			default: return 1;
+		}
+	}
+	*out = 0;
+	return 0;
+}
+
+// a line is the rom, its cycle limit and optionally the uart output it
+// has to produce, escaped, which is the rest of the line. # starts a comment
+// roms are relative to the directory the manifest is in
+struct BatchRun *readManifest(const char *filename, int *count) {
+	FILE *fp = fopen(filename, "r");
+	if(!fp) {
+		fprintf(stderr, "Could not open manifest %s\n", filename);
+		exit(1);
+	}
+	const char *slash = strrchr(filename, '/');
+	int dirLength = slash ? slash - filename + 1 : 0;
+	struct BatchRun *runs = NULL;
+	int capacity = 0;
+	*count = 0;
+	char line[BATCH_LINE];
+	for(int number = 1; fgets(line, sizeof(line), fp); number++) {
+		int length = strlen(line);
+		if(length == BATCH_LINE - 1 && line[length-1] != '\n') {
+			fprintf(stderr, "%s:%i: line too long\n", filename, number);
+			exit(1);
+		}
+		while(length && isspace((unsigned char)line[length-1])) line[--length] = 0;
+		char *start = line;
+		while(isspace((unsigned char)*start)) start++;
+		if(!*start || *start == '#') continue;
+
+		char *rom = start;
+		while(*start && !isspace((unsigned char)*start)) start++;
+		if(*start) *start++ = 0;
+		while(isspace((unsigned char)*start)) start++;
+		char *end;
+		uint64_t cycles = strtoull(start, &end, 0);
+		if(end == start || (*end && !isspace((unsigned char)*end))) {
+			fprintf(stderr, "%s:%i: expected a cycle limit after the rom\n",
+					filename, number);
+			exit(1);
+		}
+		while(isspace((unsigned char)*end)) end++;
+		char *expected = *end ? end : NULL;
+		if(expected && unescape(expected)) {
+			fprintf(stderr, "%s:%i: bad escape in the expected output\n",
+					filename, number);
+			exit(1);
+		}
+		if(!cycles && !expected) {
+			fprintf(stderr, "%s:%i: a run needs a cycle limit or expected output\n",
+					filename, number);
+			exit(1);
+		}
+
+		if(*count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			runs = realloc(runs, capacity * sizeof(struct BatchRun));
+			if(!runs) {
+				fprintf(stderr, "Out of memory for the manifest\n");
+				exit(1);
+			}
+		}
+		struct BatchRun *run = &runs[(*count)++];
+		memset(run, 0, sizeof(struct BatchRun));
+		run->cycles = cycles;
+		run->expected = expected ? strdup(expected) : NULL;
+		if(*rom == '/') run->rom = strdup(rom);
+		else {
+			run->rom = malloc(dirLength + strlen(rom) + 1);
+			if(run->rom) {
+				memcpy(run->rom, filename, dirLength);
+				strcpy(run->rom + dirLength, rom);
+			}
+		}
+		if(!run->rom || (expected && !run->expected)) {
+			fprintf(stderr, "Out of memory for the manifest\n");
+			exit(1);
+		}
+	}
+	fclose(fp);
+	return runs;
+}
+
+
+
+/* RUNNING */
+
+// the uart's sink, keeps the end of what it sends
+void captureOutput(void *data, const uint8_t *bytes, int length) {
+	struct BatchRun *run = data;
+	if(!run->output) run->output = malloc(BATCH_OUTPUT);
+	if(!run->output) return;
+	if(length >= BATCH_OUTPUT) {
+		memcpy(run->output, bytes + length - BATCH_OUTPUT, BATCH_OUTPUT);
+		run->outputLength = BATCH_OUTPUT;
+		return;
+	}
+	int keep = run->outputLength + length > BATCH_OUTPUT
+		? BATCH_OUTPUT - length : run->outputLength;
+	memmove(run->output, run->output + run->outputLength - keep, keep);
+	memcpy(run->output + keep, bytes, length);
+	run->outputLength = keep + length;
+}
+
+// a whole system of its own, nothing is shared with the other workers
+void batchRun(struct Batch *batch, struct BatchRun *run) {
+	if(access(run->rom, R_OK)) {
+		run->result = -1;
+		return;
+	}
+	struct System *system = newSystem(1);
+	system->stop.cycleLimit = run->cycles;
+	if(run->expected) setUARTPattern(system, run->expected);
+	system->peripherals.uart.sink = captureOutput;
+	system->peripherals.uart.sinkData = run;
+	if(!batch->interpret) system->blocks = newBlockCache(threadOps);
+	if(batch->jit && system->blocks) system->blocks->jit = newJIT();
+	loadMemory(&system->memory, run->rom, NULL);
+
+	long int start = nanos();
+	run->result = runHeadless(system);
+	run->nanos = nanos() - start;
+	run->ran = system->cycles;
+	run->passed = run->expected ? run->result == RUN_UART : run->result == RUN_LIMIT;
+	destroySystem(system);
+}
+
+// the next run from the front of a queue, or the back when stealing
+// -1 if it's empty
+int takeRun(struct BatchQueue *queue, int steal) {
+	pthread_mutex_lock(&queue->lock);
+	int run = -1;
+	if(queue->next < queue->end) run = steal ? --queue->end : queue->next++;
+	pthread_mutex_unlock(&queue->lock);
+	return run;
+}
+
+// works through its own queue then steals from the others until they're
+// all empty, nothing is ever added so that's the end
+void *batchWorker(void *data) {
+	struct BatchWorker *worker = data;
+	struct Batch *batch = worker->batch;
+	while(1) {
+		int run = takeRun(&batch->queues[worker->index], 0);
+		for(int i = 1; run < 0 && i < batch->workers; i++)
+			run = takeRun(&batch->queues[(worker->index + i) % batch->workers], 1);
+		if(run < 0) break;
+		batchRun(batch, &batch->runs[run]);
+	}
+	return NULL;
+}
+
+
+
+/* REPORT */
+
+// the end of what a run sent, escaped the way the manifest has it
+void printOutput(struct BatchRun *run) {
+	int first = run->outputLength > 64 ? run->outputLength - 64 : 0;
+	printf("    output: %s\"", first ? "..." : "");
+	for(int i = first; i < run->outputLength; i++) {
+		uint8_t c = run->output[i];
+		if(c == '\n') printf("\\n");
+		else if(c == '\r') printf("\\r");
+		else if(c == '\t') printf("\\t");
+		else if(c == '\\') printf("\\\\");
+		else if(c == '"' || c < 0x20 || c >= 0x7f) printf("\\x%02x", c);
+		else putchar(c);
+	}
+	printf("\"\n");
+}
+
+void printRun(struct BatchRun *run) {
+	double seconds = run->nanos / 1e9;
+	printf("%s %-32s %12" PRIu64 " cycles %8.3fs %8.1f MHz\n",
+			run->passed ? "PASS" : "FAIL", run->rom, run->ran, seconds,
+			seconds > 0 ? run->ran / seconds / 1e6 : 0);
+	if(run->passed) return;
+	switch(run->result) {
+		case -1: printf("    could not read the rom\n"); return;
+		case RUN_CRASHED: printf("    stopped at an unknown opcode\n"); break;
+		case RUN_LIMIT: printf("    reached the cycle limit\n"); break;
+		default: printf("    stopped early\n"); break;
+	}
+	if(run->outputLength) printOutput(run);
+}
+
+
+
+/* BATCH */
+
+// run everything in the manifest headless, as many at once as the host has
+// cores, and report how each went
+// returns nonzero if any of them failed
+int runBatch(const char *manifest, int interpret, int jit) {
+	struct Batch batch = { 0 };
+	batch.interpret = interpret;
+	batch.jit = jit;
+	batch.runs = readManifest(manifest, &batch.count);
+	if(!batch.count) {
+		fprintf(stderr, "Nothing to run in %s\n", manifest);
+		return 1;
+	}
+	long int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	batch.workers = cores < 1 ? 1 : cores > batch.count ? batch.count : cores;
+	batch.queues = calloc(batch.workers, sizeof(struct BatchQueue));
+	struct BatchWorker *workers = calloc(batch.workers, sizeof(struct BatchWorker));
+	if(!batch.queues || !workers) {
+		fprintf(stderr, "Out of memory for the batch\n");
+		exit(1);
+	}
+	// neighbouring lines tend to be alike, so each worker starts on a
+	// stretch of them and stealing evens out whatever's left
+	for(int i = 0; i < batch.workers; i++) {
+		pthread_mutex_init(&batch.queues[i].lock, NULL);
+		batch.queues[i].next = batch.count * i / batch.workers;
+		batch.queues[i].end = batch.count * (i + 1) / batch.workers;
+	}
+
+	long int start = nanos();
+	for(int i = 0; i < batch.workers; i++) {
+		workers[i].batch = &batch;
+		workers[i].index = i;
+		if(pthread_create(&workers[i].thread, NULL, batchWorker, &workers[i])) {
+			fprintf(stderr, "Could not start the batch workers\n");
+			exit(1);
+		}
+	}
+	for(int i = 0; i < batch.workers; i++) pthread_join(workers[i].thread, NULL);
+	double seconds = (nanos() - start) / 1e9;
+
+	int passed = 0;
+	uint64_t cycles = 0;
+	for(int i = 0; i < batch.count; i++) {
+		struct BatchRun *run = &batch.runs[i];
+		printRun(run);
+		passed += run->passed;
+		cycles += run->ran;
+		free(run->rom);
+		free(run->expected);
+		free(run->output);
+	}
+	printf("%i runs, %i passed, %i failed in %.3fs on %i thread%s, "
+			"%.1f MHz emulated in total\n",
+			batch.count, passed, batch.count - passed, seconds, batch.workers,
+			batch.workers == 1 ? "" : "s", seconds > 0 ? cycles / seconds / 1e6 : 0);
+
+	for(int i = 0; i < batch.workers; i++) pthread_mutex_destroy(&batch.queues[i].lock);
+	free(batch.queues);
+	free(workers);
+	free(batch.runs);
+	return passed < batch.count;
+}
@@ -0,0 +1,46 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define BATCH_LINE 4096    // longest manifest line
+#define BATCH_OUTPUT 65536 // uart output kept from each run, the end of it
+
+// one line of the manifest and how it went
+struct BatchRun {
+	char *rom;
+	uint64_t cycles;  // 0 for no limit
+	char *expected;   // what the uart has to send, NULL to just run to the limit
+	int result;       // see RUN_PC and co, -1 if the rom couldn't be read
+	int passed;
+	uint64_t ran;     // cycles it took
+	long int nanos;   // host time it took
+	uint8_t *output;  // the last outputLength bytes the uart sent
+	int outputLength;
+};
+
+// the runs a worker has yet to start, a contiguous range it takes from the
+// front of while other workers with nothing left steal from the back
+struct BatchQueue {
+	pthread_mutex_t lock;
+	int next, end;
+};
+
+struct Batch {
+	struct BatchRun *runs;
+	int count;
+	struct BatchQueue *queues; // one per worker
+	int workers;
+	int interpret, jit;
+};
+
+struct BatchWorker {
+	struct Batch *batch;
+	int index; // of its queue
+	pthread_t thread;
+};
+
+int runBatch(const char *, int, int);
+
+#endif
@@ -0,0 +1,492 @@
+#include <stdint.h>
+#include <string.h>
+#include "v9958.h"
+#include "sched.h"
+
+// r45
+#define ARG_MAJ 0b00000001 // lines step along y
+#define ARG_EQ  0b00000010 // srch stops on anything but the colour
+#define ARG_DIX 0b00000100 // right to left
+#define ARG_DIY 0b00001000 // bottom to top
+
+// the low nibble of r46, the t versions leave the destination
+// alone wherever the source is colour 0
+#define LOGIC_IMP 0x0
+#define LOGIC_AND 0x1
+#define LOGIC_OR  0x2
+#define LOGIC_EOR 0x3
+#define LOGIC_NOT 0x4
+#define LOGIC_T   0x8
+
+// the vdp runs at 6 times the cpu clock
+#define TICKS_PER_CYCLE 6
+
+// vdp ticks a dot or byte takes, about what the real chip manages with
+// the screen and sprites on
+static const int commandTicks[16] = {
+	[CMD_POINT] = 147, [CMD_PSET] = 147, [CMD_SRCH] = 125, [CMD_LINE] = 147,
+	[CMD_LMMV] = 137, [CMD_LMMM] = 197, [CMD_LMCM] = 137, [CMD_LMMC] = 137,
+	[CMD_HMMV] = 65, [CMD_HMMM] = 136, [CMD_YMMM] = 125, [CMD_HMMC] = 65,
+};
+
+
+
+/* ADDRESSING */
+
+// how the bitmap modes lay out their dots, the others are addressed
+// like graphic7
+void setGeometry(struct Blitter *blitter, int mode) {
+	switch(mode) {
+		case MODE_GRAPHIC4:
+			blitter->width = 256;
+			blitter->shift = 1;
+			blitter->rowShift = 7;
+			break;
+		case MODE_GRAPHIC5:
+			blitter->width = 512;
+			blitter->shift = 2;
+			blitter->rowShift = 7;
+			break;
+		case MODE_GRAPHIC6:
+			blitter->width = 512;
+			blitter->shift = 1;
+			blitter->rowShift = 8;
+			break;
+		default:
+			blitter->width = 256;
+			blitter->shift = 0;
+			blitter->rowShift = 8;
+			break;
+	}
+	blitter->bits = 8 >> blitter->shift;
+}
+
+static inline uint32_t byteAddress(struct Blitter *blitter, int x, int y) {
+	return (((y & 1023) << blitter->rowShift) + x) & VRAM_MASK;
+}
+
+static inline uint32_t dotAddress(struct Blitter *blitter, int x, int y) {
+	return byteAddress(blitter, x >> blitter->shift, y);
+}
+
+// the leftmost dot of a byte is in its high bits
+static inline int dotShift(struct Blitter *blitter, int x) {
+	return (~x & ((1 << blitter->shift) - 1)) * blitter->bits;
+}
+
+static inline uint8_t dotMask(struct Blitter *blitter) {
+	return (1 << blitter->bits) - 1;
+}
+
+// the first of n bytes going the engine's way along a row from x
+static inline uint32_t spanAddress(struct Blitter *blitter, int x, int y, int n) {
+	return byteAddress(blitter, blitter->dix > 0 ? x : x - n + 1, y);
+}
+
+static inline int getPair(uint8_t *regs) {
+	return regs[0] | regs[1] << 8;
+}
+
+static inline void setPair(uint8_t *regs, int value) {
+	regs[0] = value;
+	regs[1] = value >> 8 & 0x03;
+}
+
+// how many of n dots or bytes from x fit before the edge of the screen
+int clipSpan(int n, int x, int dix, int width) {
+	int room = dix > 0 ? width - x : x + 1;
+	return n < room ? n : room;
+}
+
+
+
+/* DOTS AND BYTES */
+
+uint8_t readDot(struct VDC *vdc, int x, int y) {
+	struct Blitter *blitter = &vdc->blitter;
+	return vdc->vram[dotAddress(blitter, x, y)] >> dotShift(blitter, x)
+		& dotMask(blitter);
+}
+
+uint8_t logicOp(int logic, uint8_t source, uint8_t destination, uint8_t mask) {
+	if(logic & LOGIC_T && !source) return destination;
+	switch(logic & 0x07) {
+		case LOGIC_IMP: return source;
+		case LOGIC_AND: return source & destination;
+		case LOGIC_OR:  return source | destination;
+		case LOGIC_EOR: return source ^ destination;
+		case LOGIC_NOT: return ~source & mask;
+		default: return destination;
+	}
+}
+
+void writeDot(struct VDC *vdc, int x, int y, uint8_t color) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint32_t address = dotAddress(blitter, x, y);
+	int shift = dotShift(blitter, x);
+	uint8_t mask = dotMask(blitter);
+	uint8_t dot = logicOp(blitter->logic, color & mask,
+			vdc->vram[address] >> shift & mask, mask);
+	vdc->vram[address] = (vdc->vram[address] & ~(mask << shift)) | dot << shift;
+	touchVRAM(vdc, address, 1);
+}
+
+void fillBytes(struct VDC *vdc, int x, int y, int n, uint8_t data) {
+	uint32_t address = spanAddress(&vdc->blitter, x, y, n);
+	memset(vdc->vram + address, data, n);
+	touchVRAM(vdc, address, n);
+}
+
+// the engine copies a byte at a time in its own direction, which only
+// comes out different from memmove when it overwrites source bytes
+// before it gets to them
+void moveBytes(struct VDC *vdc, int sx, int sy, int dx, int dy, int n) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint8_t *source = vdc->vram + spanAddress(blitter, sx, sy, n);
+	uint8_t *destination = vdc->vram + spanAddress(blitter, dx, dy, n);
+	if(blitter->dix > 0
+			? destination <= source || destination >= source + n
+			: destination >= source || destination + n <= source)
+		memmove(destination, source, n);
+	else if(blitter->dix > 0)
+		for(int i = 0; i < n; i++) destination[i] = source[i];
+	else
+		for(int i = n - 1; i >= 0; i--) destination[i] = source[i];
+	touchVRAM(vdc, destination - vdc->vram, n);
+}
+
+
+
+/* COMMANDS */
+
+int waitsOnCPU(int command) {
+	return command == CMD_LMCM || command == CMD_LMMC || command == CMD_HMMC;
+}
+
+// back to idle, leaving the y registers where the engine got to
+void finishCommand(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	int command = blitter->command;
+	if(command == CMD_LMMM || command == CMD_LMCM
+			|| command == CMD_HMMM || command == CMD_YMMM)
+		setPair(vdc->regs + 34, blitter->sy & 1023);
+	if(command >= CMD_LMMV && command != CMD_LMCM)
+		setPair(vdc->regs + 38, blitter->dy & 1023);
+	blitter->command = CMD_STOP;
+	blitter->credit = 0;
+}
+
+// on n dots or bytes along the row, and to the start of the next at its end
+void advanceCommand(struct VDC *vdc, int n) {
+	struct Blitter *blitter = &vdc->blitter;
+	blitter->sx += blitter->dix * n;
+	blitter->dx += blitter->dix * n;
+	blitter->left -= n;
+	if(blitter->left) return;
+	blitter->sx = blitter->rowSX;
+	blitter->dx = blitter->rowDX;
+	blitter->sy += blitter->diy;
+	blitter->dy += blitter->diy;
+	blitter->left = blitter->nx;
+	if(!--blitter->ny) finishCommand(vdc);
+}
+
+// lmcm has the next dot ready in s#7 before the cpu asks
+void fetchDot(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	blitter->color = readDot(vdc, blitter->sx, blitter->sy);
+	blitter->credit -= commandTicks[CMD_LMCM];
+}
+
+// r46 was written, set the engine up for the command in it
+void startCommand(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint8_t *regs = vdc->regs;
+	int command = regs[46] >> 4;
+	blitter->command = CMD_STOP;
+	blitter->credit = 0;
+	blitter->logic = regs[46] & 0x0f;
+	if(command < CMD_POINT) return; // stop, or one that does nothing
+
+	setGeometry(blitter, getModeFlags(vdc->regs));
+	blitter->sx = getPair(regs + 32) & (blitter->width - 1);
+	blitter->sy = getPair(regs + 34) & 1023;
+	blitter->dx = getPair(regs + 36) & (blitter->width - 1);
+	blitter->dy = getPair(regs + 38) & 1023;
+	blitter->dix = regs[45] & ARG_DIX ? -1 : 1;
+	blitter->diy = regs[45] & ARG_DIY ? -1 : 1;
+	blitter->command = command;
+	switch(command) {
+		case CMD_POINT:
+		case CMD_PSET:
+			return;
+		case CMD_SRCH:
+			blitter->found = 0;
+			return;
+		case CMD_LINE:
+			// nx dots along the major axis, ny along the minor
+			blitter->nx = getPair(regs + 40) & 511;
+			blitter->ny = getPair(regs + 42) & 1023;
+			blitter->left = blitter->nx + 1;
+			blitter->error = ((blitter->nx - 1) & 1023) >> 1;
+			return;
+	}
+
+	// the rest are all rectangles, 0 is as big as they go
+	int nx = getPair(regs + 40) & 511;
+	if(!nx) nx = 512;
+	blitter->ny = getPair(regs + 42) & 1023;
+	if(!blitter->ny) blitter->ny = 1024;
+	if(command >= CMD_HMMV) {
+		blitter->sx >>= blitter->shift;
+		blitter->dx >>= blitter->shift;
+		nx >>= blitter->shift;
+		int width = blitter->width >> blitter->shift;
+		if(command == CMD_YMMM) {
+			// from dx to the edge, between two lines
+			blitter->sx = blitter->dx;
+			nx = width;
+		}
+		nx = clipSpan(nx, blitter->dx, blitter->dix, width);
+		if(command == CMD_HMMM)
+			nx = clipSpan(nx, blitter->sx, blitter->dix, width);
+	} else {
+		// lmcm only has a source, lmmv and lmmc only a destination
+		if(command != CMD_LMCM)
+			nx = clipSpan(nx, blitter->dx, blitter->dix, blitter->width);
+		if(command == CMD_LMMM || command == CMD_LMCM)
+			nx = clipSpan(nx, blitter->sx, blitter->dix, blitter->width);
+	}
+	blitter->nx = nx;
+	blitter->left = nx;
+	blitter->rowSX = blitter->sx;
+	blitter->rowDX = blitter->dx;
+	if(!nx) finishCommand(vdc);
+	// the first byte for the cpu commands is already in r44
+	else if(command == CMD_LMMC || command == CMD_HMMC)
+		transferCommand(vdc, regs[44]);
+	else if(command == CMD_LMCM)
+		fetchDot(vdc);
+}
+
+// hmmv, hmmm and ymmm go a row at a time
+int64_t stepBytes(struct VDC *vdc, int64_t units) {
+	struct Blitter *blitter = &vdc->blitter;
+	int64_t done = 0;
+	while(done < units && blitter->command != CMD_STOP) {
+		int n = units - done < blitter->left ? units - done : blitter->left;
+		if(blitter->command == CMD_HMMV)
+			fillBytes(vdc, blitter->dx, blitter->dy, n, vdc->regs[44]);
+		else moveBytes(vdc, blitter->sx, blitter->sy, blitter->dx, blitter->dy, n);
+		advanceCommand(vdc, n);
+		done += n;
+	}
+	return done;
+}
+
+// how many dots from here lmmv or lmmm can do as whole bytes,
+// only plain fills and copies lined up with the bytes can
+int bulkDots(struct Blitter *blitter, int64_t units) {
+	if(blitter->logic != LOGIC_IMP) return 0;
+	int last = (1 << blitter->shift) - 1;
+	int first = blitter->dix > 0 ? 0 : last;
+	if((blitter->dx & last) != first) return 0;
+	if(blitter->command == CMD_LMMM && (blitter->sx & last) != first) return 0;
+	int n = units < blitter->left ? units : blitter->left;
+	return n & ~last;
+}
+
+// lmmv and lmmm go a dot at a time unless they can go a byte at a time
+int64_t stepDots(struct VDC *vdc, int64_t units) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint8_t mask = dotMask(blitter);
+	// the colour repeated across a byte
+	uint8_t fill = (vdc->regs[44] & mask) * (0xff / mask);
+	int64_t done = 0;
+	while(done < units && blitter->command != CMD_STOP) {
+		int n = bulkDots(blitter, units - done);
+		int bytes = n >> blitter->shift;
+		if(!n) {
+			n = 1;
+			writeDot(vdc, blitter->dx, blitter->dy, blitter->command == CMD_LMMV
+					? vdc->regs[44] : readDot(vdc, blitter->sx, blitter->sy));
+		} else if(blitter->command == CMD_LMMV)
+			fillBytes(vdc, blitter->dx >> blitter->shift, blitter->dy, bytes, fill);
+		else moveBytes(vdc, blitter->sx >> blitter->shift, blitter->sy,
+				blitter->dx >> blitter->shift, blitter->dy, bytes);
+		advanceCommand(vdc, n);
+		done += n;
+	}
+	return done;
+}
+
+// nx+1 dots, stepping along the minor axis whenever the error runs out,
+// or until it goes off the side of the screen
+int64_t stepLine(struct VDC *vdc, int64_t units) {
+	struct Blitter *blitter = &vdc->blitter;
+	int xMajor = !(vdc->regs[45] & ARG_MAJ);
+	int64_t done = 0;
+	while(done < units && blitter->command != CMD_STOP) {
+		writeDot(vdc, blitter->dx, blitter->dy, vdc->regs[44]);
+		done++;
+		if(xMajor) blitter->dx += blitter->dix;
+		else blitter->dy += blitter->diy;
+		if(blitter->error < blitter->ny) {
+			blitter->error += blitter->nx;
+			if(xMajor) blitter->dy += blitter->diy;
+			else blitter->dx += blitter->dix;
+		}
+		blitter->error = (blitter->error - blitter->ny) & 1023;
+		if(!--blitter->left || blitter->dx < 0 || blitter->dx >= blitter->width)
+			finishCommand(vdc);
+	}
+	return done;
+}
+
+// along the row from sx until the border colour turns up, or anything
+// but it with eq, or the edge of the screen does
+int64_t stepSearch(struct VDC *vdc, int64_t units) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint8_t border = vdc->regs[44] & dotMask(blitter);
+	int equal = !(vdc->regs[45] & ARG_EQ);
+	int64_t done = 0;
+	while(done < units && blitter->command != CMD_STOP) {
+		done++;
+		if((readDot(vdc, blitter->sx, blitter->sy) == border) == equal) {
+			blitter->found = 1;
+			blitter->border = blitter->sx;
+			finishCommand(vdc);
+			break;
+		}
+		blitter->sx += blitter->dix;
+		if(blitter->sx < 0 || blitter->sx >= blitter->width) finishCommand(vdc);
+	}
+	return done;
+}
+
+// do up to units dots or bytes of the command, returns how many it did
+int64_t stepCommand(struct VDC *vdc, int64_t units) {
+	struct Blitter *blitter = &vdc->blitter;
+	switch(blitter->command) {
+		case CMD_POINT:
+			blitter->color = readDot(vdc, blitter->sx, blitter->sy);
+			finishCommand(vdc);
+			return 1;
+		case CMD_PSET:
+			writeDot(vdc, blitter->dx, blitter->dy, vdc->regs[44]);
+			finishCommand(vdc);
+			return 1;
+		case CMD_SRCH:
+			return stepSearch(vdc, units);
+		case CMD_LINE:
+			return stepLine(vdc, units);
+		case CMD_LMMV:
+		case CMD_LMMM:
+			return stepDots(vdc, units);
+		case CMD_HMMV:
+		case CMD_HMMM:
+		case CMD_YMMM:
+			return stepBytes(vdc, units);
+	}
+	return 0;
+}
+
+// catch the engine up with the cpu, it gets to spend the time since it
+// last did on as many dots or bytes as that pays for
+void runCommand(struct VDC *vdc, uint64_t now) {
+	struct Blitter *blitter = &vdc->blitter;
+	if(now <= blitter->clock) return;
+	uint64_t elapsed = now - blitter->clock;
+	blitter->clock = now;
+	if(blitter->command == CMD_STOP) return;
+	blitter->credit += elapsed * TICKS_PER_CYCLE;
+	if(waitsOnCPU(blitter->command)) {
+		// time spent waiting on the cpu can't be saved up
+		if(blitter->credit > 0) blitter->credit = 0;
+		return;
+	}
+	int cost = commandTicks[blitter->command];
+	int64_t units = blitter->credit / cost;
+	if(!units) return;
+	blitter->credit -= stepCommand(vdc, units) * cost;
+	if(blitter->command == CMD_STOP) blitter->credit = 0;
+}
+
+// r44 was written, lmmc and hmmc take it as their next dot or byte
+void transferCommand(struct VDC *vdc, uint8_t data) {
+	struct Blitter *blitter = &vdc->blitter;
+	if(blitter->command == CMD_HMMC) {
+		uint32_t address = byteAddress(blitter, blitter->dx, blitter->dy);
+		vdc->vram[address] = data;
+		touchVRAM(vdc, address, 1);
+	} else if(blitter->command == CMD_LMMC)
+		writeDot(vdc, blitter->dx, blitter->dy, data);
+	else return;
+	blitter->credit -= commandTicks[blitter->command];
+	advanceCommand(vdc, 1);
+}
+
+// s#7, reading it during lmcm moves on to the next dot
+uint8_t readCommandColor(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	uint8_t color = blitter->color;
+	if(blitter->command == CMD_LMCM) {
+		advanceCommand(vdc, 1);
+		if(blitter->command == CMD_LMCM) fetchDot(vdc);
+	}
+	return color;
+}
+
+// the engine's bits of s#2: tr, bd, two that always read 1 and ce
+uint8_t commandStatus(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	int ready = waitsOnCPU(blitter->command) && blitter->credit >= 0;
+	return (ready ? 0x80 : 0)
+		| (blitter->found ? 0x10 : 0)
+		| 0x0c
+		| (blitter->command != CMD_STOP);
+}
+
+// the cycle the running command will be done on, NO_EVENT when the
+// engine is idle or waiting on the cpu
+uint64_t commandDone(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	int64_t units;
+	switch(blitter->command) {
+		case CMD_POINT:
+		case CMD_PSET:
+			units = 1;
+			break;
+		case CMD_SRCH: // unless it finds something first
+			units = blitter->dix > 0 ? blitter->width - blitter->sx : blitter->sx + 1;
+			break;
+		case CMD_LINE:
+			units = blitter->left;
+			break;
+		case CMD_LMMV:
+		case CMD_LMMM:
+		case CMD_HMMV:
+		case CMD_HMMM:
+		case CMD_YMMM:
+			units = blitter->left + (int64_t)(blitter->ny - 1) * blitter->nx;
+			break;
+		default:
+			return NO_EVENT;
+	}
+	int64_t ticks = units * commandTicks[blitter->command] - blitter->credit;
+	return blitter->clock + (ticks + TICKS_PER_CYCLE - 1) / TICKS_PER_CYCLE;
+}
+
+// until when commandStatus() can't change with the cpu leaving the engine
+// alone, as of the last runCommand()
+uint64_t commandSteady(struct VDC *vdc) {
+	struct Blitter *blitter = &vdc->blitter;
+	// it could find its colour at any dot
+	if(blitter->command == CMD_SRCH) return blitter->clock;
+	if(waitsOnCPU(blitter->command)) {
+		// tr only goes back off when the cpu takes the dot or byte
+		if(blitter->credit >= 0) return NO_EVENT;
+		return blitter->clock + (-blitter->credit + TICKS_PER_CYCLE - 1) / TICKS_PER_CYCLE;
+	}
+	return commandDone(vdc);
+}
@@ -0,0 +1,54 @@
+#ifndef BLITTER_H
+#define BLITTER_H
+
+#include <stdint.h>
+
+// commands by the high nibble of r46
+#define CMD_STOP  0x0
+#define CMD_POINT 0x4
+#define CMD_PSET  0x5
+#define CMD_SRCH  0x6
+#define CMD_LINE  0x7
+#define CMD_LMMV  0x8
+#define CMD_LMMM  0x9
+#define CMD_LMCM  0xa
+#define CMD_LMMC  0xb
+#define CMD_HMMV  0xc
+#define CMD_HMMM  0xd
+#define CMD_YMMM  0xe
+#define CMD_HMMC  0xf
+
+struct VDC;
+
+// the v9958 command engine. it runs behind the cpu and only catches up
+// when something could notice, see runCommand()
+struct Blitter {
+	int command; // the one running, CMD_STOP when idle
+	int logic;   // low nibble of r46
+	int sx, sy, dx, dy; // where it has got to
+	int rowSX, rowDX;   // where each row starts
+	int nx, ny; // dots or bytes a row, rows left
+	int left;   // dots or bytes left in this row
+	int dix, diy;
+	int error;  // line
+	// the screen mode it was started in
+	int width;    // dots a line
+	int shift;    // log2 of dots a byte
+	int bits;     // a dot
+	int rowShift; // log2 of bytes a line
+	uint8_t color; // s#7
+	int border;    // s#8 and s#9
+	int found;     // bd in s#2
+	uint64_t clock; // cpu cycle it has caught up with
+	int64_t credit; // vdp ticks it has left to spend
+};
+
+void startCommand(struct VDC *);
+void runCommand(struct VDC *, uint64_t);
+void transferCommand(struct VDC *, uint8_t);
+uint8_t readCommandColor(struct VDC *);
+uint8_t commandStatus(struct VDC *);
+uint64_t commandDone(struct VDC *);
+uint64_t commandSteady(struct VDC *);
+
+#endif
@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "memory.h"
+#include "decode.h"
+
+/* DECODER */
+
+static const uint8_t prefixes[] = { 0, 0xcb, 0xdd, 0xed };
+
+static inline uint8_t peek(struct Memory *memory, uint16_t addr) {
+	return memory->readPages[addr >> PAGE_SHIFT][addr & PAGE_MASK];
+}
+
+static inline uint16_t peekWord(struct Memory *memory, uint16_t addr) {
+	return peek(memory, addr) + (peek(memory, addr+1) << 8);
+}
+
+// work out what the instruction at pc is and how long it takes
+// without running it, the cycle counts are the same ones the z80 takes
+// with every fetch and memory access included
+void decodeOp(struct Memory *memory, uint16_t pc, struct Op *op) {
+	uint8_t opcode = peek(memory, pc);
+	int length = 1;
+	op->id = opcode;
+	op->arg = 0;
+	op->flags = 0;
+	switch(opcode) {
+		case 0x00: // nop
+		case 0x04: // inc b
+		case 0x05: // dec b
+		case 0x07: // rlca
+		case 0x08: // ex af,af'
+		case 0x0c: // inc c
+		case 0x0d: // dec c
+		case 0x0f: // rrca
+		case 0x17: // rla
+		case 0x1f: // rra
+		case 0x3c: // inc a
+		case 0x3d: // dec a
+		case 0x47: // ld b,a
+		case 0x4f: // ld c,a
+		case 0x60: // ld h,b
+		case 0x67: // ld h,a
+		case 0x69: // ld l,c
+		case 0x6f: // ld l,a
+		case 0x78: // ld a,b
+		case 0x79: // ld a,c
+		case 0x7a: // ld a,d
+		case 0x7b: // ld a,e
+		case 0xb7: // or a
+		case 0xf3: // di
+			op->cycles = 4;
+			break;
+		case 0x76: // halt
+		case 0xfb: // ei
+			// both can end the slice, see runOps()
+			op->cycles = 4;
+			op->flags = OP_ENDS_BLOCK;
+			break;
+		case 0x03: // inc bc
+		case 0x0b: // dec bc
+			op->cycles = 6;
+			break;
+		case 0x02: // ld (bc),a
+			op->cycles = 7;
+			op->flags = OP_WRITES;
+			break;
+		case 0x0a: // ld a,(bc)
+			op->cycles = 7;
+			break;
+		case 0x09: // add hl,bc
+			op->cycles = 11;
+			break;
+		case 0x06: // ld b,*
+		case 0x0e: // ld c,*
+		case 0x3e: // ld a,*
+		case 0xc6: // add a,*
+		case 0xe6: // and *
+		case 0xfe: // cp *
+			op->arg = peek(memory, pc+1);
+			op->cycles = 7;
+			length = 2;
+			break;
+		case 0x01: // ld bc,**
+		case 0x11: // ld de,**
+		case 0x31: // ld sp,**
+			op->arg = peekWord(memory, pc+1);
+			op->cycles = 10;
+			length = 3;
+			break;
+		case 0xc2: // jp nz,**
+		case 0xc3: // jp **
+		case 0xca: // jp z,**
+			op->arg = peekWord(memory, pc+1);
+			op->cycles = 10;
+			op->flags = OP_ENDS_BLOCK;
+			length = 3;
+			break;
+		case 0xcd: // call **
+			op->arg = peekWord(memory, pc+1);
+			op->cycles = 17;
+			op->flags = OP_ENDS_BLOCK | OP_WRITES;
+			length = 3;
+			break;
+		case 0xc9: // ret
+			op->cycles = 10;
+			op->flags = OP_ENDS_BLOCK;
+			break;
+		case 0xd3: // out (*),a
+			op->arg = peek(memory, pc+1);
+			op->cycles = 11;
+			op->flags = OP_ENDS_BLOCK | OP_OUT;
+			length = 2;
+			break;
+		case 0xdb: // in a,(*)
+			op->arg = peek(memory, pc+1);
+			op->cycles = 11;
+			op->flags = OP_ENDS_BLOCK | OP_IN;
+			length = 2;
+			break;
+		case 0xf1: // pop af
+			op->cycles = 10;
+			break;
+		case 0xf5: // push af
+			op->cycles = 11;
+			op->flags = OP_WRITES;
+			break;
+		case 0xcb: // bits
+			op->id = ID_CB | peek(memory, pc+1);
+			length = 2;
+			switch(op->id) {
+				case ID_CB | 0x1a: // rr d
+				case ID_CB | 0x1b: // rr e
+					op->cycles = 8;
+					break;
+				default: goto unknown;
+			}
+			break;
+		case 0xdd: // ix
+			op->id = ID_DD | peek(memory, pc+1);
+			length = 2;
+			switch(op->id) {
+				case ID_DD | 0x7c: // ld a,ixh
+				case ID_DD | 0x7d: // ld a,ixl
+					op->cycles = 8;
+					break;
+				case ID_DD | 0x23: // inc ix
+					op->cycles = 10;
+					break;
+				case ID_DD | 0x21: // ld ix,**
+					op->arg = peekWord(memory, pc+2);
+					op->cycles = 14;
+					length = 4;
+					break;
+				case ID_DD | 0x7e: // ld a,(ix+*)
+					op->arg = peek(memory, pc+2);
+					op->cycles = 19;
+					length = 3;
+					break;
+				default: goto unknown;
+			}
+			break;
+		case 0xed: // extd
+			op->id = ID_ED | peek(memory, pc+1);
+			length = 2;
+			switch(op->id) {
+				case ID_ED | 0x46: // im 0
+				case ID_ED | 0x56: // im 1
+				case ID_ED | 0x5e: // im 2
+					op->cycles = 8;
+					break;
+				case ID_ED | 0x47: // ld i,a
+				case ID_ED | 0x57: // ld a,i
+					op->cycles = 9;
+					break;
+				case ID_ED | 0x45: // retn
+				case ID_ED | 0x4d: // reti
+					op->cycles = 14;
+					op->flags = OP_ENDS_BLOCK;
+					break;
+				case ID_ED | 0x52: // sbc hl,de
+					op->cycles = 15;
+					break;
+				default: goto unknown;
+			}
+			break;
+		default:
+		unknown:
+			// runOps() complains about it if it ever gets run
+			op->arg = prefixes[op->id >> 8] << 8 | (op->id & 0xff);
+			op->cycles = 4 * length;
+			op->flags = OP_ENDS_BLOCK | OP_OUT;
+			break;
+	}
+	op->next = pc + length;
+}
+
+
+
+/* BLOCK CACHE */
+
+struct BlockCache *newBlockCache(void (*thread)(struct Op *, int)) {
+	struct BlockCache *cache = malloc(sizeof(struct BlockCache));
+	if(!cache) {
+		fprintf(stderr, "Out of memory for the block cache\n");
+		exit(1);
+	}
+	for(int i = 0; i < CACHE_BLOCKS; i++)
+		cache->blocks[i].key = NO_BLOCK;
+	cache->thread = thread;
+	cache->jit = NULL;
+	cache->breaks = NULL;
+	return cache;
+}
+
+void destroyBlockCache(struct BlockCache *cache) {
+	if(cache->jit) destroyJIT(cache->jit);
+	free(cache);
+}
+
+// some memory code was decoded from was written, forget every block
+void flushBlocks(struct BlockCache *cache, struct Memory *memory) {
+	for(int i = 0; i < CACHE_BLOCKS; i++)
+		cache->blocks[i].key = NO_BLOCK;
+	memset(memory->code, 0, sizeof(memory->code));
+	memory->codeModified = 0;
+	if(cache->jit) resetJIT(cache->jit, cache);
+}
+
+// whether an instruction runs over from one page into a page that
+// could hold different memory (the other side of the banked window)
+int crossesWindow(uint16_t pc, uint16_t next) {
+	uint16_t last = next - 1;
+	return (pc < BANK_BASE) != (last < BANK_BASE)
+		|| (pc < RAM_BASE) != (last < RAM_BASE);
+}
+
+// decode the block starting at pc into the cache
+// writes to ram or eeprom a block was decoded from trap so they can
+// flush the cache, see writeTrap()
+struct Block *decodeBlock(struct BlockCache *cache, struct Memory *memory,
+		uint16_t pc, uint32_t key) {
+	struct Block *block = &cache->blocks[(key * 2654435761u) >> 20
+		& (CACHE_BLOCKS - 1)];
+	// outside the zero-page a store can change the code that follows it,
+	// either by writing over it or by switching the flash bank
+	int changeable = pc >= BANK_BASE;
+	block->key = key;
+	block->pc = pc;
+	block->cycles = 0;
+	block->length = 0;
+	block->runs = 0;
+	block->flags = 0;
+	block->native = NULL;
+	uint16_t at = pc;
+	do {
+		if(block->length && cache->breaks && inSet(cache->breaks, at)) break;
+		struct Op *op = &block->ops[block->length];
+		decodeOp(memory, at, op);
+		if(crossesWindow(at, op->next)) {
+			// only ok alone, and even then not worth keeping
+			if(block->length) break;
+			block->key = NO_BLOCK;
+		}
+		block->length++;
+		block->cycles += op->cycles;
+		block->flags |= op->flags;
+		at = op->next;
+		if(op->flags & OP_ENDS_BLOCK) break;
+		if(changeable && op->flags & OP_WRITES) break;
+	} while(block->length < BLOCK_OPS && at >> PAGE_SHIFT == pc >> PAGE_SHIFT);
+	block->size = at - pc;
+
+	if(pc >= RAM_BASE) {
+		for(int page = pc >> PAGE_SHIFT; page <= (uint16_t)(at-1) >> PAGE_SHIFT; page++) {
+			memory->code[page] = 1;
+			memory->writePages[page] = NULL;
+		}
+	}
+	cache->thread(block->ops, block->length);
+	return block;
+}
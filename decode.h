@@ -0,0 +1,86 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdint.h>
+#include "memory.h"
+#include "jit.h"
+#include "gdb.h"
+
+// instruction ids: the opcode, with the prefix in the high byte for
+// the extended ones so every id indexes one flat handler table
+#define ID_CB 0x100
+#define ID_DD 0x200
+#define ID_ED 0x300
+#define OP_IDS 0x400
+
+// what the block builder needs to know about an instruction
+#define OP_ENDS_BLOCK 1 // jumps, io and anything unknown
+#define OP_WRITES     2 // stores to memory
+#define OP_IN         4 // reads a port
+#define OP_OUT        8 // anything else outside the cpu and memory, out or a warning
+
+#define BLOCK_OPS 32      // longest run of instructions in one block
+#define CACHE_BLOCKS 4096 // direct mapped, must be a power of two
+#define NO_BLOCK UINT32_MAX
+
+struct Core;
+struct CPUState;
+
+// an instruction decoded ahead of time
+struct Op {
+	const void *handler; // where runOps() handles the id
+	uint16_t id;
+	uint16_t arg;  // immediate operand, displacement or the unknown opcode
+	uint16_t next; // pc after it
+	uint8_t cycles; // static T cycles, memory accesses included
+	uint8_t flags;
+};
+
+// a straight run of instructions ending at a jump, io or a page boundary
+struct Block {
+	uint32_t key; // see blockKey()
+	uint16_t pc;
+	uint16_t size; // bytes it was decoded from
+	uint32_t cycles; // sum of the ops'
+	int length;
+	int runs; // times it was interpreted, see JIT_THRESHOLD
+	uint8_t flags; // all of the ops' together
+	// compiled code for it, NULL until it's hot
+	void (*native)(struct Core *, struct CPUState *, struct Memory *);
+	struct Op ops[BLOCK_OPS];
+};
+
+struct BlockCache {
+	struct Block blocks[CACHE_BLOCKS];
+	// hands the ops their handler pointers, see runOps()
+	void (*thread)(struct Op *, int);
+	struct JIT *jit; // NULL to only ever interpret
+	// the debugger's breakpoints, blocks end before them so they only
+	// have to be checked between blocks. NULL with no debugger
+	struct AddressSet *breaks;
+};
+
+void decodeOp(struct Memory *, uint16_t, struct Op *);
+struct Block *decodeBlock(struct BlockCache *, struct Memory *, uint16_t, uint32_t);
+struct BlockCache *newBlockCache(void (*)(struct Op *, int));
+void destroyBlockCache(struct BlockCache *);
+void flushBlocks(struct BlockCache *, struct Memory *);
+
+// code in the banked window is only the same code under the same bank
+static inline uint32_t blockKey(struct Memory *memory, uint16_t pc) {
+	if(pc >= BANK_BASE && pc < RAM_BASE)
+		return pc | (memory->flashBank + 1) << 16;
+	return pc;
+}
+
+static inline struct Block *lookupBlock(struct BlockCache *cache,
+		struct Memory *memory, uint16_t pc) {
+	if(memory->codeModified) flushBlocks(cache, memory);
+	uint32_t key = blockKey(memory, pc);
+	struct Block *block = &cache->blocks[(key * 2654435761u) >> 20
+		& (CACHE_BLOCKS - 1)];
+	if(block->key == key) return block;
+	return decodeBlock(cache, memory, pc, key);
+}
+
+#endif
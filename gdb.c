@@ -0,0 +1,466 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "aardbei.h"
+#include "gdb.h"
+
+// the signals gdb is told the cpu stopped with
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+// af bc de hl sp pc ix iy af' bc' de' hl' ir, the order gdb's z80 wants
+#define GDB_REGISTERS 13
+
+
+
+/* ADDRESS SETS */
+
+void addAddress(struct AddressSet *set, uint16_t addr) {
+	int page = addr >> PAGE_SHIFT;
+	uint32_t *word = &set->bits[page][(addr & PAGE_MASK) >> 5];
+	uint32_t bit = 1u << (addr & 31);
+	if(*word & bit) return;
+	*word |= bit;
+	set->count[page]++;
+	set->total++;
+}
+
+void removeAddress(struct AddressSet *set, uint16_t addr) {
+	int page = addr >> PAGE_SHIFT;
+	uint32_t *word = &set->bits[page][(addr & PAGE_MASK) >> 5];
+	uint32_t bit = 1u << (addr & 31);
+	if(!(*word & bit)) return;
+	*word &= ~bit;
+	set->count[page]--;
+	set->total--;
+}
+
+// a read or write the cpu just made, returns nonzero if it's watched
+int watchHit(struct Debugger *debugger, int write, uint16_t addr) {
+	if(!inSet(write ? &debugger->writes : &debugger->reads, addr)) return 0;
+	debugger->stop = DEBUG_WATCH;
+	debugger->watchWrite = write;
+	debugger->watchAddr = addr;
+	return 1;
+}
+
+
+
+/* CONNECTION */
+
+// take the connection gdb is making, it expects the cpu to stop for it
+void attachDebugger(struct Debugger *debugger) {
+	debugger->client = accept(debugger->listener, NULL, NULL);
+	if(debugger->client < 0) return;
+	// packets are small and each one is waited on
+	int on = 1;
+	setsockopt(debugger->client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	debugger->inLength = 0;
+	debugger->stop = DEBUG_ATTACH;
+}
+
+// listen on a tcp port on localhost if the address is a number, otherwise
+// on a unix socket at that path. with wait it doesn't return until gdb
+// has attached
+struct Debugger *newDebugger(const char *address, int wait) {
+	struct Debugger *debugger = calloc(1, sizeof(struct Debugger));
+	if(!debugger) {
+		fprintf(stderr, "Out of memory for the debugger\n");
+		exit(1);
+	}
+	debugger->client = -1;
+	char *end;
+	long port = strtol(address, &end, 10);
+	int listener;
+	if(*address && !*end) {
+		struct sockaddr_in in = { 0 };
+		in.sin_family = AF_INET;
+		in.sin_port = htons(port);
+		in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		int reuse = 1;
+		listener = socket(AF_INET, SOCK_STREAM, 0);
+		if(listener >= 0)
+			setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if(listener < 0 || bind(listener, (struct sockaddr *)&in, sizeof(in))) {
+			fprintf(stderr, "Could not listen for gdb on port %s\n", address);
+			exit(1);
+		}
+	} else {
+		struct sockaddr_un un = { 0 };
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, address, sizeof(un.sun_path) - 1);
+		unlink(address);
+		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(listener < 0 || bind(listener, (struct sockaddr *)&un, sizeof(un))) {
+			fprintf(stderr, "Could not listen for gdb on %s\n", address);
+			exit(1);
+		}
+		debugger->path = strdup(address);
+	}
+	if(listen(listener, 1)) {
+		fprintf(stderr, "Could not listen for gdb on %s\n", address);
+		exit(1);
+	}
+	debugger->listener = listener;
+	if(wait) {
+		fprintf(stderr, "Waiting for gdb on %s\n", address);
+		attachDebugger(debugger);
+	}
+	return debugger;
+}
+
+void destroyDebugger(struct Debugger *debugger) {
+	if(debugger->client >= 0) close(debugger->client);
+	close(debugger->listener);
+	if(debugger->path) unlink(debugger->path);
+	free(debugger->path);
+	free(debugger);
+}
+
+// gdb went away, everything it set goes with it
+void detachDebugger(struct System *system) {
+	struct Debugger *debugger = system->debugger;
+	close(debugger->client);
+	debugger->client = -1;
+	memset(&debugger->breaks, 0, sizeof(struct AddressSet));
+	memset(&debugger->reads, 0, sizeof(struct AddressSet));
+	memset(&debugger->writes, 0, sizeof(struct AddressSet));
+	debugger->stop = DEBUG_RUNNING;
+	debugger->resumed = 1;
+	// blocks were cut short at the breakpoints
+	system->memory.codeModified = 1;
+}
+
+// add whatever gdb sent to the buffer, waits for it if there's nothing yet
+// returns 0 if gdb hung up
+int receive(struct Debugger *debugger) {
+	if(debugger->inLength == GDB_PACKET) debugger->inLength = 0; // garbage
+	int got = recv(debugger->client, debugger->in + debugger->inLength,
+			GDB_PACKET - debugger->inLength, 0);
+	if(got <= 0) return 0;
+	debugger->inLength += got;
+	return got;
+}
+
+// see whether gdb attached or pressed ctrl-c, without waiting for it
+void pollDebugger(struct System *system) {
+	struct Debugger *debugger = system->debugger;
+	if(debugger->stop) return;
+	struct pollfd fd = {
+		debugger->client < 0 ? debugger->listener : debugger->client, POLLIN, 0
+	};
+	if(poll(&fd, 1, 0) <= 0) return;
+	if(debugger->client < 0) attachDebugger(debugger);
+	else if(!receive(debugger)) detachDebugger(system);
+	else {
+		// anything else sent while it runs is only acks
+		if(memchr(debugger->in, 0x03, debugger->inLength))
+			debugger->stop = DEBUG_INTERRUPT;
+		debugger->inLength = 0;
+	}
+}
+
+
+
+/* PACKETS */
+
+void sendPacket(struct Debugger *debugger, const char *data) {
+	char packet[GDB_PACKET + 4];
+	uint8_t sum = 0;
+	for(const char *c = data; *c; c++)
+		sum += *c;
+	int length = snprintf(packet, sizeof(packet), "$%s#%02x", data, sum);
+	send(debugger->client, packet, length, MSG_NOSIGNAL);
+}
+
+// wait for the next whole packet from gdb and acknowledge it
+// returns nonzero if gdb hung up first
+int readPacket(struct Debugger *debugger, char *packet) {
+	while(1) {
+		// acks and ctrl-c don't mean anything while stopped
+		char *start = memchr(debugger->in, '$', debugger->inLength);
+		int skip = start ? start - debugger->in : debugger->inLength;
+		memmove(debugger->in, debugger->in + skip, debugger->inLength - skip);
+		debugger->inLength -= skip;
+		char *hash = memchr(debugger->in, '#', debugger->inLength);
+		if(hash && hash + 3 <= debugger->in + debugger->inLength) {
+			int length = hash - debugger->in - 1;
+			uint8_t sum = 0;
+			for(int i = 0; i < length; i++)
+				sum += debugger->in[1 + i];
+			char check[3] = { hash[1], hash[2], 0 };
+			int good = strtol(check, NULL, 16) == sum;
+			memcpy(packet, debugger->in + 1, length);
+			packet[length] = 0;
+			int used = hash + 3 - debugger->in;
+			memmove(debugger->in, hash + 3, debugger->inLength - used);
+			debugger->inLength -= used;
+			send(debugger->client, good ? "+" : "-", 1, MSG_NOSIGNAL);
+			if(good) return 0;
+		} else if(!receive(debugger)) return 1;
+	}
+}
+
+// tell gdb why the cpu stopped
+void reportStop(struct Debugger *debugger) {
+	char reply[32];
+	if(debugger->stop == DEBUG_WATCH) {
+		// an access watchpoint is in both sets
+		const char *kind = debugger->watchWrite
+			? (inSet(&debugger->reads, debugger->watchAddr) ? "awatch" : "watch")
+			: (inSet(&debugger->writes, debugger->watchAddr) ? "awatch" : "rwatch");
+		snprintf(reply, sizeof(reply), "T%02x%s:%04x;", GDB_SIGTRAP, kind,
+				debugger->watchAddr);
+	} else snprintf(reply, sizeof(reply), "S%02x",
+			debugger->stop == DEBUG_INTERRUPT ? GDB_SIGINT : GDB_SIGTRAP);
+	sendPacket(debugger, reply);
+}
+
+
+
+/* COMMANDS */
+
+// gdb's nth register, NULL for ir which isn't stored as one word
+uint16_t *registerWord(struct Registers *regs, int n) {
+	uint16_t *words[GDB_REGISTERS - 1] = {
+		&regs->main.af, &regs->main.bc, &regs->main.de, &regs->main.hl,
+		&regs->sp, &regs->pc, &regs->ix, &regs->iy,
+		&regs->alt.af, &regs->alt.bc, &regs->alt.de, &regs->alt.hl,
+	};
+	return n < GDB_REGISTERS - 1 ? words[n] : NULL;
+}
+
+uint16_t readRegister(struct CPUState *cpu, int n) {
+	uint16_t *word = registerWord(&cpu->regs, n);
+	if(n == 0) getFlags(cpu);
+	return word ? *word : cpu->regs.i << 8 | cpu->regs.r;
+}
+
+void writeRegister(struct CPUState *cpu, int n, uint16_t value) {
+	uint16_t *word = registerWord(&cpu->regs, n);
+	if(n == 0) cpu->lazy.op = FLAGS_NONE;
+	if(word) *word = value;
+	else {
+		cpu->regs.i = value >> 8;
+		cpu->regs.r = value;
+	}
+}
+
+// two hex digits, -1 if they aren't
+int hexByte(const char *hex) {
+	int byte = 0;
+	for(int i = 0; i < 2; i++) {
+		int c = hex[i];
+		byte <<= 4;
+		if(c >= '0' && c <= '9') byte |= c - '0';
+		else if(c >= 'a' && c <= 'f') byte |= c - 'a' + 10;
+		else if(c >= 'A' && c <= 'F') byte |= c - 'A' + 10;
+		else return -1;
+	}
+	return byte;
+}
+
+// registers go over the wire as little endian hex
+void readRegisters(struct CPUState *cpu, char *reply) {
+	for(int n = 0; n < GDB_REGISTERS; n++) {
+		uint16_t value = readRegister(cpu, n);
+		sprintf(reply + n * 4, "%02x%02x", value & 0xff, value >> 8);
+	}
+}
+
+int writeRegisters(struct CPUState *cpu, const char *hex) {
+	if(strlen(hex) < GDB_REGISTERS * 4) return 1;
+	for(int n = 0; n < GDB_REGISTERS; n++) {
+		int low = hexByte(hex + n * 4), high = hexByte(hex + n * 4 + 2);
+		if(low < 0 || high < 0) return 1;
+		writeRegister(cpu, n, low | high << 8);
+	}
+	return 0;
+}
+
+// memory as the cpu sees it right now, through the flash bank
+void readMemory(struct Memory *memory, uint16_t addr, int length, char *reply) {
+	for(int i = 0; i < length; i++, addr++)
+		sprintf(reply + i * 2, "%02x",
+				memory->readPages[addr >> PAGE_SHIFT][addr & PAGE_MASK]);
+}
+
+int writeMemory(struct Memory *memory, uint16_t addr, int length, const char *hex) {
+	if(strlen(hex) < (size_t)length * 2) return 1;
+	for(int i = 0; i < length; i++) {
+		int byte = hexByte(hex + i * 2);
+		if(byte < 0) return 1;
+		pokeMemory(memory, addr + i, byte);
+	}
+	return 0;
+}
+
+// Z and z, returns nonzero for a kind it doesn't know
+int setPoint(struct System *system, int insert, int type, uint16_t addr, int length) {
+	struct Debugger *debugger = system->debugger;
+	if(type == 0 || type == 1) {
+		if(insert) addAddress(&debugger->breaks, addr);
+		else removeAddress(&debugger->breaks, addr);
+		// blocks have to be decoded again to end at it
+		system->memory.codeModified = 1;
+		return 0;
+	}
+	if(type < 2 || type > 4) return 1;
+	if(length < 1) length = 1;
+	for(int i = 0; i < length; i++) {
+		uint16_t at = addr + i;
+		if(type != 3 && insert) addAddress(&debugger->writes, at);
+		else if(type != 3) removeAddress(&debugger->writes, at);
+		if(type != 2 && insert) addAddress(&debugger->reads, at);
+		else if(type != 2) removeAddress(&debugger->reads, at);
+	}
+	return 0;
+}
+
+// run one instruction and the events it passed
+// whatever gdb changed goes in the recording before the cpu runs again
+void recordChanges(struct System *system) {
+	if(system->debugger->modified && system->recording)
+		recordState(system->recording, system, system->cycles);
+	system->debugger->modified = 0;
+}
+
+void stepDebugger(struct System *system) {
+	struct Debugger *debugger = system->debugger;
+	debugger->stop = DEBUG_RUNNING;
+	recordChanges(system);
+	step(system);
+	runEvents(&system->scheduler, system->cycles);
+	if(system->recording && system->cycles >= system->recording->due)
+		syncRecording(system->recording, system);
+	if(debugger->stop != DEBUG_WATCH) debugger->stop = DEBUG_STEP;
+}
+
+// do one thing gdb asked for
+// returns nonzero once the cpu should run again
+int handlePacket(struct System *system, char *packet) {
+	struct Debugger *debugger = system->debugger;
+	struct CPUState *cpu = &system->cpu;
+	char reply[GDB_PACKET];
+	unsigned int addr, length, type, n, value;
+	reply[0] = 0;
+	switch(packet[0]) {
+		case '?':
+			reportStop(debugger);
+			return 0;
+		case 'g':
+			readRegisters(cpu, reply);
+			break;
+		case 'G':
+			strcpy(reply, writeRegisters(cpu, packet + 1) ? "E01" : "OK");
+			debugger->modified = 1;
+			break;
+		case 'p':
+			if(sscanf(packet + 1, "%x", &n) != 1 || n >= GDB_REGISTERS)
+				strcpy(reply, "E01");
+			else {
+				value = readRegister(cpu, n);
+				sprintf(reply, "%02x%02x", value & 0xff, value >> 8);
+			}
+			break;
+		case 'P': {
+			char *equals = strchr(packet, '=');
+			int low = equals ? hexByte(equals + 1) : -1;
+			int high = equals ? hexByte(equals + 3) : -1;
+			if(sscanf(packet + 1, "%x", &n) != 1 || n >= GDB_REGISTERS
+					|| low < 0 || high < 0)
+				strcpy(reply, "E01");
+			else {
+				writeRegister(cpu, n, low | high << 8);
+				debugger->modified = 1;
+				strcpy(reply, "OK");
+			}
+			break;
+		}
+		case 'm':
+			if(sscanf(packet + 1, "%x,%x", &addr, &length) != 2)
+				strcpy(reply, "E01");
+			else {
+				if(length > GDB_PACKET / 2 - 1) length = GDB_PACKET / 2 - 1;
+				readMemory(&system->memory, addr, length, reply);
+			}
+			break;
+		case 'M': {
+			char *colon = strchr(packet, ':');
+			if(!colon || sscanf(packet + 1, "%x,%x", &addr, &length) != 2
+					|| writeMemory(&system->memory, addr, length, colon + 1))
+				strcpy(reply, "E01");
+			else strcpy(reply, "OK");
+			debugger->modified = 1;
+			break;
+		}
+		case 'Z':
+		case 'z':
+			if(sscanf(packet + 1, "%x,%x,%x", &type, &addr, &length) != 3)
+				strcpy(reply, "E01");
+			else if(!setPoint(system, packet[0] == 'Z', type, addr, length))
+				strcpy(reply, "OK");
+			break;
+		case 'c':
+			if(sscanf(packet + 1, "%x", &addr) == 1) {
+				cpu->regs.pc = addr;
+				debugger->modified = 1;
+			}
+			debugger->stop = DEBUG_RUNNING;
+			return 1;
+		case 's':
+			if(sscanf(packet + 1, "%x", &addr) == 1) {
+				cpu->regs.pc = addr;
+				debugger->modified = 1;
+			}
+			stepDebugger(system);
+			reportStop(debugger);
+			return 0;
+		case 'H':
+		case 'T':
+			strcpy(reply, "OK");
+			break;
+		case 'q':
+			if(!strncmp(packet, "qSupported", 10))
+				sprintf(reply, "PacketSize=%x", GDB_PACKET - 8);
+			else if(!strcmp(packet, "qAttached"))
+				strcpy(reply, "1"); // so quitting gdb detaches
+			break;
+		case 'D':
+			sendPacket(debugger, "OK");
+			detachDebugger(system);
+			return 1;
+		case 'k':
+			system->stop.killed = 1;
+			detachDebugger(system);
+			return 1;
+	}
+	// anything else gets the empty reply, which means it isn't supported
+	sendPacket(debugger, reply);
+	return 0;
+}
+
+// the cpu stopped for the debugger, do what gdb says until it lets it go
+void debugStop(struct System *system) {
+	struct Debugger *debugger = system->debugger;
+	char packet[GDB_PACKET];
+	// gdb asks why with ? when it has just attached
+	if(debugger->stop != DEBUG_ATTACH) reportStop(debugger);
+	while(1) {
+		if(readPacket(debugger, packet)) {
+			detachDebugger(system);
+			break;
+		}
+		if(handlePacket(system, packet)) break;
+	}
+	recordChanges(system);
+	debugger->resumed = 1;
+}
@@ -0,0 +1,59 @@
+#ifndef GDB_H
+#define GDB_H
+
+#include <stdint.h>
+#include "memory.h"
+
+// a set of z80 addresses as a bitmap per page, a page's bits are only
+// ever looked at if its count says it has some
+struct AddressSet {
+	int total;
+	uint16_t count[PAGES];
+	uint32_t bits[PAGES][PAGE_SIZE / 32];
+};
+
+static inline int inSet(struct AddressSet *set, uint16_t addr) {
+	int page = addr >> PAGE_SHIFT;
+	return set->count[page]
+		&& set->bits[page][(addr & PAGE_MASK) >> 5] >> (addr & 31) & 1;
+}
+
+// why the cpu stopped for the debugger
+#define DEBUG_RUNNING   0
+#define DEBUG_ATTACH    1 // gdb just connected
+#define DEBUG_INTERRUPT 2 // ctrl-c
+#define DEBUG_BREAK     3
+#define DEBUG_WATCH     4
+#define DEBUG_STEP      5
+
+#define GDB_PACKET 4096 // longest packet either side sends
+
+struct System;
+
+// a gdb remote protocol stub on a tcp port or unix socket
+// the cpu runs at full speed while gdb is attached as long as nothing is
+// watched: blocks end before breakpoints so they're only checked between
+// blocks, see decodeBlock() and runCycles(). watchpoints make it run an
+// instruction at a time so it can stop right after the access
+struct Debugger {
+	int listener;
+	int client; // -1 while nobody is attached
+	char *path; // the unix socket, removed at exit, NULL for tcp
+	struct AddressSet breaks;
+	struct AddressSet reads, writes; // an access watchpoint is in both
+	int stop; // DEBUG_RUNNING unless the cpu should stop for gdb
+	int watchWrite; // what the last DEBUG_WATCH hit
+	uint16_t watchAddr;
+	int resumed; // gdb let the cpu go, the realtime loop shouldn't catch up
+	int modified; // gdb changed registers or memory, a recording has to know
+	char in[GDB_PACKET]; // received and not handled yet
+	int inLength;
+};
+
+struct Debugger *newDebugger(const char *, int);
+void destroyDebugger(struct Debugger *);
+void pollDebugger(struct System *);
+void debugStop(struct System *);
+int watchHit(struct Debugger *, int, uint16_t);
+
+#endif
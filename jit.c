@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "aardbei.h"
+#include "jit.h"
+
+// compiles hot blocks to x86-64
+// the generated code is called as native(core, cpu, memory) and keeps
+// those in rbx (cpu), r12 (memory) and r13 (core) for the whole block
+// z80 registers are used where they live in the cpu state rather than
+// copied into host registers, that way anything it can't compile just
+// calls the interpreter's handler for it, see interpretOp()
+
+#if defined(__x86_64__)
+
+/* EMITTER */
+
+// host registers
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RBX 3
+#define RSI 6
+#define RDI 7
+#define R12 12
+#define R13 13
+
+#define CPU(FIELD) offsetof(struct CPUState, FIELD)
+#define REG(FIELD) CPU(regs.FIELD)
+
+void emit8(struct JIT *jit, uint8_t byte) {
+	*jit->at++ = byte;
+}
+
+void emit16(struct JIT *jit, uint16_t value) {
+	emit8(jit, value);
+	emit8(jit, value >> 8);
+}
+
+void emit32(struct JIT *jit, uint32_t value) {
+	emit16(jit, value);
+	emit16(jit, value >> 16);
+}
+
+void emit64(struct JIT *jit, uint64_t value) {
+	emit32(jit, value);
+	emit32(jit, value >> 32);
+}
+
+// the modrm for reg and [base + disp32]
+void emitMemory(struct JIT *jit, int reg, int base, int32_t disp) {
+	emit8(jit, 0x80 | (reg & 7) << 3 | (base & 7));
+	if((base & 7) == 4) emit8(jit, 0x24); // r12 needs a sib
+	emit32(jit, disp);
+}
+
+// an instruction with a memory operand, rex is added when either
+// register needs one
+void emitOp(struct JIT *jit, int rex, const char *opcode, int length,
+		int reg, int base, int32_t disp) {
+	rex |= (reg & 8 ? 0x44 : 0) | (base & 8 ? 0x41 : 0);
+	if(rex) emit8(jit, rex | 0x40);
+	for(int i = 0; i < length; i++) emit8(jit, opcode[i]);
+	emitMemory(jit, reg, base, disp);
+}
+
+// loads and stores of the cpu state, all through rbx
+void loadByte(struct JIT *jit, int reg, int offset) { // movzx r32,byte
+	emitOp(jit, 0, "\x0f\xb6", 2, reg, RBX, offset);
+}
+
+void loadWord(struct JIT *jit, int reg, int offset) { // movzx r32,word
+	emitOp(jit, 0, "\x0f\xb7", 2, reg, RBX, offset);
+}
+
+void storeByte(struct JIT *jit, int reg, int offset) { // mov byte,r8
+	emitOp(jit, 0, "\x88", 1, reg, RBX, offset);
+}
+
+void storeImmediate8(struct JIT *jit, int offset, uint8_t value) {
+	emitOp(jit, 0, "\xc6", 1, 0, RBX, offset);
+	emit8(jit, value);
+}
+
+void storeImmediate16(struct JIT *jit, int offset, uint16_t value) {
+	emit8(jit, 0x66);
+	emitOp(jit, 0, "\xc7", 1, 0, RBX, offset);
+	emit16(jit, value);
+}
+
+// call a c function, the stack is kept aligned by the prologue
+void emitCall(struct JIT *jit, void *function) {
+	emit8(jit, 0x48); // mov rax,imm64
+	emit8(jit, 0xb8);
+	emit64(jit, (uint64_t)function);
+	emit8(jit, 0xff); // call rax
+	emit8(jit, 0xd0);
+}
+
+// a forward jump, patched by landJump()
+uint8_t *emitJump(struct JIT *jit, uint8_t opcode) {
+	emit8(jit, opcode);
+	emit8(jit, 0);
+	return jit->at;
+}
+
+void landJump(struct JIT *jit, uint8_t *from) {
+	from[-1] = jit->at - from;
+}
+
+
+
+/* Z80 */
+
+// set core->pc
+void emitSetPC(struct JIT *jit, uint16_t pc) {
+	emit8(jit, 0x66);
+	emitOp(jit, 0, "\xc7", 1, 0, R13, offsetof(struct Core, pc));
+	emit16(jit, pc);
+}
+
+// F into al, the same as getFlags() which only gets called if it
+// actually has work to do
+void emitGetFlags(struct JIT *jit) {
+	loadByte(jit, RAX, REG(main.f));
+	emitOp(jit, 0, "\x80", 1, 7, RBX, CPU(lazy.op)); // cmp byte,FLAGS_NONE
+	emit8(jit, FLAGS_NONE);
+	uint8_t *done = emitJump(jit, 0x74); // je
+	emit8(jit, 0x48); // mov rdi,rbx
+	emit8(jit, 0x89);
+	emit8(jit, 0xdf);
+	emitCall(jit, getFlags);
+	landJump(jit, done);
+}
+
+// record an alu op for the lazy flags, the result is in al
+// and pre in cl if it has one
+void emitLazyFlags(struct JIT *jit, int op, int hasPre) {
+	storeByte(jit, RAX, CPU(lazy.post));
+	if(hasPre) storeByte(jit, RCX, CPU(lazy.pre));
+	else storeImmediate8(jit, CPU(lazy.pre), 0);
+	storeImmediate8(jit, CPU(lazy.carry), 0);
+	storeImmediate8(jit, CPU(lazy.op), op);
+}
+
+// inc and dec r, the carry is kept from before
+void emitIncDec(struct JIT *jit, int offset, int dec) {
+	emitGetFlags(jit);
+	emit8(jit, 0x24); // and al,C_FLAG
+	emit8(jit, C_FLAG);
+	storeByte(jit, RAX, CPU(lazy.keep));
+	emitOp(jit, 0, "\xfe", 1, dec, RBX, offset); // inc/dec byte
+	loadByte(jit, RAX, offset);
+	emitLazyFlags(jit, dec ? FLAGS_DEC : FLAGS_INC, 0);
+}
+
+// inc and dec rr
+void emitIncDecWord(struct JIT *jit, int offset, int dec) {
+	emit8(jit, 0x66);
+	emitOp(jit, 0, "\xff", 1, dec, RBX, offset);
+}
+
+// a = (eax), eax being a z80 address
+void emitReadA(struct JIT *jit) {
+	emit8(jit, 0x89); emit8(jit, 0xc1); // mov ecx,eax
+	emit8(jit, 0xc1); emit8(jit, 0xe9); emit8(jit, PAGE_SHIFT); // shr ecx,8
+	emit8(jit, 0x0f); emit8(jit, 0xb6); emit8(jit, 0xc0); // movzx eax,al
+	// mov rdx,[r12 + rcx*8 + readPages]
+	emit8(jit, 0x49); emit8(jit, 0x8b); emit8(jit, 0x94); emit8(jit, 0xcc);
+	emit32(jit, offsetof(struct Memory, readPages));
+	// movzx eax,byte [rdx+rax]
+	emit8(jit, 0x0f); emit8(jit, 0xb6); emit8(jit, 0x04); emit8(jit, 0x02);
+	storeByte(jit, RAX, REG(main.a));
+}
+
+// (esi) = a, esi being a z80 address, through writeTrap() if the page
+// isn't writable straight away
+void emitWriteA(struct JIT *jit) {
+	emit8(jit, 0x89); emit8(jit, 0xf1); // mov ecx,esi
+	emit8(jit, 0xc1); emit8(jit, 0xe9); emit8(jit, PAGE_SHIFT); // shr ecx,8
+	// mov rax,[r12 + rcx*8 + writePages]
+	emit8(jit, 0x49); emit8(jit, 0x8b); emit8(jit, 0x84); emit8(jit, 0xcc);
+	emit32(jit, offsetof(struct Memory, writePages));
+	emit8(jit, 0x48); emit8(jit, 0x85); emit8(jit, 0xc0); // test rax,rax
+	uint8_t *trap = emitJump(jit, 0x74); // jz
+	emit8(jit, 0x89); emit8(jit, 0xf1); // mov ecx,esi
+	emit8(jit, 0x0f); emit8(jit, 0xb6); emit8(jit, 0xc9); // movzx ecx,cl
+	loadByte(jit, RDX, REG(main.a));
+	emit8(jit, 0x88); emit8(jit, 0x14); emit8(jit, 0x08); // mov [rax+rcx],dl
+	uint8_t *done = emitJump(jit, 0xeb); // jmp
+	landJump(jit, trap);
+	emit8(jit, 0x4c); emit8(jit, 0x89); emit8(jit, 0xe7); // mov rdi,r12
+	loadByte(jit, RDX, REG(main.a));
+	emitCall(jit, writeTrap);
+	landJump(jit, done);
+}
+
+// jp z,** and jp nz,**
+void emitJumpZ(struct JIT *jit, struct Op *op, int ifZ) {
+	emitGetFlags(jit);
+	emit8(jit, 0xb9); emit32(jit, op->next); // mov ecx,next
+	emit8(jit, 0xba); emit32(jit, op->arg);  // mov edx,arg
+	emit8(jit, 0xa8); emit8(jit, Z_FLAG);    // test al,Z_FLAG
+	// cmovnz or cmovz ecx,edx
+	emit8(jit, 0x0f); emit8(jit, ifZ ? 0x45 : 0x44); emit8(jit, 0xca);
+	// mov [r13+pc],cx
+	emit8(jit, 0x66);
+	emitOp(jit, 0, "\x89", 1, RCX, R13, offsetof(struct Core, pc));
+}
+
+// the interpreter does the op instead, it leaves core->pc after it
+void emitInterpret(struct JIT *jit, struct Op *op) {
+	emit8(jit, 0x4c); emit8(jit, 0x89); emit8(jit, 0xef); // mov rdi,r13
+	emit8(jit, 0x48); emit8(jit, 0xbe); emit64(jit, (uint64_t)op); // mov rsi,op
+	emitCall(jit, interpretOp);
+}
+
+// 8 bit register moves, by id
+int moveSource(int id) {
+	switch(id) {
+		case 0x47: case 0x4f: case 0x67: case 0x6f: return REG(main.a);
+		case 0x60: case 0x78: return REG(main.b);
+		case 0x69: case 0x79: return REG(main.c);
+		case 0x7a: return REG(main.d);
+		case 0x7b: return REG(main.e);
+		case ID_DD | 0x7c: return REG(ixh);
+		case ID_DD | 0x7d: return REG(ixl);
+	}
+	return -1;
+}
+
+int moveTarget(int id) {
+	switch(id) {
+		case 0x47: case 0x06: return REG(main.b);
+		case 0x4f: case 0x0e: return REG(main.c);
+		case 0x60: case 0x67: return REG(main.h);
+		case 0x69: case 0x6f: return REG(main.l);
+		default: return REG(main.a);
+	}
+}
+
+// compile one op, returns nonzero if it left core->pc set
+int compileOp(struct JIT *jit, struct Op *op) {
+	switch(op->id) {
+		case 0x00: // nop
+			break;
+		case 0x01: // ld bc,**
+			storeImmediate16(jit, REG(main.bc), op->arg);
+			break;
+		case 0x11: // ld de,**
+			storeImmediate16(jit, REG(main.de), op->arg);
+			break;
+		case ID_DD | 0x21: // ld ix,**
+			storeImmediate16(jit, REG(ix), op->arg);
+			break;
+		case 0x03: // inc bc
+			emitIncDecWord(jit, REG(main.bc), 0);
+			break;
+		case 0x0b: // dec bc
+			emitIncDecWord(jit, REG(main.bc), 1);
+			break;
+		case ID_DD | 0x23: // inc ix
+			emitIncDecWord(jit, REG(ix), 0);
+			break;
+		case 0x04: // inc b
+			emitIncDec(jit, REG(main.b), 0);
+			break;
+		case 0x0c: // inc c
+			emitIncDec(jit, REG(main.c), 0);
+			break;
+		case 0x3c: // inc a
+			emitIncDec(jit, REG(main.a), 0);
+			break;
+		case 0x05: // dec b
+			emitIncDec(jit, REG(main.b), 1);
+			break;
+		case 0x0d: // dec c
+			emitIncDec(jit, REG(main.c), 1);
+			break;
+		case 0x3d: // dec a
+			emitIncDec(jit, REG(main.a), 1);
+			break;
+		case 0x06: // ld b,*
+		case 0x0e: // ld c,*
+		case 0x3e: // ld a,*
+			storeImmediate8(jit, moveTarget(op->id), op->arg);
+			break;
+		case 0x47: case 0x4f: case 0x60: case 0x67: case 0x69: case 0x6f:
+		case 0x78: case 0x79: case 0x7a: case 0x7b:
+		case ID_DD | 0x7c: case ID_DD | 0x7d: // ld r,r
+			loadByte(jit, RAX, moveSource(op->id));
+			storeByte(jit, RAX, moveTarget(op->id));
+			break;
+		case 0x0a: // ld a,(bc)
+			loadWord(jit, RAX, REG(main.bc));
+			emitReadA(jit);
+			break;
+		case ID_DD | 0x7e: // ld a,(ix+*)
+			loadWord(jit, RAX, REG(ix));
+			emit8(jit, 0x05); emit32(jit, op->arg);       // add eax,arg
+			emit8(jit, 0x0f); emit8(jit, 0xb7); emit8(jit, 0xc0); // movzx eax,ax
+			emitReadA(jit);
+			break;
+		case 0x02: // ld (bc),a
+			loadWord(jit, RSI, REG(main.bc));
+			emitWriteA(jit);
+			break;
+		case 0xb7: // or a
+			loadByte(jit, RAX, REG(main.a));
+			emitLazyFlags(jit, FLAGS_LOGIC, 0);
+			break;
+		case 0xc6: // add a,*
+		case 0xe6: // and *
+		case 0xfe: // cp *
+			loadByte(jit, RAX, REG(main.a));
+			emit8(jit, 0x88); emit8(jit, 0xc1); // mov cl,al
+			// add, and or sub al,imm8
+			emit8(jit, op->id == 0xc6 ? 0x04 : op->id == 0xe6 ? 0x24 : 0x2c);
+			emit8(jit, op->arg);
+			if(op->id != 0xfe) storeByte(jit, RAX, REG(main.a));
+			if(op->id == 0xc6) emitLazyFlags(jit, FLAGS_ADD, 1);
+			else if(op->id == 0xe6) emitLazyFlags(jit, FLAGS_AND, 0);
+			else emitLazyFlags(jit, FLAGS_SUB, 1);
+			break;
+		case 0xc3: // jp **
+			emitSetPC(jit, op->arg);
+			return 1;
+		case 0xc2: // jp nz,**
+			emitJumpZ(jit, op, 0);
+			return 1;
+		case 0xca: // jp z,**
+			emitJumpZ(jit, op, 1);
+			return 1;
+		default:
+			emitInterpret(jit, op);
+			return 1;
+	}
+	return 0;
+}
+
+
+
+/* ARENA */
+
+// the arena is never writable and executable at once: the pages a block
+// is going into are made writable while it's compiled, then executable
+int protectArena(struct JIT *jit, size_t from, size_t to, int prot) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	from = from / page * page;
+	to = (to + page - 1) / page * page;
+	if(to > JIT_ARENA_SIZE) to = JIT_ARENA_SIZE;
+	return mprotect(jit->code + from, to - from, prot);
+}
+
+struct JIT *newJIT(void) {
+	struct JIT *jit = calloc(1, sizeof(struct JIT));
+	jit->code = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(jit->code == MAP_FAILED) {
+		fprintf(stderr, "Could not map memory for the JIT, interpreting instead\n");
+		free(jit);
+		return NULL;
+	}
+	// a hardened kernel can refuse to ever make it executable
+	if(protectArena(jit, 0, JIT_ARENA_SIZE, PROT_READ | PROT_EXEC)) {
+		fprintf(stderr, "Could not make the JIT's memory executable, interpreting instead\n");
+		munmap(jit->code, JIT_ARENA_SIZE);
+		free(jit);
+		return NULL;
+	}
+	return jit;
+}
+
+void compileBlock(struct JIT *jit, struct BlockCache *cache, struct Block *block) {
+	if(jit->used + JIT_BLOCK_ROOM > JIT_ARENA_SIZE) resetJIT(jit, cache);
+	uint8_t *start = jit->code + jit->used;
+	if(protectArena(jit, jit->used, jit->used + JIT_BLOCK_ROOM, PROT_READ | PROT_WRITE)) {
+		fprintf(stderr, "Could not make the JIT's memory writable\n");
+		exit(1);
+	}
+	jit->at = start;
+	emit8(jit, 0x53);                   // push rbx
+	emit8(jit, 0x41); emit8(jit, 0x54); // push r12
+	emit8(jit, 0x41); emit8(jit, 0x55); // push r13
+	emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xfd); // mov r13,rdi
+	emit8(jit, 0x48); emit8(jit, 0x89); emit8(jit, 0xf3); // mov rbx,rsi
+	emit8(jit, 0x49); emit8(jit, 0x89); emit8(jit, 0xd4); // mov r12,rdx
+	int pcSet = 0;
+	for(int i = 0; i < block->length; i++)
+		pcSet = compileOp(jit, &block->ops[i]);
+	if(!pcSet) emitSetPC(jit, block->ops[block->length-1].next);
+	emit8(jit, 0x41); emit8(jit, 0x5d); // pop r13
+	emit8(jit, 0x41); emit8(jit, 0x5c); // pop r12
+	emit8(jit, 0x5b);                   // pop rbx
+	emit8(jit, 0xc3);                   // ret
+	if(protectArena(jit, start - jit->code, jit->at - jit->code, PROT_READ | PROT_EXEC)) {
+		fprintf(stderr, "Could not make the JIT's memory executable\n");
+		exit(1);
+	}
+	jit->used += jit->at - start;
+	block->native = (void *)start;
+}
+
+#else
+
+struct JIT *newJIT(void) {
+	fprintf(stderr, "The JIT only targets x86-64, interpreting instead\n");
+	return NULL;
+}
+
+void compileBlock(struct JIT *jit, struct BlockCache *cache, struct Block *block) {
+}
+
+#endif
+
+void destroyJIT(struct JIT *jit) {
+	munmap(jit->code, JIT_ARENA_SIZE);
+	free(jit);
+}
+
+// throw away all the compiled code
+void resetJIT(struct JIT *jit, struct BlockCache *cache) {
+	jit->used = 0;
+	for(int i = 0; i < CACHE_BLOCKS; i++) {
+		cache->blocks[i].native = NULL;
+		cache->blocks[i].runs = 0;
+	}
+}
@@ -0,0 +1,28 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// how many times a block is interpreted before it gets compiled
+#define JIT_THRESHOLD 64
+#define JIT_ARENA_SIZE (1024*1024*4)
+// room one block could possibly need, the arena starts over below this
+#define JIT_BLOCK_ROOM (1024*4)
+
+struct Block;
+struct BlockCache;
+
+// executable memory compiled blocks are bumped into
+struct JIT {
+	uint8_t *code;
+	size_t used;
+	uint8_t *at; // where the block being compiled is up to
+};
+
+struct JIT *newJIT(void);
+void destroyJIT(struct JIT *);
+void resetJIT(struct JIT *, struct BlockCache *);
+void compileBlock(struct JIT *, struct BlockCache *, struct Block *);
+
+#endif
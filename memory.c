@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "memory.h"
+
+/* IMAGES */
+
+// map an image file into memory
+// a shared image writes back to the file, a private one is copy-on-write
+// with no file the image is just zeroed memory
+uint8_t *mapImage(const char *filename, int size, int shared) {
+	uint8_t *image = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(image == MAP_FAILED) {
+		fprintf(stderr, "Could not allocate %i bytes\n", size);
+		exit(1);
+	}
+	if(!filename) return image;
+
+	int fd = open(filename, shared ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Could not open %s\n", filename);
+		exit(1);
+	}
+	int length = size;
+	if(shared && st.st_size < size && ftruncate(fd, size)) {
+		fprintf(stderr, "Could not resize %s\n", filename);
+		exit(1);
+	}
+	// a short rom only covers the start, past its end stays zeroed
+	if(!shared && st.st_size < size) length = st.st_size;
+	if(length && mmap(image, length, PROT_READ | PROT_WRITE,
+				(shared ? MAP_SHARED : MAP_PRIVATE) | MAP_FIXED,
+				fd, 0) == MAP_FAILED) {
+		fprintf(stderr, "Could not map %s\n", filename);
+		exit(1);
+	}
+	close(fd);
+	return image;
+}
+
+// zeroed images until loadMemory() is given some files
+void initMemory(struct Memory *memory) {
+	memory->flash = mapImage(NULL, FLASH_SIZE, 0);
+	memory->eeprom = mapImage(NULL, EEPROM_SIZE, 0);
+	memory->eepromPersistent = 0;
+	mapMemory(memory);
+}
+
+// map the rom into flash and, if given, a save file into eeprom
+// the rom is never written back, the eeprom always is
+void loadMemory(struct Memory *memory, const char *rom, const char *eeprom) {
+	munmap(memory->flash, FLASH_SIZE);
+	memory->flash = mapImage(rom, FLASH_SIZE, 0);
+	if(eeprom) {
+		munmap(memory->eeprom, EEPROM_SIZE);
+		memory->eeprom = mapImage(eeprom, EEPROM_SIZE, 1);
+		memory->eepromPersistent = 1;
+	}
+	mapMemory(memory);
+}
+
+// write the dirty eeprom pages back to the file in one go
+void syncMemory(struct Memory *memory) {
+	if(!memory->eepromPersistent) return;
+	long hostPage = sysconf(_SC_PAGESIZE);
+	long synced = -1;
+	for(int page = 0; page < EEPROM_PAGES; page++) {
+		if(!takeDirty(memory, (EEPROM_BASE >> PAGE_SHIFT) + page, DIRTY_SYNC))
+			continue;
+		long offset = (long)page * PAGE_SIZE / hostPage * hostPage;
+		if(offset == synced) continue;
+		msync(memory->eeprom + offset, hostPage, MS_ASYNC);
+		synced = offset;
+	}
+}
+
+void destroyMemory(struct Memory *memory) {
+	syncMemory(memory);
+	munmap(memory->flash, FLASH_SIZE);
+	munmap(memory->eeprom, EEPROM_SIZE);
+}
+
+
+
+/* PAGE TABLE */
+
+void mapPages(struct Memory *memory, uint16_t base, int size,
+		uint8_t *host, int writable) {
+	for(int offset = 0; offset < size; offset += PAGE_SIZE) {
+		int page = (base + offset) >> PAGE_SHIFT;
+		memory->readPages[page] = host + offset;
+		memory->writePages[page] = writable ? host + offset : NULL;
+	}
+}
+
+// build the page table from scratch
+void mapMemory(struct Memory *memory) {
+	// zero-page is always the start of flash
+	mapPages(memory, 0, BANK_BASE, memory->flash, 0);
+	setFlashBank(memory, memory->flashBank);
+	mapPages(memory, RAM_BASE, RAM_SIZE, memory->ram, 0);
+	mapPages(memory, EEPROM_BASE, EEPROM_SIZE, memory->eeprom, 0);
+	memset(memory->dirty, 0, sizeof(memory->dirty));
+	memory->codeModified = 1;
+}
+
+// switch which bank of flash shows up after the zero-page
+void setFlashBank(struct Memory *memory, uint8_t bank) {
+	memory->flashBank = bank;
+	uint8_t *host = &memory->flash[BANK_SIZE * (bank % FLASH_BANKS)];
+	mapPages(memory, BANK_BASE, BANK_SIZE, host, 0);
+}
+
+// somewhere read-only or clean was written to
+void writeTrap(struct Memory *memory, uint16_t addr, uint8_t data) {
+	int page = addr >> PAGE_SHIFT;
+	if(addr < RAM_BASE) // flash bank latch
+		setFlashBank(memory, data);
+	else { // first write to a clean page or one holding cached code
+		if(memory->code[page]) memory->codeModified = 1;
+		memory->dirty[page] = DIRTY_ALL;
+		memory->writePages[page] = memory->readPages[page];
+		memory->writePages[page][addr & PAGE_MASK] = data;
+	}
+}
+
+// a write from outside the cpu (the debugger), straight into whatever is
+// mapped there, even flash, with none of the side effects of a trap
+void pokeMemory(struct Memory *memory, uint16_t addr, uint8_t data) {
+	int page = addr >> PAGE_SHIFT;
+	memory->readPages[page][addr & PAGE_MASK] = data;
+	if(addr >= RAM_BASE) memory->dirty[page] = DIRTY_ALL;
+	memory->codeModified = 1;
+}
+
+// whether a page was written to since the last time whoever
+// owns this dirty bit asked, the next write to it will trap again
+int takeDirty(struct Memory *memory, int page, int bit) {
+	if(!(memory->dirty[page] & bit)) return 0;
+	memory->dirty[page] &= ~bit;
+	memory->writePages[page] = NULL;
+	return 1;
+}
+
+// forget about every write so far as far as one dirty bit is concerned
+void cleanMemory(struct Memory *memory, int bit) {
+	for(int page = RAM_BASE >> PAGE_SHIFT; page < PAGES; page++)
+		takeDirty(memory, page, bit);
+}
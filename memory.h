@@ -0,0 +1,59 @@
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stdint.h>
+
+#define EEPROM_SIZE (1024*8)
+#define RAM_SIZE    (1024*24)
+#define BANK_SIZE   (1024*16)
+#define FLASH_SIZE  (1024*512)
+#define FLASH_BANKS (FLASH_SIZE / BANK_SIZE)
+
+#define EEPROM_BASE (1024*56)
+#define RAM_BASE    (1024*32)
+#define BANK_BASE   (1024*16)
+
+// the z80 address space is mapped in pages of host memory
+#define PAGE_SHIFT 8
+#define PAGE_SIZE  (1 << PAGE_SHIFT)
+#define PAGE_MASK  (PAGE_SIZE - 1)
+#define PAGES      (0x10000 / PAGE_SIZE)
+
+#define EEPROM_PAGES (EEPROM_SIZE / PAGE_SIZE)
+
+// who still has to see that a page was written to
+#define DIRTY_SYNC     1 // syncMemory()
+#define DIRTY_SNAPSHOT 2 // the rewind buffer
+#define DIRTY_ALL      (DIRTY_SYNC | DIRTY_SNAPSHOT)
+
+struct Memory {
+	uint8_t *eeprom; // mmapped image files
+	uint8_t *flash;
+	uint8_t ram[RAM_SIZE];
+	uint8_t flashBank;
+	// where each page lives on the host, rebuilt when the bank changes
+	// writes to a page with no write pointer go to writeTrap() instead
+	uint8_t *readPages[PAGES];
+	uint8_t *writePages[PAGES];
+	// ram and eeprom pages start out write-trapped so the first write
+	// to each one marks it dirty, see takeDirty()
+	uint8_t dirty[PAGES];
+	// pages the block cache decoded code from, they're kept write-trapped
+	// so writing to one can set codeModified and flush the cache
+	uint8_t code[PAGES];
+	int codeModified;
+	int eepromPersistent;
+};
+
+void initMemory(struct Memory *);
+void loadMemory(struct Memory *, const char *, const char *);
+void syncMemory(struct Memory *);
+void destroyMemory(struct Memory *);
+void mapMemory(struct Memory *);
+void setFlashBank(struct Memory *, uint8_t);
+void writeTrap(struct Memory *, uint16_t, uint8_t);
+void pokeMemory(struct Memory *, uint16_t, uint8_t);
+int takeDirty(struct Memory *, int, int);
+void cleanMemory(struct Memory *, int);
+
+#endif
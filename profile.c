@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include "profile.h"
+
+// how much of each table the report shows
+#define REPORT_SPOTS 40
+#define REPORT_FUNCTIONS 20
+#define REPORT_LOOPS 20
+
+
+
+/* COUNTING */
+
+struct Profile *newProfile(const char *file) {
+	struct Profile *profile = calloc(1, sizeof(struct Profile));
+	if(profile) profile->spots = calloc(PROFILE_KEYS, sizeof(struct ProfileSpot));
+	if(profile) profile->nodes = calloc(PROFILE_NODES, sizeof(struct ProfileNode));
+	if(!profile || !profile->spots || !profile->nodes) {
+		fprintf(stderr, "Out of memory for the profiler\n");
+		exit(1);
+	}
+	profile->file = file;
+	// whatever was running when profiling started is the root
+	profile->nodes[0].parent = -1;
+	profile->nodes[0].child = -1;
+	profile->nodeCount = 1;
+	profile->jumpedFrom = NO_BLOCK;
+	return profile;
+}
+
+void destroyProfile(struct Profile *profile) {
+	free(profile->spots);
+	free(profile->nodes);
+	free(profile);
+}
+
+// like blockKey() but dense, so the keys can index an array
+static inline uint32_t profileKey(struct Memory *memory, uint16_t pc) {
+	if(pc >= BANK_BASE && pc < RAM_BASE)
+		return 0x10000 + memory->flashBank % FLASH_BANKS * BANK_SIZE
+			+ pc - BANK_BASE;
+	return pc;
+}
+
+// the callee's node under the current one, made the first time
+// it's called from here
+int calleeNode(struct Profile *profile, int parent, uint32_t key) {
+	struct ProfileNode *nodes = profile->nodes;
+	for(int node = nodes[parent].child; node >= 0; node = nodes[node].sibling)
+		if(nodes[node].key == key) return node;
+	if(profile->nodeCount == PROFILE_NODES) return parent;
+	int node = profile->nodeCount++;
+	nodes[node].key = key;
+	nodes[node].parent = parent;
+	nodes[node].child = -1;
+	nodes[node].sibling = nodes[parent].child;
+	nodes[parent].child = node;
+	return node;
+}
+
+void countLoop(struct Profile *profile, uint32_t from, uint32_t to) {
+	uint32_t hash = (from * 2654435761u ^ to) & (PROFILE_LOOPS - 1);
+	for(int i = 0; i < PROFILE_LOOPS; i++) {
+		struct ProfileLoop *loop = &profile->loops[(hash + i) & (PROFILE_LOOPS - 1)];
+		if(!loop->iterations) {
+			loop->from = from;
+			loop->to = to;
+		} else if(loop->from != from || loop->to != to) continue;
+		loop->iterations++;
+		return;
+	}
+}
+
+// count an instruction that's about to run at pc with the stack at sp
+// calls and rets are followed to keep track of the calling context
+void profileOp(struct Profile *profile, struct Memory *memory, uint16_t pc,
+		uint16_t sp, struct Op *op) {
+	uint32_t key = profileKey(memory, pc);
+	profile->spots[key].count++;
+	profile->spots[key].cycles += op->cycles;
+	profile->instructions++;
+	profile->cycles += op->cycles;
+	struct ProfileFrame *frame = &profile->stack[profile->depth];
+	profile->nodes[frame->node].cycles += op->cycles;
+
+	// the last instruction jumped back here, that's a loop going round
+	if(profile->jumpedFrom != NO_BLOCK && pc <= profile->jumpedPC)
+		countLoop(profile, profile->jumpedFrom, key);
+	profile->jumpedFrom = NO_BLOCK;
+
+	switch(op->id) {
+		case 0xc2: // jp nz,**
+		case 0xc3: // jp **
+		case 0xca: // jp z,**
+			profile->jumpedFrom = key;
+			profile->jumpedPC = pc;
+			break;
+		case 0xcd: // call **
+			// too deep and it just stays in the caller, its ret
+			// won't find a frame to pop either
+			if(profile->depth + 1 == PROFILE_DEPTH) break;
+			int node = calleeNode(profile, frame->node, profileKey(memory, op->arg));
+			profile->nodes[node].calls++;
+			frame++;
+			frame->node = node;
+			frame->sp = sp - 2;
+			profile->depth++;
+			break;
+		case 0xc9: // ret
+		case ID_ED | 0x45: // retn
+		case ID_ED | 0x4d: // reti
+			// everything whose return address is at or below the one being
+			// popped has returned, even if it was dropped rather than ret
+			while(profile->depth && profile->stack[profile->depth].sp <= sp)
+				profile->depth--;
+			break;
+	}
+}
+
+// the cpu took an interrupt to addr, pushing the pc to sp. it's counted
+// as a call from whatever was running, the entry's cycles included
+void profileInterrupt(struct Profile *profile, struct Memory *memory, uint16_t addr,
+		uint16_t sp, int cycles) {
+	profile->jumpedFrom = NO_BLOCK;
+	profile->cycles += cycles;
+	struct ProfileFrame *frame = &profile->stack[profile->depth];
+	if(profile->depth + 1 == PROFILE_DEPTH) {
+		profile->nodes[frame->node].cycles += cycles;
+		return;
+	}
+	int node = calleeNode(profile, frame->node, profileKey(memory, addr));
+	profile->nodes[node].calls++;
+	profile->nodes[node].cycles += cycles;
+	frame++;
+	frame->node = node;
+	frame->sp = sp;
+	profile->depth++;
+}
+
+// an in or out just ran and the host took nanos over it
+void profilePort(struct Profile *profile, struct Op *op, long int nanos) {
+	struct ProfilePort *port = &profile->ports[op->arg & 0xff];
+	if(op->id == 0xdb) port->reads++;
+	else port->writes++;
+	port->cycles += op->cycles;
+	port->nanos += nanos;
+}
+
+
+
+/* REPORT */
+
+// -1 outside of the banked window
+int keyBank(uint32_t key) {
+	return key < 0x10000 ? -1 : (key - 0x10000) / BANK_SIZE;
+}
+
+// how an address is shown, bank:address in the banked window
+void keyName(uint32_t key, char *name) {
+	if(key < 0x10000) sprintf(name, "0x%04x", key);
+	else sprintf(name, "%d:0x%04x", keyBank(key),
+			BANK_BASE + (key - 0x10000) % BANK_SIZE);
+}
+
+// where a function's own cycles and those of everything it called go
+struct Function {
+	uint32_t key;
+	uint64_t calls;
+	uint64_t self;
+	uint64_t total;
+};
+
+// things to sort, all by cycles descending
+struct Ranked {
+	uint32_t key;
+	uint64_t cycles;
+	uint64_t count;
+	uint32_t to;
+};
+
+int compareRanked(const void *a, const void *b) {
+	uint64_t x = ((const struct Ranked *)a)->cycles;
+	uint64_t y = ((const struct Ranked *)b)->cycles;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int compareFunctions(const void *a, const void *b) {
+	const struct Function *x = a, *y = b;
+	if(x->key != y->key) return x->key < y->key ? -1 : 1;
+	return 0;
+}
+
+int compareTotals(const void *a, const void *b) {
+	uint64_t x = ((const struct Function *)a)->total;
+	uint64_t y = ((const struct Function *)b)->total;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+double percent(uint64_t part, uint64_t whole) {
+	return whole ? 100.0 * part / whole : 0;
+}
+
+void reportSpots(struct Profile *profile, FILE *fp) {
+	int count = 0;
+	struct Ranked *ranked = malloc(PROFILE_KEYS * sizeof(struct Ranked));
+	if(!ranked) return;
+	for(uint32_t key = 0; key < PROFILE_KEYS; key++) {
+		if(!profile->spots[key].count) continue;
+		ranked[count].key = key;
+		ranked[count].cycles = profile->spots[key].cycles;
+		ranked[count++].count = profile->spots[key].count;
+	}
+	qsort(ranked, count, sizeof(struct Ranked), compareRanked);
+	fprintf(fp, "\nhot spots\n%14s %7s %14s  %s\n", "cycles", "%", "count", "address");
+	for(int i = 0; i < count && i < REPORT_SPOTS; i++) {
+		char name[16];
+		keyName(ranked[i].key, name);
+		fprintf(fp, "%14" PRIu64 " %6.2f%% %14" PRIu64 "  %s\n", ranked[i].cycles,
+				percent(ranked[i].cycles, profile->cycles), ranked[i].count, name);
+	}
+	free(ranked);
+}
+
+// self and total cycles for each function over every context it was in,
+// recursion only counts towards its total once
+void reportFunctions(struct Profile *profile, FILE *fp) {
+	struct ProfileNode *nodes = profile->nodes;
+	int count = profile->nodeCount;
+	uint64_t *inclusive = malloc(count * sizeof(uint64_t));
+	struct Function *functions = malloc(count * sizeof(struct Function));
+	if(!inclusive || !functions) goto done;
+	// callees always come after their callers
+	for(int node = 0; node < count; node++) inclusive[node] = nodes[node].cycles;
+	for(int node = count-1; node > 0; node--) inclusive[nodes[node].parent] += inclusive[node];
+	for(int node = 0; node < count; node++) {
+		int outer = nodes[node].parent;
+		while(outer > 0 && nodes[outer].key != nodes[node].key) outer = nodes[outer].parent;
+		functions[node].key = node ? nodes[node].key : NO_BLOCK;
+		functions[node].calls = nodes[node].calls;
+		functions[node].self = nodes[node].cycles;
+		functions[node].total = outer > 0 ? 0 : inclusive[node];
+	}
+	// the root isn't a function, it sorts last and gets left off
+	qsort(functions, count, sizeof(struct Function), compareFunctions);
+	int merged = 0;
+	for(int i = 0; i < count - 1; i++) {
+		if(merged && functions[merged-1].key == functions[i].key) {
+			functions[merged-1].calls += functions[i].calls;
+			functions[merged-1].self += functions[i].self;
+			functions[merged-1].total += functions[i].total;
+		} else functions[merged++] = functions[i];
+	}
+	qsort(functions, merged, sizeof(struct Function), compareTotals);
+	fprintf(fp, "\nfunctions\n%14s %7s %14s %7s %12s  %s\n",
+			"total", "%", "self", "%", "calls", "entry");
+	for(int i = 0; i < merged && i < REPORT_FUNCTIONS; i++) {
+		char name[16];
+		keyName(functions[i].key, name);
+		fprintf(fp, "%14" PRIu64 " %6.2f%% %14" PRIu64 " %6.2f%% %12" PRIu64 "  %s\n",
+				functions[i].total, percent(functions[i].total, profile->cycles),
+				functions[i].self, percent(functions[i].self, profile->cycles),
+				functions[i].calls, name);
+	}
+done:
+	free(inclusive);
+	free(functions);
+}
+
+// loops by the cycles spent from their head down to the jump back,
+// that doesn't include whatever they call
+void reportLoops(struct Profile *profile, FILE *fp) {
+	struct Ranked ranked[PROFILE_LOOPS];
+	int count = 0;
+	for(int i = 0; i < PROFILE_LOOPS; i++) {
+		struct ProfileLoop *loop = &profile->loops[i];
+		if(!loop->iterations) continue;
+		uint64_t cycles = 0;
+		// only a loop that stays within one bank has a body to add up
+		if(loop->to <= loop->from && keyBank(loop->to) == keyBank(loop->from))
+			for(uint32_t key = loop->to; key <= loop->from; key++)
+				cycles += profile->spots[key].cycles;
+		ranked[count].key = loop->from;
+		ranked[count].to = loop->to;
+		ranked[count].cycles = cycles;
+		ranked[count++].count = loop->iterations;
+	}
+	qsort(ranked, count, sizeof(struct Ranked), compareRanked);
+	fprintf(fp, "\nhot loops\n%14s %7s %14s  %s\n", "cycles", "%", "iterations", "head..jump");
+	for(int i = 0; i < count && i < REPORT_LOOPS; i++) {
+		char head[16], jump[16];
+		keyName(ranked[i].to, head);
+		keyName(ranked[i].key, jump);
+		fprintf(fp, "%14" PRIu64 " %6.2f%% %14" PRIu64 "  %s..%s\n", ranked[i].cycles,
+				percent(ranked[i].cycles, profile->cycles), ranked[i].count, head, jump);
+	}
+}
+
+void reportPorts(struct Profile *profile, FILE *fp) {
+	fprintf(fp, "\nio ports\n%6s %12s %12s %14s %12s\n",
+			"port", "reads", "writes", "cycles", "host us");
+	for(int i = 0; i < PROFILE_PORTS; i++) {
+		struct ProfilePort *port = &profile->ports[i];
+		if(!port->reads && !port->writes) continue;
+		fprintf(fp, "  0x%02x %12" PRIu64 " %12" PRIu64 " %14" PRIu64 " %12" PRIu64 "\n",
+				i, port->reads, port->writes, port->cycles, port->nanos / 1000);
+	}
+}
+
+// one line per calling context with cycles of its own, the format
+// flamegraph.pl and friends read
+void writeStacks(struct Profile *profile, FILE *fp) {
+	struct ProfileNode *nodes = profile->nodes;
+	int path[PROFILE_DEPTH];
+	for(int node = 0; node < profile->nodeCount; node++) {
+		if(!nodes[node].cycles) continue;
+		int depth = 0;
+		for(int at = node; at > 0; at = nodes[at].parent) path[depth++] = at;
+		fprintf(fp, "start");
+		while(depth--) {
+			char name[16];
+			keyName(nodes[path[depth]].key, name);
+			fprintf(fp, ";%s", name);
+		}
+		fprintf(fp, " %" PRIu64 "\n", nodes[node].cycles);
+	}
+}
+
+// the report goes to the profile's file and the stacks next to it
+// in file.folded, returns nonzero if either couldn't be written
+int writeProfile(struct Profile *profile) {
+	FILE *fp = fopen(profile->file, "w");
+	if(!fp) {
+		fprintf(stderr, "Could not write the profile to %s\n", profile->file);
+		return 1;
+	}
+	fprintf(fp, "%" PRIu64 " instructions, %" PRIu64 " T cycles\n",
+			profile->instructions, profile->cycles);
+	reportSpots(profile, fp);
+	reportFunctions(profile, fp);
+	reportLoops(profile, fp);
+	reportPorts(profile, fp);
+	int failed = fclose(fp);
+
+	char *stacks = malloc(strlen(profile->file) + sizeof(".folded"));
+	if(!stacks) return 1;
+	sprintf(stacks, "%s.folded", profile->file);
+	fp = fopen(stacks, "w");
+	if(fp) {
+		writeStacks(profile, fp);
+		failed |= fclose(fp);
+	} else failed = 1;
+	if(failed) fprintf(stderr, "Could not write the profile to %s\n", stacks);
+	free(stacks);
+	return failed;
+}
@@ -0,0 +1,72 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdint.h>
+#include "memory.h"
+#include "decode.h"
+
+// a profile key for every address the cpu can see, the banked window
+// once for each flash bank
+#define PROFILE_KEYS (0x10000 + FLASH_BANKS * BANK_SIZE)
+#define PROFILE_DEPTH 256  // calls deeper than this count towards their caller
+#define PROFILE_NODES 65536 // calling contexts kept, same again past this
+#define PROFILE_LOOPS 4096 // backward jumps kept, must be a power of two
+#define PROFILE_PORTS 256
+
+// where the cpu spent its time at one address
+struct ProfileSpot {
+	uint64_t count;  // instructions run
+	uint64_t cycles; // T cycles they took
+};
+
+// a function in one calling context, see the collapsed stacks
+struct ProfileNode {
+	uint32_t key;  // its entry point
+	int parent;    // -1 for the root
+	int child;     // first callee, -1 for none
+	int sibling;   // next callee of the parent
+	uint64_t calls;
+	uint64_t cycles; // self, callees not included
+};
+
+// an active call, popped by the ret that returns past it
+struct ProfileFrame {
+	int node;
+	uint16_t sp; // where its return address is
+};
+
+// a jump back to an earlier address
+struct ProfileLoop {
+	uint32_t from, to; // keys
+	uint64_t iterations; // 0 when the slot is free
+};
+
+struct ProfilePort {
+	uint64_t reads, writes;
+	uint64_t cycles; // of the in and out instructions
+	uint64_t nanos;  // the host spent emulating them
+};
+
+struct Profile {
+	const char *file;
+	struct ProfileSpot *spots; // PROFILE_KEYS of them
+	struct ProfileNode *nodes;
+	int nodeCount;
+	struct ProfileFrame stack[PROFILE_DEPTH];
+	int depth;
+	struct ProfileLoop loops[PROFILE_LOOPS];
+	uint32_t jumpedFrom; // key of the jump just run, NO_BLOCK if it wasn't one
+	uint16_t jumpedPC;
+	struct ProfilePort ports[PROFILE_PORTS];
+	uint64_t instructions;
+	uint64_t cycles;
+};
+
+struct Profile *newProfile(const char *);
+void destroyProfile(struct Profile *);
+void profileOp(struct Profile *, struct Memory *, uint16_t, uint16_t, struct Op *);
+void profileInterrupt(struct Profile *, struct Memory *, uint16_t, uint16_t, int);
+void profilePort(struct Profile *, struct Op *, long int);
+int writeProfile(struct Profile *);
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include "aardbei.h"
+#include "record.h"
+
+
+
+/* HASHING */
+
+// fnv-1a, carrying on from hash
+uint64_t hashBytes(uint64_t hash, const uint8_t *data, size_t size) {
+	for(size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3;
+	return hash;
+}
+
+#define HASH_START 0xcbf29ce484222325
+
+// everything a state holds, so two runs that hash the same at the same
+// cycle are in the same place
+uint64_t hashState(struct System *system) {
+	struct StateBuffer buffer = { 0 };
+	putState(&buffer, system);
+	uint64_t hash = hashBytes(HASH_START, buffer.data, buffer.size);
+	free(buffer.data);
+	return hash;
+}
+
+
+
+/* RECORDING */
+
+// the first checkpoint after this cycle, they're on whole emulated seconds
+// so loading a state doesn't move them about
+uint64_t nextCheckpoint(uint64_t cycle) {
+	return (cycle / CHECKPOINT_CYCLES + 1) * CHECKPOINT_CYCLES;
+}
+
+void writeEntry(struct Recording *recording, uint64_t cycle, int type,
+		const void *data, int length) {
+	struct InputEntry entry = { cycle, type, length };
+	if(fwrite(&entry, sizeof(entry), 1, recording->fp) != 1
+			|| (length && fwrite(data, length, 1, recording->fp) != 1))
+		recording->failed = 1;
+}
+
+// bytes from outside the machine got to it at this cycle
+void recordInput(struct Recording *recording, uint64_t cycle, int type,
+		const void *data, int length) {
+	if(!recording->replaying) writeEntry(recording, cycle, type, data, length);
+}
+
+// the uart's tap, see readInput()
+void recordUART(void *data, uint64_t cycle, const uint8_t *bytes, int length) {
+	recordInput(data, cycle, INPUT_UART, bytes, length);
+}
+
+// the host replaced the machine at this cycle, which it may have moved
+void recordState(struct Recording *recording, struct System *system, uint64_t cycle) {
+	if(recording->replaying) return;
+	struct StateBuffer buffer = { 0 };
+	putState(&buffer, system);
+	writeEntry(recording, cycle, INPUT_STATE, buffer.data, buffer.size);
+	free(buffer.data);
+	recording->due = nextCheckpoint(system->cycles);
+}
+
+void writeCheck(struct Recording *recording, struct System *system) {
+	uint64_t hash = hashState(system);
+	writeEntry(recording, system->cycles, INPUT_CHECK, &hash, sizeof(hash));
+	recording->checks++;
+}
+
+// starts with the whole machine as it is now, so the eeprom and any loaded
+// state come along
+struct Recording *newRecording(const char *filename, struct System *system) {
+	struct Recording *recording = calloc(1, sizeof(struct Recording));
+	if(!recording) {
+		fprintf(stderr, "Out of memory for the recording\n");
+		exit(1);
+	}
+	recording->fp = fopen(filename, "wb");
+	if(!recording->fp) {
+		fprintf(stderr, "Could not open recording %s\n", filename);
+		exit(1);
+	}
+	recording->filename = filename;
+	recording->system = system;
+	struct RecordHeader header = { RECORD_MAGIC, RECORD_VERSION,
+		sizeof(struct InputEntry),
+		hashBytes(HASH_START, system->memory.flash, FLASH_SIZE) };
+	if(fwrite(&header, sizeof(header), 1, recording->fp) != 1) recording->failed = 1;
+	recordState(recording, system, system->cycles);
+	struct UART *uart = &system->peripherals.uart;
+	uart->tap = recordUART;
+	uart->inputData = recording;
+	return recording;
+}
+
+
+
+/* REPLAYING */
+
+int streamOf(int type) {
+	return type == INPUT_UART ? STREAM_UART : STREAM_MACHINE;
+}
+
+// the next entry in a stream, NULL if there are no more
+struct InputEntry *peekEntry(struct Recording *recording, int stream) {
+	struct ReplayCursor *cursor = &recording->cursors[stream];
+	if(cursor->data >= 0) return &cursor->entry;
+	if(cursor->done) return NULL;
+	FILE *fp = recording->fp;
+	if(!fseek(fp, cursor->after, SEEK_SET)) {
+		while(fread(&cursor->entry, sizeof(struct InputEntry), 1, fp) == 1) {
+			long data = ftell(fp);
+			if(streamOf(cursor->entry.type) == stream) {
+				cursor->data = data;
+				cursor->after = data + cursor->entry.length;
+				return &cursor->entry;
+			}
+			if(fseek(fp, cursor->entry.length, SEEK_CUR)) break;
+		}
+	}
+	cursor->done = 1;
+	return NULL;
+}
+
+// read the data of the entry peekEntry() gave and move on past it
+// returns nonzero if it couldn't be read
+int takeEntry(struct Recording *recording, int stream, void *data) {
+	struct ReplayCursor *cursor = &recording->cursors[stream];
+	int length = cursor->entry.length;
+	int failed = fseek(recording->fp, cursor->data, SEEK_SET)
+		|| (length && fread(data, length, 1, recording->fp) != 1);
+	cursor->data = -1;
+	return failed;
+}
+
+void diverge(struct Recording *recording, const char *why) {
+	fprintf(stderr, "Replay diverged at cycle %" PRIu64 " after %i checkpoints: %s\n",
+			recording->system->cycles, recording->checks, why);
+	recording->diverged = 1;
+	recording->system->stop.diverged = 1;
+	recording->due = NO_EVENT;
+}
+
+// what was recorded for this cycle, into a buffer of space bytes
+// returns how many bytes that was, 0 if nothing was
+int replayInput(struct Recording *recording, uint64_t cycle, int type,
+		void *buffer, int space) {
+	int stream = streamOf(type);
+	struct InputEntry *entry = peekEntry(recording, stream);
+	if(recording->diverged || !entry || entry->cycle > cycle) return 0;
+	if(entry->cycle < cycle || entry->type != (uint32_t)type
+			|| entry->length > (uint32_t)space) {
+		diverge(recording, "input got there at another time");
+		return 0;
+	}
+	int length = entry->length;
+	if(takeEntry(recording, stream, buffer)) {
+		diverge(recording, "the recording is cut short");
+		return 0;
+	}
+	return length;
+}
+
+// the uart's source, see readInput()
+int replayUART(void *data, uint64_t cycle, uint8_t *buffer, int space) {
+	return replayInput(data, cycle, INPUT_UART, buffer, space);
+}
+
+// put back the state the recording has next, it's already been peeked
+// returns nonzero if it isn't a valid one
+int replayState(struct Recording *recording, struct System *system) {
+	struct StateBuffer buffer = { 0 };
+	buffer.size = recording->cursors[STREAM_MACHINE].entry.length;
+	buffer.data = malloc(buffer.size);
+	int failed = !buffer.data || takeEntry(recording, STREAM_MACHINE, buffer.data)
+		|| getState(&buffer, system);
+	free(buffer.data);
+	return failed;
+}
+
+void replayDue(struct Recording *recording) {
+	struct InputEntry *entry = peekEntry(recording, STREAM_MACHINE);
+	recording->due = entry && entry->type != INPUT_END ? entry->cycle : NO_EVENT;
+}
+
+// the machine starts the way the recording did, whatever else it was given
+struct Recording *openReplay(const char *filename, struct System *system) {
+	struct Recording *recording = calloc(1, sizeof(struct Recording));
+	if(!recording) {
+		fprintf(stderr, "Out of memory for the replay\n");
+		exit(1);
+	}
+	recording->fp = fopen(filename, "rb");
+	if(!recording->fp) {
+		fprintf(stderr, "Could not open recording %s\n", filename);
+		exit(1);
+	}
+	recording->filename = filename;
+	recording->system = system;
+	recording->replaying = 1;
+	struct RecordHeader header;
+	if(fread(&header, sizeof(header), 1, recording->fp) != 1
+			|| memcmp(header.magic, RECORD_MAGIC, 8)
+			|| header.version != RECORD_VERSION
+			|| header.entrySize != sizeof(struct InputEntry)) {
+		fprintf(stderr, "%s is not a recording from this version\n", filename);
+		exit(1);
+	}
+	if(header.romHash != hashBytes(HASH_START, system->memory.flash, FLASH_SIZE)) {
+		fprintf(stderr, "%s was recorded with another rom\n", filename);
+		exit(1);
+	}
+	// it only ends properly if the emulator got to quit
+	struct InputEntry last;
+	if(fseek(recording->fp, -(long)sizeof(last), SEEK_END)
+			|| fread(&last, sizeof(last), 1, recording->fp) != 1
+			|| last.type != INPUT_END || last.length) {
+		fprintf(stderr, "%s doesn't have an end\n", filename);
+		exit(1);
+	}
+	recording->end = last.cycle;
+	for(int i = 0; i < STREAMS; i++) {
+		recording->cursors[i].data = -1;
+		recording->cursors[i].after = sizeof(header);
+	}
+	struct InputEntry *first = peekEntry(recording, STREAM_MACHINE);
+	if(!first || first->type != INPUT_STATE || replayState(recording, system)) {
+		fprintf(stderr, "%s doesn't start with a valid state\n", filename);
+		exit(1);
+	}
+	replayDue(recording);
+	struct UART *uart = &system->peripherals.uart;
+	uart->source = replayUART;
+	uart->inputData = recording;
+	return recording;
+}
+
+
+
+/* BOTH */
+
+// checkpoints, and states the host put in, happen between time slices
+// once every event due by then has run, so which order events due at the
+// same cycle go in doesn't matter
+void syncRecording(struct Recording *recording, struct System *system) {
+	if(!recording->replaying) {
+		if(system->cycles < recording->due) return;
+		writeCheck(recording, system);
+		recording->due = nextCheckpoint(system->cycles);
+		return;
+	}
+	while(system->cycles >= recording->due) {
+		struct InputEntry *entry = peekEntry(recording, STREAM_MACHINE);
+		uint64_t hash;
+		if(entry->cycle != system->cycles)
+			diverge(recording, "it ran past the next entry in the recording");
+		else if(entry->type == INPUT_CHECK) {
+			if(entry->length != sizeof(hash) || takeEntry(recording, STREAM_MACHINE, &hash))
+				diverge(recording, "a checkpoint in the recording is not valid");
+			else if(hash != hashState(system))
+				diverge(recording, "the machine doesn't hash the same");
+			else recording->checks++;
+		} else if(entry->type == INPUT_STATE) {
+			if(replayState(recording, system))
+				diverge(recording, "a state in the recording is not valid");
+		} else diverge(recording, "the recording has something unknown in it");
+		if(recording->diverged) return;
+		replayDue(recording);
+	}
+}
+
+// returns nonzero if the recording couldn't be written or the replay
+// didn't match it
+int finishRecording(struct Recording *recording, struct System *system) {
+	if(recording->replaying) {
+		if(recording->diverged) return 1;
+		if(system->cycles == recording->end)
+			fprintf(stderr, "Replay matched all %i checkpoints over %" PRIu64 " cycles\n",
+					recording->checks, system->cycles);
+		else fprintf(stderr, "Replay matched %i checkpoints up to cycle %" PRIu64
+				", the recording goes on to %" PRIu64 "\n",
+				recording->checks, system->cycles, recording->end);
+		return 0;
+	}
+	writeCheck(recording, system);
+	writeEntry(recording, system->cycles, INPUT_END, NULL, 0);
+	if(fflush(recording->fp)) recording->failed = 1;
+	if(recording->failed)
+		fprintf(stderr, "Could not write recording %s\n", recording->filename);
+	return recording->failed;
+}
+
+void destroyRecording(struct Recording *recording) {
+	struct UART *uart = &recording->system->peripherals.uart;
+	uart->tap = NULL;
+	uart->source = NULL;
+	fclose(recording->fp);
+	free(recording);
+}
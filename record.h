@@ -0,0 +1,77 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "sched.h"
+
+#define RECORD_MAGIC "AARDINP\n"
+#define RECORD_VERSION 1
+
+// a recording hashes the machine this often for a replay to check against
+#define CHECKPOINT_CYCLES CPU_RATE
+
+// what an entry is. everything that gets into the machine from outside
+// goes in as one, at the cycle it got there, so a replay can put it back
+// at exactly the same point
+#define INPUT_UART  0 // bytes the uart read from its host end
+#define INPUT_STATE 1 // the whole machine, at the start and whenever the host
+                      // replaced it: a loaded state, rewinding or gdb
+#define INPUT_CHECK 2 // a hash of the machine, see hashState()
+#define INPUT_END   3 // the recording stopped here
+#define INPUT_TYPES 4
+
+struct RecordHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t entrySize; // sizeof(struct InputEntry)
+	uint64_t romHash;   // a replay needs the same rom
+};
+
+// followed by length bytes of data
+struct InputEntry {
+	uint64_t cycle;
+	uint32_t type;
+	uint32_t length;
+};
+
+// a replay reads the uart's entries on their own, from their own place
+// in the file, and everything else in order from another
+#define STREAM_UART    0
+#define STREAM_MACHINE 1
+#define STREAMS        2
+
+struct ReplayCursor {
+	struct InputEntry entry; // the next one in the stream, once looked for
+	long data;  // where its data is, -1 if it hasn't been looked for
+	long after; // where to look for the one after
+	int done;   // there are no more
+};
+
+struct System;
+
+// an input log being written or replayed
+struct Recording {
+	FILE *fp;
+	const char *filename;
+	int replaying;
+	int failed;   // couldn't write
+	uint64_t due; // when syncRecording() next has something to do
+	uint64_t end; // replaying: where the recording stopped
+	int checks;   // checkpoints written, or matched
+	int diverged; // replaying: the machine stopped matching the recording
+	struct System *system;
+	struct ReplayCursor cursors[STREAMS];
+};
+
+struct Recording *newRecording(const char *, struct System *);
+struct Recording *openReplay(const char *, struct System *);
+int finishRecording(struct Recording *, struct System *);
+void destroyRecording(struct Recording *);
+void recordInput(struct Recording *, uint64_t, int, const void *, int);
+int replayInput(struct Recording *, uint64_t, int, void *, int);
+void recordState(struct Recording *, struct System *, uint64_t);
+void syncRecording(struct Recording *, struct System *);
+uint64_t hashState(struct System *);
+
+#endif
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <allegro5/allegro.h>
+#include "render.h"
+
+
+
+/* HANDOFF */
+
+struct Renderer *newRenderer() {
+	struct Renderer *renderer = calloc(1, sizeof(struct Renderer));
+	if(!renderer) {
+		fprintf(stderr, "Out of memory for the renderer\n");
+		exit(1);
+	}
+	atomic_init(&renderer->ready, 1);
+	atomic_init(&renderer->running, 0);
+	renderer->back = 0;
+	renderer->front = 2;
+	renderer->width = 1;
+	renderer->height = 1;
+	if(sem_init(&renderer->wake, 0, 0)) {
+		fprintf(stderr, "Could not create the render thread's semaphore\n");
+		exit(1);
+	}
+	al_set_new_display_flags(ALLEGRO_GENERATE_EXPOSE_EVENTS);
+	renderer->display = al_create_display(1, 1);
+	if(!renderer->display) {
+		fprintf(stderr, "Allegro display could not be created\n");
+		exit(1);
+	}
+	renderer->bitmap = al_create_bitmap(FRAME_WIDTH, FRAME_HEIGHT);
+	if(!renderer->bitmap) {
+		fprintf(stderr, "Allegro framebuffer could not be created\n");
+		exit(1);
+	}
+	return renderer;
+}
+
+// whether anything on screen could look different from the last frame
+// handed over
+int screenChanged(struct Renderer *renderer, struct VDC *vdc, int blinkPhase) {
+	if(vdc->redraw || blinkPhase != renderer->blinkPhase) return 1;
+	for(int page = 0; page < VRAM_PAGES; page++)
+		if(vdc->vramChanged[page]) return 1;
+	return 0;
+}
+
+// copy the vdc into the back screen and swap it for the ready one,
+// emulation thread only. unchanged frames aren't handed over at all
+void publishScreen(struct Renderer *renderer, struct VDC *vdc) {
+	int blinkPhase = getModeFlags(vdc->regs) == MODE_TEXT2
+		&& getBlinkPhase(vdc->regs, vdc->frames);
+	if(!screenChanged(renderer, vdc, blinkPhase)) return;
+	renderer->blinkPhase = blinkPhase;
+	struct Screen *screen = &renderer->screens[renderer->back];
+	screen->serial = ++renderer->serial;
+	screen->frames = vdc->frames;
+	screen->redraw = vdc->redraw;
+	memcpy(screen->regs, vdc->regs, VDC_REGS);
+	memcpy(screen->palette, vdc->palette, sizeof(screen->palette));
+	memcpy(screen->vramChanged, vdc->vramChanged, VRAM_PAGES);
+	memcpy(screen->vram, vdc->vram, VRAM_SIZE);
+	vdc->redraw = 0;
+	memset(vdc->vramChanged, 0, VRAM_PAGES);
+	renderer->back = atomic_exchange(&renderer->ready, renderer->back | SCREEN_NEW)
+		& SCREEN_INDEX;
+	sem_post(&renderer->wake);
+}
+
+// swap the front screen for the ready one if that's newer,
+// render thread only
+int takeScreen(struct Renderer *renderer) {
+	if(!(atomic_load(&renderer->ready) & SCREEN_NEW)) return 0;
+	renderer->front = atomic_exchange(&renderer->ready, renderer->front)
+		& SCREEN_INDEX;
+	return 1;
+}
+
+
+
+/* RENDERING */
+
+void undefinedMode(int mode) {
+	fprintf(stderr, "Undefined v9958 mode 0x%x\n", mode);
+}
+
+// 8 pixels at once, gcc turns these into simd
+typedef uint32_t Pixels __attribute__((vector_size(32)));
+
+static const Pixels patternBits = { 0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01 };
+
+// one pattern byte to 8 pixels of either colour
+static inline void expand(uint32_t *out, uint8_t pattern, uint32_t fg, uint32_t bg) {
+	Pixels set = (Pixels)((patternBits & pattern) != 0);
+	Pixels pixels = (set & fg) | (~set & bg);
+	memcpy(out, &pixels, sizeof(pixels));
+}
+
+// a palette entry as rgba, 3 bits a channel
+uint32_t paletteColor(uint16_t entry) {
+	uint32_t r = (entry >> 4 & 7) * 255 / 7;
+	uint32_t g = (entry >> 8 & 7) * 255 / 7;
+	uint32_t b = (entry & 7) * 255 / 7;
+	return 0xff000000 | b << 16 | g << 8 | r;
+}
+
+// the palette as it looks right now, colour 0 showing the backdrop
+// unless it's been made solid
+void getColors(struct Screen *screen, uint32_t *colors) {
+	for(int i = 0; i < PALETTE_SIZE; i++)
+		colors[i] = paletteColor(screen->palette[i]);
+	if(!(screen->regs[8] & 0b00100000))
+		colors[0] = colors[screen->regs[7] & 0x0f];
+}
+
+uint32_t *frameLine(struct Renderer *renderer, int y) {
+	return renderer->frame + y * FRAME_STRIDE;
+}
+
+void drawBackdrop(struct Renderer *renderer, struct Screen *screen, uint32_t *colors, int width, int height) {
+	uint32_t backdrop = colors[screen->regs[7] & 0x0f];
+	for(int y = 0; y < height; y++) {
+		uint32_t *out = frameLine(renderer, y);
+		for(int x = 0; x < width; x++) out[x] = backdrop;
+	}
+}
+
+// character rows as bits, 27 of them at most
+#define ALL_ROWS 0xffffffff
+
+// graphic2 and 3 give each third of the screen its own patterns and
+// colours, unless the table masks make them share
+uint32_t thirdRows(uint32_t address, uint32_t base, uint32_t mask) {
+	uint32_t offset = address & mask;
+	if((address & ~mask & VRAM_MASK) != base || offset >= 0x1800) return 0;
+	uint32_t rows = 0;
+	for(int third = 0; third < 3; third++)
+		if((third << 11 & mask) == (offset & 0x1800)) rows |= 0xffu << third*8;
+	return rows;
+}
+
+// which character rows show vram written since the last frame, a write
+// to the name or blink table only touches its own row but text and
+// graphic1 patterns and colours can be used anywhere. sprite tables
+// aren't drawn yet.
+uint32_t changedRows(struct Screen *screen, int mode, int height) {
+	uint32_t names, nameSize, patterns, patternSize, colorTable, colorSize;
+	uint32_t blinks = 0, blinkSize = 0, patternMask = 0, colorMask = 0;
+	int columns = 32;
+	switch(mode) {
+		case MODE_TEXT1:
+		case MODE_TEXT2:
+			columns = mode == MODE_TEXT2 ? 80 : 40;
+			names = (screen->regs[2] & (columns == 80 ? 0x7c : 0x7f)) << 10;
+			patterns = (screen->regs[4] & 0x3f) << 11;
+			patternSize = 2048;
+			colorTable = 0;
+			colorSize = 0;
+			if(mode == MODE_TEXT2) {
+				blinks = (screen->regs[10] & 0x07) << 14 | (screen->regs[3] & 0xf8) << 6;
+				blinkSize = (columns * ((height + 7) / 8) + 7) / 8;
+			}
+			break;
+		case MODE_GRAPHIC1:
+			names = (screen->regs[2] & 0x7f) << 10;
+			patterns = (screen->regs[4] & 0x3f) << 11;
+			patternSize = 2048;
+			colorTable = (screen->regs[10] & 0x07) << 14 | screen->regs[3] << 6;
+			colorSize = 32;
+			break;
+		case MODE_GRAPHIC2:
+		case MODE_GRAPHIC3:
+			names = (screen->regs[2] & 0x7f) << 10;
+			patterns = (screen->regs[4] & 0x3c) << 11;
+			patternMask = (screen->regs[4] & 0x03) << 11 | 0x7ff;
+			patternSize = 0;
+			colorTable = (screen->regs[10] & 0x07) << 14 | (screen->regs[3] & 0x80) << 6;
+			colorMask = (screen->regs[3] & 0x7f) << 6 | 0x3f;
+			colorSize = 0;
+			break;
+		default:
+			return 0;
+	}
+	nameSize = columns * ((height + 7) / 8);
+	uint32_t rows = 0;
+	for(int page = 0; page < VRAM_PAGES; page++) {
+		if(!screen->vramChanged[page]) continue;
+		for(int chunk = 0; chunk < 8; chunk++) {
+			if(!(screen->vramChanged[page] & 1 << chunk)) continue;
+			uint32_t start = page << 8 | chunk << 5;
+			for(uint32_t address = start; address < start + 32; address++) {
+				uint32_t name = (address - names) & VRAM_MASK;
+				uint32_t blink = (address - blinks) & VRAM_MASK;
+				if(name < nameSize) rows |= 1u << name / columns;
+				if(blink < blinkSize) rows |= 1u << blink * 8 / columns;
+				if(patternMask) rows |= thirdRows(address, patterns, patternMask)
+					| thirdRows(address, colorTable, colorMask);
+				if(((address - patterns) & VRAM_MASK) < patternSize
+						|| ((address - colorTable) & VRAM_MASK) < colorSize)
+					return ALL_ROWS;
+			}
+		}
+	}
+	return rows;
+}
+
+// 6 pixel wide characters, 40 or 80 of them a row
+void drawText(struct Renderer *renderer, struct Screen *screen, uint32_t *colors, uint32_t rows, int columns, int height) {
+	uint8_t *vram = screen->vram;
+	int wide = columns == 80;
+	uint32_t names = (screen->regs[2] & (wide ? 0x7c : 0x7f)) << 10;
+	uint32_t patterns = (screen->regs[4] & 0x3f) << 11;
+	uint32_t blinks = (screen->regs[10] & 0x07) << 14 | (screen->regs[3] & 0xf8) << 6;
+	uint32_t fg = colors[screen->regs[7] >> 4];
+	uint32_t bg = colors[screen->regs[7] & 0x0f];
+	uint32_t blinkFg = colors[screen->regs[12] >> 4];
+	uint32_t blinkBg = colors[screen->regs[12] & 0x0f];
+	int blinking = wide && renderer->drawnBlink;
+	for(int y = 0; y < height; y++) {
+		if(!(rows >> y/8 & 1)) continue;
+		uint32_t *out = frameLine(renderer, y);
+		int row = y / 8 * columns;
+		for(int column = 0; column < columns; column++) {
+			int name = vram[(names + row + column) & VRAM_MASK];
+			uint8_t pattern = vram[(patterns + name*8 + y%8) & VRAM_MASK];
+			int blink = blinking && vram[(blinks + (row + column) / 8) & VRAM_MASK]
+				& 0x80 >> (row + column) % 8;
+			// the last two pixels get drawn over by the next character
+			if(blink) expand(out + column*6, pattern, blinkFg, blinkBg);
+			else expand(out + column*6, pattern, fg, bg);
+		}
+	}
+}
+
+// 8x8 tiles with a colour pair for every 8 patterns
+void drawGraphic1(struct Renderer *renderer, struct Screen *screen, uint32_t *colors, uint32_t rows) {
+	uint8_t *vram = screen->vram;
+	uint32_t names = (screen->regs[2] & 0x7f) << 10;
+	uint32_t patterns = (screen->regs[4] & 0x3f) << 11;
+	uint32_t colorTable = (screen->regs[10] & 0x07) << 14 | screen->regs[3] << 6;
+	for(int y = 0; y < 24*8; y++) {
+		if(!(rows >> y/8 & 1)) continue;
+		uint32_t *out = frameLine(renderer, y);
+		int row = y / 8 * 32;
+		for(int column = 0; column < 32; column++) {
+			int name = vram[(names + row + column) & VRAM_MASK];
+			uint8_t pattern = vram[(patterns + name*8 + y%8) & VRAM_MASK];
+			uint8_t color = vram[(colorTable + name/8) & VRAM_MASK];
+			expand(out + column*8, pattern, colors[color >> 4], colors[color & 0x0f]);
+		}
+	}
+}
+
+// 8x8 tiles with their own patterns and colours per line for each third
+// of the screen, the low bits of the table bases mask which third is used
+void drawGraphic2(struct Renderer *renderer, struct Screen *screen, uint32_t *colors, uint32_t rows) {
+	uint8_t *vram = screen->vram;
+	uint32_t names = (screen->regs[2] & 0x7f) << 10;
+	uint32_t patterns = (screen->regs[4] & 0x3c) << 11;
+	uint32_t patternMask = (screen->regs[4] & 0x03) << 11 | 0x7ff;
+	uint32_t colorTable = (screen->regs[10] & 0x07) << 14 | (screen->regs[3] & 0x80) << 6;
+	uint32_t colorMask = (screen->regs[3] & 0x7f) << 6 | 0x3f;
+	for(int y = 0; y < 24*8; y++) {
+		if(!(rows >> y/8 & 1)) continue;
+		uint32_t *out = frameLine(renderer, y);
+		int row = y / 8 * 32;
+		int third = y / 64 * 256;
+		for(int column = 0; column < 32; column++) {
+			int tile = (third + vram[(names + row + column) & VRAM_MASK]) * 8 + y%8;
+			uint8_t pattern = vram[(patterns | (tile & patternMask)) & VRAM_MASK];
+			uint8_t color = vram[(colorTable | (tile & colorMask)) & VRAM_MASK];
+			expand(out + column*8, pattern, colors[color >> 4], colors[color & 0x0f]);
+		}
+	}
+}
+
+// rasterize whatever changed on screen into renderer->frame, give back
+// how much of it the screen covers and which character rows were redrawn
+uint32_t render(struct Renderer *renderer, struct Screen *screen, int *width, int *height) {
+	struct Dimensions dimensions = getScreenDimensions(screen->regs);
+	*width = dimensions.x;
+	*height = dimensions.y;
+	int mode = getModeFlags(screen->regs);
+	int enabled = getScreenEnable(screen->regs);
+	uint32_t rows = enabled ? changedRows(screen, mode, *height) : 0;
+	// the changes in any screens that were dropped never got drawn
+	int dropped = screen->serial != renderer->shown + 1;
+	renderer->shown = screen->serial;
+	int blinkPhase = mode == MODE_TEXT2 && getBlinkPhase(screen->regs, screen->frames);
+	if(renderer->redraw || screen->redraw || dropped || blinkPhase != renderer->drawnBlink)
+		rows = ALL_ROWS;
+	renderer->redraw = 0;
+	renderer->drawnBlink = blinkPhase;
+	if(!rows) return 0;
+
+	uint32_t colors[PALETTE_SIZE];
+	getColors(screen, colors);
+	if(!enabled) {
+		drawBackdrop(renderer, screen, colors, *width, *height);
+		return ALL_ROWS;
+	}
+	switch(mode) {
+		case MODE_TEXT1:
+			drawText(renderer, screen, colors, rows, 40, *height);
+			break;
+		case MODE_TEXT2:
+			drawText(renderer, screen, colors, rows, 80, *height);
+			break;
+		case MODE_GRAPHIC1:
+			drawGraphic1(renderer, screen, colors, rows);
+			break;
+		// graphic3 only differs in its sprites
+		case MODE_GRAPHIC2:
+		case MODE_GRAPHIC3:
+			drawGraphic2(renderer, screen, colors, rows);
+			break;
+		default:
+			undefinedMode(mode);
+			drawBackdrop(renderer, screen, colors, *width, *height);
+			break;
+	}	
+	return rows;
+}
+
+
+
+/* PRESENTING */
+
+// mode changes only resize the display at the next frame, so a program
+// flipping through registers doesn't make the window jump around
+void setScreenDimensions(struct Renderer *renderer, struct Dimensions dimensions) {
+	if(dimensions.x == renderer->width && dimensions.y == renderer->height) return;
+	al_resize_display(renderer->display, dimensions.x, dimensions.y);
+	renderer->width = dimensions.x;
+	renderer->height = dimensions.y;
+	renderer->redraw = 1;
+}
+
+// copy the redrawn rows of the frame into the bitmap and show it
+void upload(struct Renderer *renderer, uint32_t rows, int width, int height) {
+	int top = __builtin_ctz(rows) * 8;
+	int bottom = (32 - __builtin_clz(rows)) * 8;
+	if(bottom > height) bottom = height;
+	ALLEGRO_LOCKED_REGION *region = al_lock_bitmap_region(renderer->bitmap,
+			0, top, width, bottom - top,
+			ALLEGRO_PIXEL_FORMAT_ABGR_8888_LE, ALLEGRO_LOCK_WRITEONLY);
+	if(!region) return;
+	for(int y = top; y < bottom; y++)
+		memcpy((uint8_t *)region->data + (y - top) * region->pitch,
+				frameLine(renderer, y), width * sizeof(uint32_t));
+	al_unlock_bitmap(renderer->bitmap);
+	// the back buffer is undefined after a flip, so all of it goes up
+	al_draw_bitmap_region(renderer->bitmap, 0, 0, width, height, 0, 0, 0);
+}
+
+void present(struct Renderer *renderer, struct Screen *screen) {
+	setScreenDimensions(renderer, getScreenDimensions(screen->regs));
+	int width, height;
+	uint32_t rows = render(renderer, screen, &width, &height);
+	if(!rows) return; // the last frame is still up
+	upload(renderer, rows, width, height);
+	// waiting for vsync here holds up nothing but this thread
+	al_flip_display();
+}
+
+// draws the newest screen whenever one is handed over
+void *renderThread(void *data) {
+	struct Renderer *renderer = data;
+	al_set_target_backbuffer(renderer->display);
+	while(1) {
+		sem_wait(&renderer->wake);
+		if(!atomic_load(&renderer->running)) break;
+		if(takeScreen(renderer))
+			present(renderer, &renderer->screens[renderer->front]);
+	}
+	al_set_target_bitmap(NULL);
+	return NULL;
+}
+
+// the display moves over to the render thread from here on
+void startRenderer(struct Renderer *renderer) {
+	al_set_target_bitmap(NULL);
+	atomic_store(&renderer->running, 1);
+	if(pthread_create(&renderer->thread, NULL, renderThread, renderer)) {
+		fprintf(stderr, "Could not start the render thread\n");
+		exit(1);
+	}
+}
+
+void destroyRenderer(struct Renderer *renderer) {
+	if(atomic_load(&renderer->running)) {
+		atomic_store(&renderer->running, 0);
+		sem_post(&renderer->wake);
+		pthread_join(renderer->thread, NULL);
+		al_set_target_backbuffer(renderer->display);
+	}
+	al_destroy_bitmap(renderer->bitmap);
+	al_destroy_display(renderer->display);
+	sem_destroy(&renderer->wake);
+	free(renderer);
+}
@@ -0,0 +1,64 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <allegro5/allegro.h>
+#include "v9958.h"
+
+// the biggest picture any mode makes, rows are padded so a pattern
+// can always be expanded 8 pixels at a time
+#define FRAME_WIDTH  512
+#define FRAME_HEIGHT 212
+#define FRAME_STRIDE (FRAME_WIDTH + 8)
+
+#define SCREENS 3
+#define SCREEN_INDEX 0x03
+#define SCREEN_NEW   0x04 // the ready screen hasn't been taken yet
+
+// everything the render thread needs of the vdc to draw a frame
+struct Screen {
+	uint64_t serial; // screens handed over up to this one
+	uint64_t frames;
+	int redraw;
+	uint8_t regs[VDC_REGS];
+	uint16_t palette[PALETTE_SIZE];
+	uint8_t vramChanged[VRAM_PAGES]; // since the screen before it
+	uint8_t vram[VRAM_SIZE];
+};
+
+// screens go from the emulation thread to the render thread through a
+// lock-free triple buffer: the emulation thread fills its back screen
+// and swaps it for the ready one, the render thread swaps its front
+// one for the ready one whenever that's new. neither waits on the
+// other, and a screen that's replaced before it's taken is dropped.
+struct Renderer {
+	struct Screen screens[SCREENS];
+	atomic_int ready; // index, with SCREEN_NEW until it's taken
+	// emulation thread only
+	int back;
+	uint64_t serial;
+	int blinkPhase; // of the last screen handed over
+	// render thread only
+	int front;
+	uint64_t shown; // serial of the last screen drawn
+	int redraw;
+	int drawnBlink;
+	int width, height; // what the display is sized to
+	uint32_t frame[FRAME_STRIDE * FRAME_HEIGHT]; // rgba
+	ALLEGRO_DISPLAY *display;
+	ALLEGRO_BITMAP *bitmap;
+	pthread_t thread;
+	sem_t wake; // posted for every screen handed over
+	atomic_int running;
+};
+
+struct Renderer *newRenderer();
+void startRenderer(struct Renderer *);
+void destroyRenderer(struct Renderer *);
+void publishScreen(struct Renderer *, struct VDC *);
+uint32_t render(struct Renderer *, struct Screen *, int *, int *);
+
+#endif
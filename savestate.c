@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "aardbei.h"
+#include "savestate.h"
+
+// what follows the machine registers in a state
+#define STATE_FULL  0 // all of ram, eeprom and vram
+#define STATE_DELTA 1 // only the pages dirtied since the last snapshot
+
+// where a delta page lives
+#define REGION_RAM    0
+#define REGION_EEPROM 1
+#define REGION_VRAM   2
+
+
+
+/* BUFFERS */
+
+void reserve(struct StateBuffer *buffer, size_t size) {
+	if(buffer->size + size <= buffer->capacity) return;
+	while(buffer->size + size > buffer->capacity)
+		buffer->capacity = buffer->capacity ? buffer->capacity*2 : 4096;
+	buffer->data = realloc(buffer->data, buffer->capacity);
+	if(!buffer->data) {
+		fprintf(stderr, "Out of memory for save state\n");
+		exit(1);
+	}
+}
+
+void putBytes(struct StateBuffer *buffer, const void *data, size_t size) {
+	reserve(buffer, size);
+	memcpy(buffer->data + buffer->size, data, size);
+	buffer->size += size;
+}
+
+void put8(struct StateBuffer *buffer, uint8_t value) {
+	putBytes(buffer, &value, 1);
+}
+
+void put16(struct StateBuffer *buffer, uint16_t value) {
+	put8(buffer, value);
+	put8(buffer, value >> 8);
+}
+
+void put32(struct StateBuffer *buffer, uint32_t value) {
+	put16(buffer, value);
+	put16(buffer, value >> 16);
+}
+
+void put64(struct StateBuffer *buffer, uint64_t value) {
+	put32(buffer, value);
+	put32(buffer, value >> 32);
+}
+
+// returns nonzero if the buffer ran out
+int getBytes(struct StateBuffer *buffer, void *data, size_t size) {
+	if(buffer->pos + size > buffer->size) return 1;
+	memcpy(data, buffer->data + buffer->pos, size);
+	buffer->pos += size;
+	return 0;
+}
+
+uint8_t get8(struct StateBuffer *buffer) {
+	uint8_t value = 0;
+	getBytes(buffer, &value, 1);
+	return value;
+}
+
+uint16_t get16(struct StateBuffer *buffer) {
+	uint16_t low = get8(buffer);
+	return low | get8(buffer) << 8;
+}
+
+uint32_t get32(struct StateBuffer *buffer) {
+	uint32_t low = get16(buffer);
+	return low | (uint32_t)get16(buffer) << 16;
+}
+
+uint64_t get64(struct StateBuffer *buffer) {
+	uint64_t low = get32(buffer);
+	return low | (uint64_t)get32(buffer) << 32;
+}
+
+int atEnd(struct StateBuffer *buffer) {
+	return buffer->pos >= buffer->size;
+}
+
+
+
+/* MACHINE STATE */
+
+void putRegisterSet(struct StateBuffer *buffer, struct RegisterSet *set) {
+	put16(buffer, set->af);
+	put16(buffer, set->bc);
+	put16(buffer, set->de);
+	put16(buffer, set->hl);
+}
+
+void getRegisterSet(struct StateBuffer *buffer, struct RegisterSet *set) {
+	set->af = get16(buffer);
+	set->bc = get16(buffer);
+	set->de = get16(buffer);
+	set->hl = get16(buffer);
+}
+
+// a command half done, down to where it's got to
+void putBlitter(struct StateBuffer *buffer, struct Blitter *blitter) {
+	put8(buffer, blitter->command);
+	put8(buffer, blitter->logic);
+	put16(buffer, blitter->sx);
+	put16(buffer, blitter->sy);
+	put16(buffer, blitter->dx);
+	put16(buffer, blitter->dy);
+	put16(buffer, blitter->rowSX);
+	put16(buffer, blitter->rowDX);
+	put16(buffer, blitter->nx);
+	put16(buffer, blitter->ny);
+	put16(buffer, blitter->left);
+	put8(buffer, blitter->dix);
+	put8(buffer, blitter->diy);
+	put16(buffer, blitter->error);
+	put8(buffer, blitter->color);
+	put16(buffer, blitter->border);
+	put8(buffer, blitter->found);
+	put16(buffer, blitter->width);
+	put8(buffer, blitter->shift);
+	put8(buffer, blitter->rowShift);
+	put64(buffer, blitter->clock);
+	put64(buffer, blitter->credit);
+}
+
+void getBlitter(struct StateBuffer *buffer, struct Blitter *blitter) {
+	blitter->command = get8(buffer) & 0x0f;
+	blitter->logic = get8(buffer) & 0x0f;
+	blitter->sx = (int16_t)get16(buffer);
+	blitter->sy = (int16_t)get16(buffer);
+	blitter->dx = (int16_t)get16(buffer);
+	blitter->dy = (int16_t)get16(buffer);
+	blitter->rowSX = (int16_t)get16(buffer);
+	blitter->rowDX = (int16_t)get16(buffer);
+	blitter->nx = get16(buffer);
+	blitter->ny = get16(buffer);
+	blitter->left = get16(buffer);
+	blitter->dix = (int8_t)get8(buffer);
+	blitter->diy = (int8_t)get8(buffer);
+	blitter->error = get16(buffer);
+	blitter->color = get8(buffer);
+	blitter->border = get16(buffer);
+	blitter->found = get8(buffer);
+	blitter->width = get16(buffer);
+	blitter->shift = get8(buffer) & 0x03;
+	blitter->rowShift = get8(buffer);
+	blitter->bits = 8 >> blitter->shift;
+	blitter->clock = get64(buffer);
+	blitter->credit = (int64_t)get64(buffer);
+}
+
+// the fifos from their first byte, the host end isn't part of the machine
+void putUART(struct StateBuffer *buffer, struct UART *uart) {
+	for(int i = 0; i < UART_FIFO; i++)
+		put8(buffer, uart->tx[(uart->txFirst + i) % UART_FIFO]);
+	for(int i = 0; i < UART_FIFO; i++)
+		put8(buffer, uart->rx[(uart->rxFirst + i) % UART_FIFO]);
+	put8(buffer, uart->txCount);
+	put8(buffer, uart->rxCount);
+	put64(buffer, uart->txDone);
+	put64(buffer, uart->rxDone);
+	put8(buffer, uart->lost);
+	put8(buffer, uart->interrupts);
+}
+
+void getUART(struct StateBuffer *buffer, struct UART *uart) {
+	getBytes(buffer, uart->tx, UART_FIFO);
+	getBytes(buffer, uart->rx, UART_FIFO);
+	uart->txFirst = uart->rxFirst = 0;
+	uart->txCount = get8(buffer);
+	uart->rxCount = get8(buffer);
+	if(uart->txCount > UART_FIFO) uart->txCount = UART_FIFO;
+	if(uart->rxCount > UART_FIFO) uart->rxCount = UART_FIFO;
+	uart->txDone = get64(buffer);
+	uart->rxDone = get64(buffer);
+	uart->lost = get8(buffer) != 0;
+	uart->interrupts = get8(buffer) & (UART_INT_STATUS | UART_INT_NMI);
+}
+
+// everything but the big memories
+void putMachine(struct StateBuffer *buffer, struct System *system) {
+	struct Registers *regs = &system->cpu.regs;
+	getFlags(&system->cpu);
+	put64(buffer, system->cycles);
+	putRegisterSet(buffer, &regs->main);
+	putRegisterSet(buffer, &regs->alt);
+	put8(buffer, regs->i);
+	put8(buffer, regs->r);
+	put16(buffer, regs->ix);
+	put16(buffer, regs->iy);
+	put16(buffer, regs->sp);
+	put16(buffer, regs->pc);
+	struct Interrupts *interrupts = &system->cpu.interrupts;
+	put8(buffer, interrupts->iff1);
+	put8(buffer, interrupts->iff2);
+	put8(buffer, interrupts->mode);
+	put8(buffer, interrupts->halted);
+	put8(buffer, interrupts->inNMI);
+	put64(buffer, interrupts->eiDone);
+	put8(buffer, system->memory.flashBank);
+	for(int i = 0; i < AY_CHIPS; i++) {
+		struct AY *ay = &system->peripherals.sound.chips[i];
+		put8(buffer, ay->latch);
+		putBytes(buffer, ay->regs, AY_REGS);
+	}
+	struct VDC *vdc = &system->peripherals.vdc;
+	putBytes(buffer, vdc->regs, sizeof(vdc->regs));
+	put8(buffer, vdc->dataLatch);
+	put8(buffer, vdc->port1Sequence);
+	put32(buffer, vdc->vramAddress);
+	put8(buffer, vdc->readAhead);
+	put8(buffer, vdc->flags);
+	for(int i = 0; i < PALETTE_SIZE; i++)
+		put16(buffer, vdc->palette[i]);
+	put8(buffer, vdc->paletteLatch);
+	put8(buffer, vdc->paletteSequence);
+	putBlitter(buffer, &vdc->blitter);
+	putUART(buffer, &system->peripherals.uart);
+}
+
+void getMachine(struct StateBuffer *buffer, struct System *system) {
+	struct Registers *regs = &system->cpu.regs;
+	system->cycles = get64(buffer);
+	getRegisterSet(buffer, &regs->main);
+	getRegisterSet(buffer, &regs->alt);
+	system->cpu.lazy.op = FLAGS_NONE;
+	regs->i = get8(buffer);
+	regs->r = get8(buffer);
+	regs->ix = get16(buffer);
+	regs->iy = get16(buffer);
+	regs->sp = get16(buffer);
+	regs->pc = get16(buffer);
+	struct Interrupts *interrupts = &system->cpu.interrupts;
+	interrupts->iff1 = get8(buffer) != 0;
+	interrupts->iff2 = get8(buffer) != 0;
+	interrupts->mode = get8(buffer);
+	if(interrupts->mode > 2) interrupts->mode = 2;
+	interrupts->halted = get8(buffer) != 0;
+	interrupts->inNMI = get8(buffer) != 0;
+	interrupts->eiDone = get64(buffer);
+	setFlashBank(&system->memory, get8(buffer));
+	for(int i = 0; i < AY_CHIPS; i++) {
+		struct AY *ay = &system->peripherals.sound.chips[i];
+		ay->latch = get8(buffer);
+		getBytes(buffer, ay->regs, AY_REGS);
+	}
+	struct VDC *vdc = &system->peripherals.vdc;
+	getBytes(buffer, vdc->regs, sizeof(vdc->regs));
+	vdc->dataLatch = get8(buffer);
+	vdc->port1Sequence = get8(buffer);
+	vdc->vramAddress = get32(buffer) & VRAM_MASK;
+	vdc->readAhead = get8(buffer);
+	vdc->flags = get8(buffer) & (VDC_VBLANK | VDC_LINE);
+	for(int i = 0; i < PALETTE_SIZE; i++)
+		vdc->palette[i] = get16(buffer);
+	vdc->paletteLatch = get8(buffer);
+	vdc->paletteSequence = get8(buffer);
+	getBlitter(buffer, &vdc->blitter);
+	getUART(buffer, &system->peripherals.uart);
+}
+
+void putFull(struct StateBuffer *buffer, struct System *system) {
+	putBytes(buffer, system->memory.ram, RAM_SIZE);
+	putBytes(buffer, system->memory.eeprom, EEPROM_SIZE);
+	putBytes(buffer, system->peripherals.vdc.vram, VRAM_SIZE);
+}
+
+int getFull(struct StateBuffer *buffer, struct System *system) {
+	return getBytes(buffer, system->memory.ram, RAM_SIZE)
+		|| getBytes(buffer, system->memory.eeprom, EEPROM_SIZE)
+		|| getBytes(buffer, system->peripherals.vdc.vram, VRAM_SIZE);
+}
+
+void putPage(struct StateBuffer *buffer, int region, int page, uint8_t *data) {
+	put8(buffer, region);
+	put16(buffer, page);
+	putBytes(buffer, data, PAGE_SIZE);
+}
+
+// every page dirtied since the last snapshot
+void putDelta(struct StateBuffer *buffer, struct System *system) {
+	struct Memory *memory = &system->memory;
+	struct VDC *vdc = &system->peripherals.vdc;
+	for(int page = RAM_BASE >> PAGE_SHIFT; page < PAGES; page++) {
+		if(!takeDirty(memory, page, DIRTY_SNAPSHOT)) continue;
+		if(page < EEPROM_BASE >> PAGE_SHIFT)
+			putPage(buffer, REGION_RAM, page - (RAM_BASE >> PAGE_SHIFT),
+					memory->ram + (page << PAGE_SHIFT) - RAM_BASE);
+		else putPage(buffer, REGION_EEPROM, page - (EEPROM_BASE >> PAGE_SHIFT),
+					memory->eeprom + (page << PAGE_SHIFT) - EEPROM_BASE);
+	}
+	for(int page = 0; page < VRAM_PAGES; page++) {
+		if(!vdc->vramDirty[page]) continue;
+		vdc->vramDirty[page] = 0;
+		putPage(buffer, REGION_VRAM, page, vdc->vram + page*PAGE_SIZE);
+	}
+}
+
+int getDelta(struct StateBuffer *buffer, struct System *system) {
+	while(!atEnd(buffer)) {
+		int region = get8(buffer);
+		int page = get16(buffer);
+		uint8_t *data;
+		if(region == REGION_RAM && page < RAM_SIZE / PAGE_SIZE)
+			data = system->memory.ram;
+		else if(region == REGION_EEPROM && page < EEPROM_PAGES)
+			data = system->memory.eeprom;
+		else if(region == REGION_VRAM && page < VRAM_PAGES)
+			data = system->peripherals.vdc.vram;
+		else return 1;
+		if(getBytes(buffer, data + page*PAGE_SIZE, PAGE_SIZE)) return 1;
+	}
+	return 0;
+}
+
+// start tracking dirty pages afresh from the state the system is in now
+void forgetDirty(struct System *system) {
+	cleanMemory(&system->memory, DIRTY_SNAPSHOT);
+	memset(system->peripherals.vdc.vramDirty, 0, VRAM_PAGES);
+}
+
+// the system was put back to another point in time
+void restored(struct System *system) {
+	// the eeprom file has to catch up with what was loaded
+	for(int page = 0; page < EEPROM_PAGES; page++)
+		system->memory.dirty[(EEPROM_BASE >> PAGE_SHIFT) + page] |= DIRTY_SYNC;
+	forgetDirty(system);
+	system->memory.codeModified = 1;
+	invalidateScreen(&system->peripherals.vdc);
+	seekSound(&system->peripherals.sound, system->cycles);
+	rescheduleEvents(system);
+}
+
+
+
+/* WHOLE STATES */
+
+// the machine and all its memories, what a state file holds after its header
+void putState(struct StateBuffer *buffer, struct System *system) {
+	putMachine(buffer, system);
+	putFull(buffer, system);
+}
+
+// returns nonzero if the rest of the buffer isn't exactly one state, in
+// which case the system is left alone
+int getState(struct StateBuffer *buffer, struct System *system) {
+	// the machine part is always the same size
+	struct StateBuffer machine = { 0 };
+	putMachine(&machine, system);
+	int failed = buffer->size - buffer->pos
+		!= machine.size + RAM_SIZE + EEPROM_SIZE + VRAM_SIZE;
+	free(machine.data);
+	if(failed) return 1;
+	getMachine(buffer, system);
+	getFull(buffer, system);
+	restored(system);
+	return 0;
+}
+
+
+
+/* STATE FILES */
+
+// returns nonzero on failure
+int saveState(struct System *system, const char *filename) {
+	struct StateBuffer buffer = { 0 };
+	putBytes(&buffer, STATE_MAGIC, 8);
+	put32(&buffer, STATE_VERSION);
+	putState(&buffer, system);
+	FILE *fp = fopen(filename, "wb");
+	int failed = !fp || fwrite(buffer.data, 1, buffer.size, fp) != buffer.size;
+	if(fp && fclose(fp)) failed = 1;
+	if(failed) fprintf(stderr, "Could not save state to %s\n", filename);
+	free(buffer.data);
+	return failed;
+}
+
+// returns nonzero on failure, in which case the system is left alone
+int loadState(struct System *system, const char *filename) {
+	struct StateBuffer buffer = { 0 };
+	FILE *fp = fopen(filename, "rb");
+	if(!fp) {
+		fprintf(stderr, "Could not open state %s\n", filename);
+		return 1;
+	}
+	uint8_t chunk[65536];
+	size_t n;
+	while((n = fread(chunk, 1, sizeof(chunk), fp)))
+		putBytes(&buffer, chunk, n);
+	fclose(fp);
+
+	char magic[8];
+	int failed = getBytes(&buffer, magic, 8) || memcmp(magic, STATE_MAGIC, 8);
+	if(!failed && get32(&buffer) != STATE_VERSION) {
+		fprintf(stderr, "State %s is from another version\n", filename);
+		failed = 1;
+	}
+	if(!failed) failed = getState(&buffer, system);
+	if(failed) fprintf(stderr, "State %s is not valid\n", filename);
+	free(buffer.data);
+	return failed;
+}
+
+
+
+/* REWIND */
+
+struct Rewind *newRewind(int frames) {
+	struct Rewind *rewind = calloc(1, sizeof(struct Rewind));
+	rewind->frames = calloc(frames, sizeof(struct RewindFrame));
+	rewind->capacity = frames;
+	// short buffers need keyframes more often or they'd wrap past them all
+	rewind->keyframeInterval = REWIND_KEYFRAME_INTERVAL;
+	if(rewind->keyframeInterval > frames / 2)
+		rewind->keyframeInterval = frames / 2 ? frames / 2 : 1;
+	return rewind;
+}
+
+void destroyRewind(struct Rewind *rewind) {
+	for(int i = 0; i < rewind->capacity; i++)
+		free(rewind->frames[i].state.data);
+	free(rewind->frames);
+	free(rewind);
+}
+
+struct RewindFrame *rewindFrame(struct Rewind *rewind, int i) {
+	return &rewind->frames[(rewind->first + i) % rewind->capacity];
+}
+
+// take a snapshot, a full one every so often and otherwise
+// just the pages dirtied since the last one
+void snapshot(struct Rewind *rewind, struct System *system) {
+	if(rewind->count == rewind->capacity) {
+		rewind->first = (rewind->first + 1) % rewind->capacity;
+		rewind->count--;
+	}
+	struct RewindFrame *frame = rewindFrame(rewind, rewind->count++);
+	frame->keyframe = rewind->count == 1
+		|| rewind->sinceKeyframe >= rewind->keyframeInterval;
+	frame->state.size = 0;
+	putMachine(&frame->state, system);
+	if(frame->keyframe) {
+		putFull(&frame->state, system);
+		forgetDirty(system);
+		rewind->sinceKeyframe = 0;
+	} else putDelta(&frame->state, system);
+	rewind->sinceKeyframe++;
+}
+
+// go back to the snapshot this many before the newest
+// returns how far it actually went back, or -1 if there was nothing
+int rewindSystem(struct Rewind *rewind, struct System *system, int frames) {
+	// frames before the oldest keyframe lost theirs to the ring wrapping
+	int oldest = 0;
+	while(oldest < rewind->count && !rewindFrame(rewind, oldest)->keyframe)
+		oldest++;
+	if(oldest == rewind->count) return -1;
+	int target = rewind->count - 1 - frames;
+	if(target < oldest) target = oldest;
+
+	int keyframe = target;
+	while(!rewindFrame(rewind, keyframe)->keyframe) keyframe--;
+	// the memories from the keyframe then each delta up to the target
+	for(int i = keyframe; i <= target; i++) {
+		struct StateBuffer *state = &rewindFrame(rewind, i)->state;
+		state->pos = 0;
+		getMachine(state, system);
+		if(i == keyframe) getFull(state, system);
+		else getDelta(state, system);
+	}
+	restored(system);
+	rewind->sinceKeyframe = target - keyframe + 1;
+	int went = rewind->count - 1 - target;
+	rewind->count = target + 1;
+	return went;
+}
@@ -0,0 +1,48 @@
+#ifndef SAVESTATE_H
+#define SAVESTATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STATE_MAGIC "AARDBEI8"
+#define STATE_VERSION 5
+
+// a full keyframe every this many rewind snapshots, deltas in between
+#define REWIND_KEYFRAME_INTERVAL 60
+
+struct System;
+
+// a growable byte buffer states are written into and read back from
+struct StateBuffer {
+	uint8_t *data;
+	size_t size;
+	size_t capacity;
+	size_t pos;
+};
+
+struct RewindFrame {
+	struct StateBuffer state;
+	int keyframe;
+};
+
+// ring of snapshots, oldest first
+struct Rewind {
+	struct RewindFrame *frames;
+	int capacity;
+	int first;
+	int count;
+	int sinceKeyframe;
+	int keyframeInterval;
+};
+
+void putState(struct StateBuffer *, struct System *);
+int getState(struct StateBuffer *, struct System *);
+int saveState(struct System *, const char *);
+int loadState(struct System *, const char *);
+
+struct Rewind *newRewind(int);
+void destroyRewind(struct Rewind *);
+void snapshot(struct Rewind *, struct System *);
+int rewindSystem(struct Rewind *, struct System *, int);
+
+#endif
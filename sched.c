@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "sched.h"
+
+void initScheduler(struct Scheduler *scheduler) {
+	scheduler->count = 0;
+}
+
+void swapEvents(struct Event *a, struct Event *b) {
+	struct Event tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+void siftUp(struct Scheduler *scheduler, int i) {
+	struct Event *events = scheduler->events;
+	while(i && events[(i-1)/2].when > events[i].when) {
+		swapEvents(&events[(i-1)/2], &events[i]);
+		i = (i-1)/2;
+	}
+}
+
+void siftDown(struct Scheduler *scheduler, int i) {
+	struct Event *events = scheduler->events;
+	while(1) {
+		int least = i;
+		int left = i*2 + 1;
+		int right = i*2 + 2;
+		if(left < scheduler->count && events[left].when < events[least].when)
+			least = left;
+		if(right < scheduler->count && events[right].when < events[least].when)
+			least = right;
+		if(least == i) break;
+		swapEvents(&events[least], &events[i]);
+		i = least;
+	}
+}
+
+// add an event to fire once the cycle count reaches when
+void schedule(struct Scheduler *scheduler, uint64_t when,
+		void (*handler)(void *, uint64_t), void *data) {
+	if(scheduler->count == MAX_EVENTS) {
+		fprintf(stderr, "Too many scheduled events\n");
+		exit(1);
+	}
+	int i = scheduler->count++;
+	scheduler->events[i] = (struct Event){ when, handler, data };
+	siftUp(scheduler, i);
+}
+
+// move the pending event with this handler and data to when, or add it if
+// there isn't one, so something that keeps changing its mind about when
+// it's due only ever takes the one slot
+void reschedule(struct Scheduler *scheduler, uint64_t when,
+		void (*handler)(void *, uint64_t), void *data) {
+	struct Event *events = scheduler->events;
+	for(int i = 0; i < scheduler->count; i++) {
+		if(events[i].handler != handler || events[i].data != data) continue;
+		uint64_t was = events[i].when;
+		events[i].when = when;
+		if(when < was) siftUp(scheduler, i);
+		else siftDown(scheduler, i);
+		return;
+	}
+	schedule(scheduler, when, handler, data);
+}
+
+// the cycle the next event is due at
+uint64_t nextEvent(struct Scheduler *scheduler) {
+	return scheduler->count ? scheduler->events[0].when : NO_EVENT;
+}
+
+struct Event popEvent(struct Scheduler *scheduler) {
+	struct Event event = scheduler->events[0];
+	scheduler->events[0] = scheduler->events[--scheduler->count];
+	siftDown(scheduler, 0);
+	return event;
+}
+
+// fire everything that is due by now
+// handlers get the cycle they were scheduled for and may schedule more
+void runEvents(struct Scheduler *scheduler, uint64_t now) {
+	while(scheduler->count && scheduler->events[0].when <= now) {
+		struct Event event = popEvent(scheduler);
+		event.handler(event.data, event.when);
+	}
+}
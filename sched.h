@@ -0,0 +1,31 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+
+// the master clock everything is scheduled against
+#define CPU_RATE 3579545
+
+#define MAX_EVENTS 64
+#define NO_EVENT UINT64_MAX
+
+// something that has to happen at a given cycle
+struct Event {
+	uint64_t when;
+	void (*handler)(void *data, uint64_t when);
+	void *data;
+};
+
+// pending events kept as a binary min-heap on when
+struct Scheduler {
+	struct Event events[MAX_EVENTS];
+	int count;
+};
+
+void initScheduler(struct Scheduler *);
+void schedule(struct Scheduler *, uint64_t, void (*)(void *, uint64_t), void *);
+void reschedule(struct Scheduler *, uint64_t, void (*)(void *, uint64_t), void *);
+uint64_t nextEvent(struct Scheduler *);
+void runEvents(struct Scheduler *, uint64_t);
+
+#endif
@@ -0,0 +1,423 @@
+// speed benchmarks, run with make bench from the top of the tree
+// the cpu ones time headless runs of ./aardbei on generated roms in each
+// of its cpu modes, the render ones call render() directly on each screen
+// mode. results are "name value" lines so they can be kept as a baseline
+// and the next run compared against it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../v9958.h"
+#include "../render.h"
+
+#define ROM_SIZE (1024*32)
+#define BODY_REPEATS 16
+#define RENDER_NANOS 250000000L // how long each render benchmark runs
+#define MAX_RESULTS 256
+
+
+
+/* RESULTS */
+
+struct Result {
+	char name[64];
+	double value;
+	int lowerIsBetter;
+};
+
+struct Result results[MAX_RESULTS];
+int resultCount;
+
+void result(const char *name, double value, int lowerIsBetter) {
+	if(resultCount == MAX_RESULTS) return;
+	struct Result *r = &results[resultCount++];
+	snprintf(r->name, sizeof(r->name), "%s", name);
+	r->value = value;
+	r->lowerIsBetter = lowerIsBetter;
+	printf("%-36s %12.2f\n", name, value);
+	fflush(stdout);
+}
+
+long int nanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+
+/* CPU */
+
+// a loop of one body over and over, after some setup
+struct Workload {
+	const char *name;
+	const char *rom; // an existing rom instead, NULL to generate one
+	const uint8_t *setup;
+	int setupLength;
+	const uint8_t *body;
+	int bodyLength;
+};
+
+// every workload starts with ld sp,0xe000 and ld bc,0x8000 so stores
+// and the stack land in ram
+static const uint8_t common[] = { 0x31, 0x00, 0xe0, 0x01, 0x00, 0x80 };
+
+static const uint8_t alu[] = {
+	0x3c,             // inc a
+	0x05,             // dec b
+	0xc6, 0x11,       // add a,0x11
+	0xe6, 0x7f,       // and 0x7f
+	0xb7,             // or a
+	0xfe, 0x40,       // cp 0x40
+	0x07,             // rlca
+	0x1f,             // rra
+	0x09,             // add hl,bc
+	0x03,             // inc bc
+	0x0b,             // dec bc
+};
+static const uint8_t loads[] = {
+	0x47,             // ld b,a
+	0x4f,             // ld c,a
+	0x60,             // ld h,b
+	0x69,             // ld l,c
+	0x78,             // ld a,b
+	0x3e, 0x12,       // ld a,0x12
+	0x01, 0x00, 0x80, // ld bc,0x8000
+	0x0a,             // ld a,(bc)
+	0x02,             // ld (bc),a
+	0xf5,             // push af
+	0xf1,             // pop af
+};
+static const uint8_t cb[] = {
+	0xcb, 0x1a, // rr d
+	0xcb, 0x1b, // rr e
+};
+static const uint8_t ddSetup[] = { 0xdd, 0x21, 0x00, 0x80 }; // ld ix,0x8000
+static const uint8_t dd[] = {
+	0xdd, 0x23,       // inc ix
+	0xdd, 0x7c,       // ld a,ixh
+	0xdd, 0x7d,       // ld a,ixl
+	0xdd, 0x7e, 0x05, // ld a,(ix+5)
+};
+static const uint8_t ed[] = {
+	0xed, 0x52, // sbc hl,de
+};
+static const uint8_t io[] = {
+	0xd3, 0x00, // out (0),a
+	0xd3, 0x01, // out (1),a
+	0xdb, 0x01, // in a,(1)
+	0xd3, 0x04, // out (4),a
+	0xdb, 0x05, // in a,(5)
+};
+static const uint8_t jumps[] = {
+	0x3e, 0x01,       // ld a,1
+	0xb7,             // or a
+	0xca, 0x00, 0x00, // jp z,0 (never taken)
+	0xc2, 0x00, 0x00, // jp nz,next, patched
+};
+// call a ret that follows the loop, patched
+static const uint8_t calls[] = { 0xcd, 0x00, 0x00 };
+// vdc register writes, the value then the register
+#define VDC_REG(R, V) 0x3e, (V), 0xd3, 0x05, 0x3e, 0x80 | (R), 0xd3, 0x05
+// a bitmap mode, the fill at the top left
+static const uint8_t commandSetup[] = {
+	VDC_REG(0, 0x0e), VDC_REG(1, 0x40),
+	VDC_REG(36, 0), VDC_REG(37, 0), VDC_REG(38, 0), VDC_REG(39, 0),
+	VDC_REG(41, 0), VDC_REG(43, 0), VDC_REG(44, 0x55), VDC_REG(45, 0),
+};
+// the biggest lmmv there is, stopped, then one that's done straight away,
+// so the command engine is always due sooner than it was
+static const uint8_t command[] = {
+	VDC_REG(40, 0), VDC_REG(42, 0), VDC_REG(46, 0x80),
+	VDC_REG(46, 0x00),
+	VDC_REG(40, 1), VDC_REG(42, 1), VDC_REG(46, 0x80),
+};
+// the line interrupt's line counting down, so it's always due sooner
+static const uint8_t line[] = {
+	0x78,       // ld a,b
+	0xd3, 0x05, // out (5),a
+	0x3e, 0x93, // ld a,0x93
+	0xd3, 0x05, // out (5),a
+	0x05,       // dec b
+};
+
+static const struct Workload workloads[] = {
+	{ "alu", NULL, NULL, 0, alu, sizeof(alu) },
+	{ "loads", NULL, NULL, 0, loads, sizeof(loads) },
+	{ "cb", NULL, NULL, 0, cb, sizeof(cb) },
+	{ "dd", NULL, ddSetup, sizeof(ddSetup), dd, sizeof(dd) },
+	{ "ed", NULL, NULL, 0, ed, sizeof(ed) },
+	{ "io", NULL, NULL, 0, io, sizeof(io) },
+	{ "jumps", NULL, NULL, 0, jumps, sizeof(jumps) },
+	{ "calls", NULL, NULL, 0, calls, sizeof(calls) },
+	{ "command", NULL, commandSetup, sizeof(commandSetup), command, sizeof(command) },
+	{ "line", NULL, NULL, 0, line, sizeof(line) },
+	{ "music", "test/music.rom" },
+};
+
+// the aardbei cpu modes, see its usage
+static const struct {
+	const char *name;
+	const char *flag;
+} modes[] = {
+	{ "interpret", "-i" },
+	{ "cache", NULL },
+	{ "jit", "-j" },
+};
+
+// lay the workload out as a rom: setup, then the body repeated in a loop
+int writeRom(const struct Workload *workload, const char *filename) {
+	static uint8_t rom[ROM_SIZE];
+	memset(rom, 0, sizeof(rom));
+	int at = 0;
+	memcpy(rom, common, sizeof(common));
+	at += sizeof(common);
+	memcpy(rom + at, workload->setup, workload->setupLength);
+	at += workload->setupLength;
+	int loop = at;
+	int subroutine = loop + BODY_REPEATS * workload->bodyLength + 3;
+	for(int i = 0; i < BODY_REPEATS; i++) {
+		uint8_t *body = rom + at;
+		memcpy(body, workload->body, workload->bodyLength);
+		at += workload->bodyLength;
+		// jumps and calls go to the instruction after the body and the
+		// ret after the loop
+		if(workload->body == jumps) {
+			body[7] = at;
+			body[8] = at >> 8;
+		} else if(workload->body == calls) {
+			body[1] = subroutine;
+			body[2] = subroutine >> 8;
+		}
+	}
+	rom[at++] = 0xc3; // jp loop
+	rom[at++] = loop;
+	rom[at++] = loop >> 8;
+	rom[at++] = 0xc9; // ret
+	FILE *fp = fopen(filename, "wb");
+	if(!fp || fwrite(rom, sizeof(rom), 1, fp) != 1) {
+		fprintf(stderr, "Could not write %s\n", filename);
+		if(fp) fclose(fp);
+		return 1;
+	}
+	return fclose(fp);
+}
+
+// run ./aardbei headless with its output thrown away, returns the
+// nanoseconds it took or -1 if it failed
+long int runEmulator(const char *rom, uint64_t cycles, const char *flag,
+		const char *profile) {
+	char limit[32];
+	snprintf(limit, sizeof(limit), "%" PRIu64, cycles);
+	const char *argv[10] = { "./aardbei", "-H", "-c", limit };
+	int argc = 4;
+	if(flag) argv[argc++] = flag;
+	if(profile) {
+		argv[argc++] = "-P";
+		argv[argc++] = profile;
+	}
+	argv[argc++] = rom;
+	argv[argc] = NULL;
+	long int start = nanos();
+	pid_t pid = fork();
+	if(pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		execv(argv[0], (char **)argv);
+		_exit(127);
+	}
+	int status;
+	if(pid < 0 || waitpid(pid, &status, 0) < 0) return -1;
+	// a headless run that hits the cycle limit with nothing else to wait for
+	// exits 0
+	if(!WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+	return nanos() - start;
+}
+
+// how many instructions a run of this many cycles is, from a profile of it
+uint64_t countInstructions(const char *rom, uint64_t cycles) {
+	const char *profile = "bench/profile";
+	uint64_t instructions = 0;
+	if(runEmulator(rom, cycles, NULL, profile) < 0) return 0;
+	FILE *fp = fopen(profile, "r");
+	if(!fp) return 0;
+	if(fscanf(fp, "%" SCNu64 " instructions", &instructions) != 1) instructions = 0;
+	fclose(fp);
+	remove(profile);
+	remove("bench/profile.folded");
+	return instructions;
+}
+
+void benchCPU(uint64_t cycles) {
+	for(int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+		const struct Workload *workload = &workloads[i];
+		char rom[64], name[64];
+		if(workload->rom) {
+			snprintf(rom, sizeof(rom), "%s", workload->rom);
+			if(access(rom, R_OK)) {
+				printf("%-36s %12s\n", workload->name, "no rom");
+				continue;
+			}
+		} else {
+			snprintf(rom, sizeof(rom), "bench/%s.rom", workload->name);
+			if(writeRom(workload, rom)) continue;
+		}
+		uint64_t instructions = countInstructions(rom, cycles);
+		for(int mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+			long int taken = runEmulator(rom, cycles, modes[mode].flag, NULL);
+			if(taken <= 0) {
+				fprintf(stderr, "%s failed under %s\n", rom, modes[mode].name);
+				continue;
+			}
+			snprintf(name, sizeof(name), "cpu.%s.%s.mhz", workload->name, modes[mode].name);
+			result(name, cycles * 1000.0 / taken, 0);
+			if(!instructions) continue;
+			snprintf(name, sizeof(name), "cpu.%s.%s.ns", workload->name, modes[mode].name);
+			result(name, (double)taken / instructions, 1);
+		}
+		if(!workload->rom) remove(rom);
+	}
+}
+
+
+
+/* RENDERING */
+
+// the registers for each mode, tables wherever the msx bios puts them
+static const struct {
+	const char *name;
+	uint8_t regs[14];
+} screens[] = {
+	{ "graphic1", { 0x00, 0x40, 0x06, 0x80, 0x00, 0x36, 0x07, 0xf4 } },
+	{ "text1", { 0x00, 0x50, 0x00, 0x00, 0x01, 0x00, 0x00, 0xf4 } },
+	{ "text2", { 0x04, 0x50, 0x00, 0x2f, 0x02, 0x00, 0x00, 0xf4, 0, 0, 0, 0, 0x1e, 0x11 } },
+	{ "graphic2", { 0x02, 0x40, 0x06, 0xff, 0x03, 0x36, 0x07, 0xf4 } },
+	{ "graphic3", { 0x04, 0x40, 0x06, 0xff, 0x03, 0x36, 0x07, 0xf4 } },
+};
+
+// render the screen over and over, all of it or just the first row of
+// names changing each time, returns frames a second
+double renderFrames(struct Renderer *renderer, struct Screen *screen, int full) {
+	int width, height;
+	long int frames = 0, start = nanos(), taken;
+	do {
+		for(int i = 0; i < 16; i++, frames++) {
+			screen->serial = renderer->shown + 1;
+			screen->redraw = full;
+			memset(screen->vramChanged, 0, VRAM_PAGES);
+			// the name table, always at the start of a 32 byte chunk
+			uint32_t names = (screen->regs[2] & 0x7f) << 10;
+			screen->vram[names] = frames;
+			screen->vramChanged[names >> 8] |= 1 << (names >> 5 & 7);
+			render(renderer, screen, &width, &height);
+		}
+		taken = nanos() - start;
+	} while(taken < RENDER_NANOS);
+	return frames * 1e9 / taken;
+}
+
+void benchRender() {
+	struct Renderer *renderer = calloc(1, sizeof(struct Renderer));
+	struct Screen *screen = calloc(1, sizeof(struct Screen));
+	if(!renderer || !screen) {
+		fprintf(stderr, "Out of memory for the render benchmark\n");
+		exit(1);
+	}
+	srand(1);
+	for(int i = 0; i < VRAM_SIZE; i++) screen->vram[i] = rand();
+	for(int i = 0; i < PALETTE_SIZE; i++) screen->palette[i] = rand() & 0x777;
+	for(int i = 0; i < sizeof(screens) / sizeof(screens[0]); i++) {
+		char name[64];
+		memset(screen->regs, 0, VDC_REGS);
+		memcpy(screen->regs, screens[i].regs, sizeof(screens[i].regs));
+		snprintf(name, sizeof(name), "render.%s.full.fps", screens[i].name);
+		result(name, renderFrames(renderer, screen, 1), 0);
+		snprintf(name, sizeof(name), "render.%s.row.fps", screens[i].name);
+		result(name, renderFrames(renderer, screen, 0), 0);
+	}
+	free(renderer);
+	free(screen);
+}
+
+
+
+/* BASELINE */
+
+int saveResults(const char *filename) {
+	FILE *fp = fopen(filename, "w");
+	if(!fp) {
+		fprintf(stderr, "Could not save the results to %s\n", filename);
+		return 1;
+	}
+	for(int i = 0; i < resultCount; i++)
+		fprintf(fp, "%s %.3f\n", results[i].name, results[i].value);
+	return fclose(fp);
+}
+
+// compare against the baseline, returns how many results got slower by
+// more than threshold percent
+int compareBaseline(const char *filename, double threshold) {
+	FILE *fp = fopen(filename, "r");
+	if(!fp) {
+		printf("\nno baseline in %s, make baseline saves one\n", filename);
+		return 0;
+	}
+	char name[64];
+	double before;
+	int slower = 0;
+	printf("\nagainst %s\n", filename);
+	while(fscanf(fp, "%63s %lf", name, &before) == 2) {
+		for(int i = 0; i < resultCount; i++) {
+			struct Result *r = &results[i];
+			if(strcmp(r->name, name) || before <= 0 || r->value <= 0) continue;
+			// how much faster it got, below 1 is slower
+			double speedup = r->lowerIsBetter ? before / r->value : r->value / before;
+			int worse = speedup < 1 - threshold / 100;
+			slower += worse;
+			printf("%-36s %12.2f %+7.1f%%%s\n", name, r->value,
+					(speedup - 1) * 100, worse ? "  SLOWER" : "");
+		}
+	}
+	fclose(fp);
+	return slower;
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"usage: %s [-c cycles] [-o results] [-b baseline] [-t percent]\n"
+			"  -c cycles    T cycles each cpu benchmark runs for\n"
+			"  -o results   save the results here\n"
+			"  -b baseline  compare against these saved results\n"
+			"  -t percent   how much slower counts as a regression, 10 if not given\n",
+			name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t cycles = 200000000;
+	const char *output = NULL, *baseline = NULL;
+	double threshold = 10;
+	int opt;
+	while((opt = getopt(argc, argv, "c:o:b:t:")) != -1) {
+		switch(opt) {
+			case 'c': cycles = strtoull(optarg, NULL, 0); break;
+			case 'o': output = optarg; break;
+			case 'b': baseline = optarg; break;
+			case 't': threshold = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if(optind != argc) usage(argv[0]);
+	benchCPU(cycles);
+	benchRender();
+	int status = output && saveResults(output);
+	if(baseline && compareBaseline(baseline, threshold)) status = 1;
+	return status;
+}
@@ -0,0 +1,381 @@
+// turns a trace recorded with aardbei -t into a listing, one line per
+// instruction with whatever it changed after it
+// build with make tracedump
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "../memory.h"
+#include "../trace.h"
+
+
+
+/* DISASSEMBLER */
+
+static const char *r[] = { "b", "c", "d", "e", "h", "l", "(hl)", "a" };
+static const char *rp[] = { "bc", "de", "hl", "sp" };
+static const char *rp2[] = { "bc", "de", "hl", "af" };
+static const char *cc[] = { "nz", "z", "nc", "c", "po", "pe", "p", "m" };
+static const char *alu[] = { "add a,", "adc a,", "sub ", "sbc a,", "and ", "xor ", "or ", "cp " };
+static const char *rot[] = { "rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl" };
+static const char *im[] = { "0", "0/1", "1", "2", "0", "0/1", "1", "2" };
+static const char *block[4][4] = {
+	{ "ldi", "cpi", "ini", "outi" }, { "ldd", "cpd", "ind", "outd" },
+	{ "ldir", "cpir", "inir", "otir" }, { "lddr", "cpdr", "indr", "otdr" },
+};
+
+// the bytes of one instruction and how far through them it has got
+struct Code {
+	const uint8_t *bytes;
+	int at;
+	const char *index; // "ix" or "iy" after a dd or fd prefix, NULL if neither
+	int displaced;     // the displacement was already read, ddcb has it first
+	int8_t displacement;
+};
+
+uint8_t nextByte(struct Code *code) {
+	return code->bytes[code->at++];
+}
+
+uint16_t nextWord(struct Code *code) {
+	uint16_t low = nextByte(code);
+	return low | nextByte(code) << 8;
+}
+
+// hl, ix or iy
+const char *hl(struct Code *code) {
+	return code->index ? code->index : "hl";
+}
+
+// r[z], with (hl) becoming (ix+d) and h and l the index's halves
+// unless the instruction also has (ix+d) in it
+void reg(struct Code *code, int z, int memory, char *out) {
+	if(z == 6 && code->index) {
+		if(!code->displaced) {
+			code->displacement = nextByte(code);
+			code->displaced = 1;
+		}
+		sprintf(out, "(%s%+d)", code->index, code->displacement);
+	} else if((z == 4 || z == 5) && code->index && !memory)
+		sprintf(out, "%s%s", code->index, z == 4 ? "h" : "l");
+	else strcpy(out, r[z]);
+}
+
+const char *pair(struct Code *code, const char **table, int p) {
+	return p == 2 ? hl(code) : table[p];
+}
+
+void bits(struct Code *code, char *out) {
+	char operand[16];
+	if(code->index) {
+		code->displacement = nextByte(code);
+		code->displaced = 1;
+	}
+	uint8_t op = nextByte(code);
+	int x = op >> 6, y = op >> 3 & 7, z = op & 7;
+	reg(code, code->index ? 6 : z, 1, operand);
+	if(x == 0) sprintf(out, "%s %s", rot[y], operand);
+	else sprintf(out, "%s %d,%s", x == 1 ? "bit" : x == 2 ? "res" : "set", y, operand);
+	// undocumented, the result also goes to a register
+	if(code->index && x != 1 && z != 6) sprintf(out + strlen(out), ",%s", r[z]);
+}
+
+void extended(struct Code *code, char *out) {
+	uint8_t op = nextByte(code);
+	int x = op >> 6, y = op >> 3 & 7, z = op & 7, p = y >> 1, q = y & 1;
+	if(x == 2 && z <= 3 && y >= 4) {
+		strcpy(out, block[y-4][z]);
+		return;
+	}
+	if(x != 1) {
+		sprintf(out, "db 0xed,0x%02x", op);
+		return;
+	}
+	switch(z) {
+		case 0:
+			if(y == 6) strcpy(out, "in (c)");
+			else sprintf(out, "in %s,(c)", r[y]);
+			break;
+		case 1:
+			if(y == 6) strcpy(out, "out (c),0");
+			else sprintf(out, "out (c),%s", r[y]);
+			break;
+		case 2: sprintf(out, "%s hl,%s", q ? "adc" : "sbc", rp[p]); break;
+		case 3:
+			if(q) sprintf(out, "ld %s,(0x%04x)", rp[p], nextWord(code));
+			else sprintf(out, "ld (0x%04x),%s", nextWord(code), rp[p]);
+			break;
+		case 4: strcpy(out, "neg"); break;
+		case 5: strcpy(out, y == 1 ? "reti" : "retn"); break;
+		case 6: sprintf(out, "im %s", im[y]); break;
+		case 7: {
+			static const char *misc[] = { "ld i,a", "ld r,a", "ld a,i", "ld a,r",
+				"rrd", "rld", "nop", "nop" };
+			strcpy(out, misc[y]);
+			break;
+		}
+	}
+}
+
+// the instruction at pc in mnemonic form
+void disassemble(const uint8_t *bytes, uint16_t pc, char *out) {
+	struct Code code = { bytes, 0, NULL, 0, 0 };
+	char a[16], b[16];
+	uint8_t op = nextByte(&code);
+	while(op == 0xdd || op == 0xfd) {
+		code.index = op == 0xdd ? "ix" : "iy";
+		op = nextByte(&code);
+	}
+	if(op == 0xcb) {
+		bits(&code, out);
+		return;
+	}
+	if(op == 0xed) {
+		extended(&code, out);
+		return;
+	}
+	int x = op >> 6, y = op >> 3 & 7, z = op & 7, p = y >> 1, q = y & 1;
+	switch(x) {
+		case 0:
+			switch(z) {
+				case 0:
+					if(y == 0) strcpy(out, "nop");
+					else if(y == 1) strcpy(out, "ex af,af'");
+					else {
+						int8_t d = nextByte(&code);
+						uint16_t to = pc + code.at + d;
+						if(y == 2) sprintf(out, "djnz 0x%04x", to);
+						else if(y == 3) sprintf(out, "jr 0x%04x", to);
+						else sprintf(out, "jr %s,0x%04x", cc[y-4], to);
+					}
+					break;
+				case 1:
+					if(q) sprintf(out, "add %s,%s", hl(&code), pair(&code, rp, p));
+					else sprintf(out, "ld %s,0x%04x", pair(&code, rp, p), nextWord(&code));
+					break;
+				case 2: {
+					static const char *to[] = { "(bc),a", "(de),a", NULL, NULL };
+					static const char *from[] = { "a,(bc)", "a,(de)", NULL, NULL };
+					if(p < 2) sprintf(out, "ld %s", q ? from[p] : to[p]);
+					else if(p == 2 && q) sprintf(out, "ld %s,(0x%04x)", hl(&code), nextWord(&code));
+					else if(p == 2) sprintf(out, "ld (0x%04x),%s", nextWord(&code), hl(&code));
+					else if(q) sprintf(out, "ld a,(0x%04x)", nextWord(&code));
+					else sprintf(out, "ld (0x%04x),a", nextWord(&code));
+					break;
+				}
+				case 3: sprintf(out, "%s %s", q ? "dec" : "inc", pair(&code, rp, p)); break;
+				case 4: reg(&code, y, 0, a); sprintf(out, "inc %s", a); break;
+				case 5: reg(&code, y, 0, a); sprintf(out, "dec %s", a); break;
+				case 6: reg(&code, y, 0, a); sprintf(out, "ld %s,0x%02x", a, nextByte(&code)); break;
+				case 7: {
+					static const char *misc[] = { "rlca", "rrca", "rla", "rra",
+						"daa", "cpl", "scf", "ccf" };
+					strcpy(out, misc[y]);
+					break;
+				}
+			}
+			break;
+		case 1:
+			if(y == 6 && z == 6) strcpy(out, "halt");
+			else {
+				int memory = y == 6 || z == 6;
+				reg(&code, y, memory, a);
+				reg(&code, z, memory, b);
+				sprintf(out, "ld %s,%s", a, b);
+			}
+			break;
+		case 2:
+			reg(&code, z, 0, a);
+			sprintf(out, "%s%s", alu[y], a);
+			break;
+		case 3:
+			switch(z) {
+				case 0: sprintf(out, "ret %s", cc[y]); break;
+				case 1:
+					if(!q) sprintf(out, "pop %s", pair(&code, rp2, p));
+					else if(p == 0) strcpy(out, "ret");
+					else if(p == 1) strcpy(out, "exx");
+					else if(p == 2) sprintf(out, "jp (%s)", hl(&code));
+					else sprintf(out, "ld sp,%s", hl(&code));
+					break;
+				case 2: sprintf(out, "jp %s,0x%04x", cc[y], nextWord(&code)); break;
+				case 3:
+					switch(y) {
+						case 0: sprintf(out, "jp 0x%04x", nextWord(&code)); break;
+						case 2: sprintf(out, "out (0x%02x),a", nextByte(&code)); break;
+						case 3: sprintf(out, "in a,(0x%02x)", nextByte(&code)); break;
+						case 4: sprintf(out, "ex (sp),%s", hl(&code)); break;
+						case 5: strcpy(out, "ex de,hl"); break;
+						case 6: strcpy(out, "di"); break;
+						case 7: strcpy(out, "ei"); break;
+					}
+					break;
+				case 4: sprintf(out, "call %s,0x%04x", cc[y], nextWord(&code)); break;
+				case 5:
+					if(!q) sprintf(out, "push %s", pair(&code, rp2, p));
+					else sprintf(out, "call 0x%04x", nextWord(&code));
+					break;
+				case 6: sprintf(out, "%s0x%02x", alu[y], nextByte(&code)); break;
+				case 7: sprintf(out, "rst 0x%02x", y * 8); break;
+			}
+			break;
+	}
+}
+
+
+
+/* LISTING */
+
+static const char *registerNames[TRACE_REGISTERS] = {
+	"af", "bc", "de", "hl", "af'", "bc'", "de'", "hl'", "ix", "iy", "sp", "ir",
+};
+
+// the instruction being listed, it's printed once the next one starts
+// so everything it did is known
+struct Line {
+	int pending;
+	uint64_t cycle;
+	char text[512];
+	int length;
+};
+
+void append(struct Line *line, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void append(struct Line *line, const char *format, ...) {
+	int room = sizeof(line->text) - line->length;
+	if(room <= 1) return;
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(line->text + line->length, room, format, args);
+	va_end(args);
+	line->length += length < room ? length : room - 1;
+}
+
+void flushLine(struct Line *line) {
+	while(line->length && line->text[line->length-1] == ' ')
+		line->text[--line->length] = 0;
+	if(line->pending) printf("%s\n", line->text);
+	line->pending = 0;
+	line->length = 0;
+}
+
+void startLine(struct Line *line, uint64_t cycle, struct TraceRecord *record) {
+	char text[32];
+	flushLine(line);
+	line->pending = 1;
+	line->cycle = cycle;
+	append(line, "%14" PRIu64 "  ", cycle);
+	if(record->addr >= BANK_BASE && record->addr < RAM_BASE)
+		append(line, "%2d:0x%04x  ", record->bytes[4] % FLASH_BANKS, record->addr);
+	else append(line, "   0x%04x  ", record->addr);
+	for(int i = 0; i < 4; i++) {
+		if(i < record->size) append(line, "%02x ", record->bytes[i]);
+		else append(line, "   ");
+	}
+	uint8_t bytes[8] = { 0 };
+	memcpy(bytes, record->bytes, record->size);
+	disassemble(bytes, record->addr, text);
+	append(line, " %-20s", text);
+}
+
+void usage(const char *name) {
+	fprintf(stderr,
+			"usage: %s [-f cycle] [-n count] trace\n"
+			"  -f cycle   start listing at this cycle\n"
+			"  -n count   list this many instructions at most\n",
+			name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t first = 0, count = UINT64_MAX;
+	int opt;
+	while((opt = getopt(argc, argv, "f:n:")) != -1) {
+		switch(opt) {
+			case 'f': first = strtoull(optarg, NULL, 0); break;
+			case 'n': count = strtoull(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1) usage(argv[0]);
+
+	FILE *fp = fopen(argv[optind], "rb");
+	if(!fp) {
+		fprintf(stderr, "Could not open trace %s\n", argv[optind]);
+		return 1;
+	}
+	struct TraceHeader header;
+	if(fread(&header, sizeof(header), 1, fp) != 1
+			|| memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))
+			|| header.version != TRACE_VERSION
+			|| header.recordSize != sizeof(struct TraceRecord)) {
+		fprintf(stderr, "%s is not a trace this can read\n", argv[optind]);
+		return 1;
+	}
+
+	static struct TraceRecord records[TRACE_CHUNK];
+	struct Line line = { 0 };
+	uint64_t high = 0, listed = 0;
+	size_t read;
+	while(listed <= count && (read = fread(records, sizeof(struct TraceRecord),
+			TRACE_CHUNK, fp))) {
+		for(size_t i = 0; i < read; i++) {
+			struct TraceRecord *record = &records[i];
+			uint64_t cycle = high | record->cycle;
+			if(record->type == TRACE_CLOCK) {
+				high = record->clock & ~(uint64_t)UINT32_MAX;
+				continue;
+			}
+			if(record->type == TRACE_OP) {
+				flushLine(&line);
+				if(cycle < first) continue;
+				if(++listed > count) break;
+				startLine(&line, cycle, record);
+				continue;
+			}
+			if(record->type == TRACE_INTERRUPT) {
+				flushLine(&line);
+				if(cycle < first) continue;
+				line.pending = 1;
+				char text[32];
+				sprintf(text, "interrupt 0x%04x", record->addr);
+				append(&line, "%14" PRIu64 "     0x%04x  %12s %-20s", cycle,
+						record->words[0], "", text);
+				continue;
+			}
+			// the registers tracing started with come before any instruction
+			if(!line.pending && record->type == TRACE_REGS && cycle >= first) {
+				line.pending = 1;
+				append(&line, "%14" PRIu64 "  %-43s", cycle, "start");
+			}
+			if(!line.pending) continue;
+			switch(record->type) {
+				case TRACE_REGS:
+					for(int reg = 0, n = 0; reg < TRACE_REGISTERS && n < 4; reg++)
+						if(record->addr & 1 << reg)
+							append(&line, " %s=%04x", registerNames[reg], record->words[n++]);
+					break;
+				case TRACE_READ:
+					append(&line, " (%04x)->%02x", record->addr, record->bytes[0]);
+					break;
+				case TRACE_WRITE:
+					append(&line, " (%04x)<-%02x", record->addr, record->bytes[0]);
+					break;
+				case TRACE_IN:
+					append(&line, " in %02x->%02x", record->addr, record->bytes[0]);
+					break;
+				case TRACE_OUT:
+					append(&line, " out %02x<-%02x", record->addr, record->bytes[0]);
+					break;
+			}
+		}
+	}
+	flushLine(&line);
+	fclose(fp);
+	return 0;
+}
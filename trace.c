@@ -0,0 +1,135 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "aardbei.h"
+#include "trace.h"
+
+
+
+/* WRITER */
+
+// saves full chunks in the order they were filled until it's told to stop
+void *traceWriter(void *data) {
+	struct Trace *trace = data;
+	while(1) {
+		sem_wait(&trace->full);
+		int length = trace->lengths[trace->writing];
+		if(length < 0) break;
+		struct TraceRecord *chunk = &trace->chunks[trace->writing * TRACE_CHUNK];
+		if(!trace->failed && fwrite(chunk, sizeof(struct TraceRecord), length, trace->fp)
+				!= (size_t)length)
+			trace->failed = 1;
+		trace->writing = (trace->writing + 1) % TRACE_CHUNKS;
+		sem_post(&trace->free);
+	}
+	return NULL;
+}
+
+struct Trace *newTrace(const char *filename) {
+	struct Trace *trace = calloc(1, sizeof(struct Trace));
+	if(trace) trace->chunks = malloc(TRACE_CHUNKS * TRACE_CHUNK * sizeof(struct TraceRecord));
+	if(!trace || !trace->chunks) {
+		fprintf(stderr, "Out of memory for the trace\n");
+		exit(1);
+	}
+	trace->fp = fopen(filename, "wb");
+	if(!trace->fp) {
+		fprintf(stderr, "Could not open trace %s\n", filename);
+		exit(1);
+	}
+	// the chunks are written whole, stdio's buffer would only be copied through
+	setvbuf(trace->fp, NULL, _IONBF, 0);
+	struct TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, sizeof(struct TraceRecord) };
+	if(fwrite(&header, sizeof(header), 1, trace->fp) != 1) trace->failed = 1;
+	trace->next = trace->chunks;
+	trace->end = trace->chunks + TRACE_CHUNK;
+	if(sem_init(&trace->free, 0, TRACE_CHUNKS - 1) || sem_init(&trace->full, 0, 0)
+			|| pthread_create(&trace->thread, NULL, traceWriter, trace)) {
+		fprintf(stderr, "Could not start the trace writer\n");
+		exit(1);
+	}
+	return trace;
+}
+
+// hand the chunk being filled to the writer, length records of it
+void handChunk(struct Trace *trace, int length) {
+	trace->lengths[trace->filling] = length;
+	sem_post(&trace->full);
+	trace->filling = (trace->filling + 1) % TRACE_CHUNKS;
+}
+
+// the chunk being filled is full, move on to the next one as soon as
+// the writer is done with it
+void nextChunk(struct Trace *trace) {
+	handChunk(trace, TRACE_CHUNK);
+	sem_wait(&trace->free);
+	trace->next = &trace->chunks[trace->filling * TRACE_CHUNK];
+	trace->end = trace->next + TRACE_CHUNK;
+}
+
+// write out whatever is left, returns nonzero if any of the trace
+// couldn't be written
+int destroyTrace(struct Trace *trace) {
+	handChunk(trace, trace->next - &trace->chunks[trace->filling * TRACE_CHUNK]);
+	sem_wait(&trace->free);
+	handChunk(trace, -1);
+	pthread_join(trace->thread, NULL);
+	int failed = fclose(trace->fp) || trace->failed;
+	if(failed) fprintf(stderr, "Could not write all of the trace\n");
+	sem_destroy(&trace->free);
+	sem_destroy(&trace->full);
+	free(trace->chunks);
+	free(trace);
+	return failed;
+}
+
+
+
+/* RECORDS */
+
+void traceClock(struct Trace *trace, uint64_t cycle) {
+	trace->clockHigh = cycle >> 32;
+	traceRecord(trace, TRACE_CLOCK, cycle)->clock = cycle;
+}
+
+// the instruction from pc up to next, before it runs
+void traceOp(struct Trace *trace, struct Memory *memory, uint64_t cycle,
+		uint16_t pc, uint16_t next) {
+	struct TraceRecord *record = traceRecord(trace, TRACE_OP, cycle);
+	record->addr = pc;
+	record->size = (uint16_t)(next - pc) > 4 ? 4 : next - pc;
+	for(int i = 0; i < record->size; i++) {
+		uint16_t addr = pc + i;
+		record->bytes[i] = memory->readPages[addr >> PAGE_SHIFT][addr & PAGE_MASK];
+	}
+	record->bytes[4] = memory->flashBank;
+}
+
+// whichever registers changed since last time, 4 to a record
+// F has to be up to date, see getFlags()
+void traceRegs(struct Trace *trace, uint64_t cycle, struct Registers *regs, uint16_t sp) {
+	uint16_t now[TRACE_REGISTERS] = {
+		[TRACE_AF] = regs->main.af, [TRACE_BC] = regs->main.bc,
+		[TRACE_DE] = regs->main.de, [TRACE_HL] = regs->main.hl,
+		[TRACE_AF_] = regs->alt.af, [TRACE_BC_] = regs->alt.bc,
+		[TRACE_DE_] = regs->alt.de, [TRACE_HL_] = regs->alt.hl,
+		[TRACE_IX] = regs->ix, [TRACE_IY] = regs->iy,
+		[TRACE_SP] = sp, [TRACE_IR] = regs->i << 8 | regs->r,
+	};
+	struct TraceRecord *record = NULL;
+	int count = 0;
+	for(int reg = 0; reg < TRACE_REGISTERS; reg++) {
+		if(trace->started && now[reg] == trace->regs[reg]) continue;
+		if(!record || count == 4) {
+			record = traceRecord(trace, TRACE_REGS, cycle);
+			count = 0;
+		}
+		record->addr |= 1 << reg;
+		record->words[count++] = now[reg];
+		trace->regs[reg] = now[reg];
+	}
+	trace->started = 1;
+}
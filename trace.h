@@ -0,0 +1,116 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+// a trace file is this header followed by records, tools/tracedump.c
+// turns one back into a listing
+#define TRACE_MAGIC "AARDTRC\n"
+#define TRACE_VERSION 2
+
+// what a record is
+#define TRACE_CLOCK 0 // the full cycle count, before any record whose
+                      // cycle doesn't share its high half with the last one
+#define TRACE_OP    1 // an instruction about to run
+#define TRACE_REGS  2 // registers the instruction before it changed
+#define TRACE_READ  3 // memory
+#define TRACE_WRITE 4
+#define TRACE_IN    5 // io
+#define TRACE_OUT   6
+#define TRACE_INTERRUPT 7 // taken before the next instruction
+
+// registers in the order TRACE_REGS records give them
+#define TRACE_AF  0
+#define TRACE_BC  1
+#define TRACE_DE  2
+#define TRACE_HL  3
+#define TRACE_AF_ 4
+#define TRACE_BC_ 5
+#define TRACE_DE_ 6
+#define TRACE_HL_ 7
+#define TRACE_IX  8
+#define TRACE_IY  9
+#define TRACE_SP  10
+#define TRACE_IR  11
+#define TRACE_REGISTERS 12
+
+// every record is 16 bytes, little endian
+struct TraceRecord {
+	uint8_t type;
+	uint8_t size;  // op: bytes in it
+	uint16_t addr; // op: pc, regs: which ones follow, memory: address, io: port,
+	               // interrupt: where it went
+	uint32_t cycle; // low half
+	union {
+		uint64_t clock;    // clock: the whole count
+		uint8_t bytes[8];  // op: the opcode bytes then the flash bank,
+		                   // memory and io: the data
+		uint16_t words[4]; // regs: up to 4 new values, lowest register first,
+		                   // interrupt: the pc it left
+	};
+};
+
+struct TraceHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+};
+
+#define TRACE_CHUNK 65536 // records, each goes to the file in one write
+#define TRACE_CHUNKS 8    // how far the writer thread can fall behind
+
+struct Registers;
+struct Memory;
+
+// records are appended to a ring of chunks on the emulation thread and
+// a writer thread saves the full ones, so the disk is only ever waited
+// on if it's slower than the cpu for a whole ring
+struct Trace {
+	FILE *fp;
+	struct TraceRecord *chunks; // TRACE_CHUNKS of TRACE_CHUNK records
+	int lengths[TRACE_CHUNKS]; // records in each full chunk, -1 to stop
+	// emulation thread only
+	int filling; // chunk
+	struct TraceRecord *next, *end; // in it
+	uint32_t clockHigh;
+	uint16_t regs[TRACE_REGISTERS]; // as of the last regs record
+	int started; // a first regs record with all of them was written
+	// writer thread only
+	int writing;
+	int failed;
+	sem_t free, full; // chunks
+	pthread_t thread;
+};
+
+struct Trace *newTrace(const char *);
+int destroyTrace(struct Trace *);
+void nextChunk(struct Trace *);
+void traceClock(struct Trace *, uint64_t);
+void traceOp(struct Trace *, struct Memory *, uint64_t, uint16_t, uint16_t);
+void traceRegs(struct Trace *, uint64_t, struct Registers *, uint16_t);
+
+// room for one more record, zeroed apart from its type and cycle
+static inline struct TraceRecord *traceRecord(struct Trace *trace, int type,
+		uint64_t cycle) {
+	if(cycle >> 32 != trace->clockHigh) traceClock(trace, cycle);
+	if(trace->next == trace->end) nextChunk(trace);
+	struct TraceRecord *record = trace->next++;
+	memset(record, 0, sizeof(struct TraceRecord));
+	record->type = type;
+	record->cycle = cycle;
+	return record;
+}
+
+// memory and io, just the one byte
+static inline void traceData(struct Trace *trace, int type, uint64_t cycle,
+		uint16_t addr, uint8_t data) {
+	struct TraceRecord *record = traceRecord(trace, type, cycle);
+	record->addr = addr;
+	record->bytes[0] = data;
+}
+
+#endif
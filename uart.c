@@ -0,0 +1,258 @@
+#define _GNU_SOURCE // ptys
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "uart.h"
+#include "sched.h"
+
+/* HOST END */
+
+// stdout and no input until openUART() is given something else, or a
+// sink is set
+void initUART(struct UART *uart) {
+	memset(uart, 0, sizeof(struct UART));
+	uart->out = STDOUT_FILENO;
+	uart->in = -1;
+	uart->listener = -1;
+}
+
+// connect the uart to pty for a new pseudo-terminal, unix:path for a
+// unix socket it waits for someone on, or anything else for a file the
+// output goes to. a baud of 0 sends and receives with no waiting at all
+void openUART(struct UART *uart, const char *name, int baud) {
+	uart->byteCycles = baud > 0 ? (uint64_t)CPU_RATE * 10 / baud : 0;
+	if(!name) return;
+	if(!strcmp(name, "pty")) {
+		int fd = posix_openpt(O_RDWR | O_NOCTTY);
+		struct termios raw;
+		if(fd < 0 || grantpt(fd) || unlockpt(fd) || tcgetattr(fd, &raw)) {
+			fprintf(stderr, "Could not open a pty for the uart\n");
+			exit(1);
+		}
+		// bytes go through untouched, not as lines
+		cfmakeraw(&raw);
+		tcsetattr(fd, TCSANOW, &raw);
+		fcntl(fd, F_SETFL, O_NONBLOCK);
+		fprintf(stderr, "Uart on %s\n", ptsname(fd));
+		uart->out = uart->in = fd;
+	} else if(!strncmp(name, "unix:", 5)) {
+		struct sockaddr_un un = { 0 };
+		un.sun_family = AF_UNIX;
+		strncpy(un.sun_path, name + 5, sizeof(un.sun_path) - 1);
+		unlink(name + 5);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if(fd < 0 || bind(fd, (struct sockaddr *)&un, sizeof(un)) || listen(fd, 1)) {
+			fprintf(stderr, "Could not listen for the uart on %s\n", name + 5);
+			exit(1);
+		}
+		uart->listener = fd;
+		uart->path = strdup(name + 5);
+		uart->out = uart->in = -1;
+	} else {
+		int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) {
+			fprintf(stderr, "Could not open %s for the uart\n", name);
+			exit(1);
+		}
+		uart->out = fd;
+	}
+}
+
+// the other end of the socket went away, wait for the next one
+void hangUp(struct UART *uart) {
+	close(uart->in);
+	uart->in = uart->out = -1;
+	uart->inputLength = 0;
+}
+
+// write out what's gone over the line, as much as the host takes
+void flushOutput(struct UART *uart) {
+	// the debug opcodes print through stdio
+	if(uart->out == STDOUT_FILENO) fflush(stdout);
+	if(uart->sink) {
+		uart->sink(uart->sinkData, uart->output, uart->outputLength);
+		uart->outputLength = 0;
+		return;
+	}
+	int done = 0;
+	while(uart->out >= 0 && done < uart->outputLength) {
+		// a socket closed on the other end mustn't raise SIGPIPE
+		ssize_t n = uart->listener >= 0
+			? send(uart->out, uart->output + done, uart->outputLength - done,
+					MSG_NOSIGNAL)
+			: write(uart->out, uart->output + done, uart->outputLength - done);
+		if(n > 0) done += n;
+		else if(n < 0 && errno == EINTR) continue;
+		else if(n < 0 && errno == EAGAIN) break; // the rest later
+		else if(uart->listener >= 0) {
+			hangUp(uart);
+			break;
+		} else break;
+	}
+	// nowhere for it to go, a socket keeps it for whoever connects
+	if(uart->out < 0 && uart->listener < 0) done = uart->outputLength;
+	memmove(uart->output, uart->output + done, uart->outputLength - done);
+	uart->outputLength -= done;
+}
+
+void readInput(struct UART *uart, uint64_t cycles) {
+	if(uart->in < 0 && !uart->source) return;
+	memmove(uart->input, uart->input + uart->inputFirst, uart->inputLength);
+	uart->inputFirst = 0;
+	if(uart->inputLength == UART_BUFFER) return;
+	uint8_t *into = uart->input + uart->inputLength;
+	int space = UART_BUFFER - uart->inputLength;
+	ssize_t n;
+	if(uart->source) n = uart->source(uart->inputData, cycles, into, space);
+	else {
+		n = read(uart->in, into, space);
+		// a pty with nothing on the other end says EIO, that's fine
+		if(n <= 0 && uart->listener >= 0
+				&& (n == 0 || (errno != EAGAIN && errno != EINTR))) {
+			hangUp(uart);
+			return;
+		}
+	}
+	if(n <= 0) return;
+	if(uart->tap) uart->tap(uart->inputData, cycles, into, n);
+	// an idle line starts its next byte from now
+	if(!uart->inputLength && uart->rxDone < cycles)
+		uart->rxDone = cycles + uart->byteCycles;
+	uart->inputLength += n;
+}
+
+void destroyUART(struct UART *uart) {
+	flushOutput(uart);
+	if(uart->out >= 0 && uart->out != STDOUT_FILENO) close(uart->out);
+	if(uart->in >= 0 && uart->in != uart->out) close(uart->in);
+	if(uart->listener >= 0) close(uart->listener);
+	if(uart->path) unlink(uart->path);
+	free(uart->path);
+}
+
+
+
+/* LINE */
+
+// move bytes along both lines as far as they've got by now
+void syncUART(struct UART *uart, uint64_t cycles) {
+	while(uart->txCount && uart->txDone <= cycles) {
+		if(uart->outputLength == UART_BUFFER) {
+			flushOutput(uart);
+			// the host isn't keeping up, hold the line until it does
+			if(uart->outputLength == UART_BUFFER) break;
+		}
+		uart->output[uart->outputLength++] = uart->tx[uart->txFirst];
+		uart->txFirst = (uart->txFirst + 1) % UART_FIFO;
+		uart->txCount--;
+		uart->txDone += uart->byteCycles;
+	}
+	while(uart->inputLength && uart->rxCount < UART_FIFO && uart->rxDone <= cycles) {
+		uart->rx[(uart->rxFirst + uart->rxCount) % UART_FIFO]
+			= uart->input[uart->inputFirst++];
+		uart->inputLength--;
+		uart->rxCount++;
+		uart->rxDone += uart->byteCycles;
+	}
+}
+
+// talk to the host end, every so often rather than for every byte
+void serviceUART(struct UART *uart, uint64_t cycles) {
+	syncUART(uart, cycles);
+	if(uart->listener >= 0 && uart->in < 0) {
+		int fd = accept(uart->listener, NULL, NULL);
+		if(fd >= 0) {
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			uart->out = uart->in = fd;
+		}
+	}
+	flushOutput(uart);
+	readInput(uart, cycles);
+	syncUART(uart, cycles);
+}
+
+void uartWrite(struct UART *uart, uint64_t cycles, uint8_t data) {
+	syncUART(uart, cycles);
+	if(uart->txCount == UART_FIFO) {
+		uart->lost = 1;
+		return;
+	}
+	if(!uart->txCount) uart->txDone = cycles + uart->byteCycles;
+	uart->tx[(uart->txFirst + uart->txCount++) % UART_FIFO] = data;
+	syncUART(uart, cycles);
+}
+
+// the next byte received, 0 if there isn't one
+uint8_t uartRead(struct UART *uart, uint64_t cycles) {
+	syncUART(uart, cycles);
+	if(!uart->rxCount) return 0;
+	// a held up line starts its next byte from now. not in syncUART(), then
+	// it'd depend on how often that's called
+	if(uart->rxCount == UART_FIFO && uart->inputLength && uart->rxDone < cycles)
+		uart->rxDone = cycles + uart->byteCycles;
+	uint8_t data = uart->rx[uart->rxFirst];
+	uart->rxFirst = (uart->rxFirst + 1) % UART_FIFO;
+	uart->rxCount--;
+	return data;
+}
+
+// the status as of the last sync
+uint8_t statusBits(struct UART *uart) {
+	return (uart->rxCount ? UART_RX_READY : 0)
+		| (uart->txCount < UART_FIFO ? UART_TX_READY : 0)
+		| (uart->txCount ? 0 : UART_TX_IDLE)
+		| (uart->lost ? UART_TX_LOST : 0);
+}
+
+uint8_t uartStatus(struct UART *uart, uint64_t cycles) {
+	syncUART(uart, cycles);
+	uint8_t status = statusBits(uart);
+	uart->lost = 0;
+	return status;
+}
+
+
+
+/* INTERRUPTS */
+
+void uartEnable(struct UART *uart, uint64_t cycles, uint8_t data) {
+	syncUART(uart, cycles);
+	uart->interrupts = data & (UART_INT_STATUS | UART_INT_NMI);
+}
+
+// the status bits that are interrupting, as of the last sync
+// whoever wants them on time has to sync at every uartChange()
+int uartInterrupt(struct UART *uart) {
+	return statusBits(uart) & uart->interrupts & UART_INT_STATUS;
+}
+
+// when syncUART() next has a byte to move, NO_EVENT if nothing's on the way
+// (it may be in the past if the host end is holding up the tx line)
+uint64_t uartChange(struct UART *uart) {
+	uint64_t next = NO_EVENT;
+	if(uart->txCount) next = uart->txDone;
+	if(uart->inputLength && uart->rxCount < UART_FIFO && uart->rxDone < next)
+		next = uart->rxDone;
+	return next;
+}
+
+
+
+/* WAITING */
+
+// see portQuiet(), status is whether it's the status port that was read
+uint64_t uartQuiet(struct UART *uart, int status, uint8_t value, uint64_t cycles) {
+	// reading status cleared lost, reading data took a byte if there was one
+	uint8_t next = status ? statusBits(uart) : 0;
+	if(next != value || (!status && uart->rxCount)) return cycles;
+	// until the next byte moves along either line
+	uint64_t change = uartChange(uart);
+	return change > cycles ? change : cycles;
+}
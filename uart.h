@@ -0,0 +1,67 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdint.h>
+
+#define UART_FIFO 16     // bytes each way, like a 16550
+#define UART_BUFFER 4096 // host side, each way
+
+// port 9, read
+#define UART_RX_READY 1 // a byte can be read from port 8
+#define UART_TX_READY 2 // the tx fifo has room for another
+#define UART_TX_IDLE  4 // everything written has gone out
+#define UART_TX_LOST  8 // a byte was written with the tx fifo full and
+                        // dropped, cleared by reading the status
+
+// port 9, written: which of those bits interrupt the cpu while they're set
+#define UART_INT_STATUS 0x0f
+#define UART_INT_NMI    0x80 // with the nmi instead of INT
+
+// bytes go over the line at the baud rate, 10 bits each, and the host end
+// is only written to and read from in batches, see serviceUART()
+// the rx line has flow control: bytes wait on the host side until the
+// fifo has room, and the tx fifo only drains as fast as the host takes it
+// (on a socket, only once someone has connected)
+struct UART {
+	// what the cpu sees, saved with the machine
+	uint8_t tx[UART_FIFO];
+	uint8_t rx[UART_FIFO];
+	int txFirst, txCount;
+	int rxFirst, rxCount;
+	uint64_t txDone; // when the first byte in tx has gone out
+	uint64_t rxDone; // when the next byte coming in lands in rx
+	int lost;
+	uint8_t interrupts; // written to port 9
+	uint32_t byteCycles; // 0 for no waiting at all
+	// the host end
+	int out, in;  // -1 for nowhere, the same fd for a pty or socket
+	int listener; // unix socket to wait for someone on, -1 for none
+	// given the output instead of out when set, see batch.c
+	void (*sink)(void *, const uint8_t *, int);
+	void *sinkData;
+	// input comes from source instead of in when it's set, and tap is shown
+	// whatever came in, both with the cycle it did, see record.c
+	int (*source)(void *, uint64_t, uint8_t *, int);
+	void (*tap)(void *, uint64_t, const uint8_t *, int);
+	void *inputData;
+	char *path;   // of it, removed at exit
+	uint8_t output[UART_BUFFER]; // gone out the tx line, not written yet
+	int outputLength;
+	uint8_t input[UART_BUFFER]; // read, not in rx yet
+	int inputFirst, inputLength;
+};
+
+void initUART(struct UART *);
+void openUART(struct UART *, const char *, int);
+void destroyUART(struct UART *);
+void serviceUART(struct UART *, uint64_t);
+void uartWrite(struct UART *, uint64_t, uint8_t);
+uint8_t uartRead(struct UART *, uint64_t);
+uint8_t uartStatus(struct UART *, uint64_t);
+void uartEnable(struct UART *, uint64_t, uint8_t);
+void syncUART(struct UART *, uint64_t);
+int uartInterrupt(struct UART *);
+uint64_t uartChange(struct UART *);
+uint64_t uartQuiet(struct UART *, int, uint8_t, uint64_t);
+
+#endif
@@ -1,102 +1,219 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
-#include <allegro5/allegro.h>
+#include <string.h>
 #include "v9958.h"
+#include "render.h"
+#include "sched.h"
 
-struct Dimensions {
-	int x;
-	int y;
+// text2 blink periods are counted in tens of frames
+#define BLINK_FRAMES 10
+
+// the msx2 power on palette
+const uint16_t defaultPalette[PALETTE_SIZE] = {
+	0x000, 0x000, 0x611, 0x733, 0x117, 0x327, 0x151, 0x627,
+	0x171, 0x373, 0x661, 0x664, 0x411, 0x265, 0x555, 0x777,
 };
 
-void undefinedMode(int mode) {
-	fprintf(stderr, "Undefined v9958 mode 0x%x\n", mode);
+int getScreenEnable(const uint8_t *regs) {
+	return regs[1] & 0b01000000;
 }
 
-int getScreenEnable(struct VDC *vdc) {
-	return vdc->regs[1] & 0b01000000;
+int getModeFlags(const uint8_t *regs) {
+	return
+		(regs[1] & 0b00010000 ? 0b00000001 : 0) |
+		(regs[1] & 0b00001000 ? 0b00000010 : 0) |
+		(regs[0] & 0b00000010 ? 0b00000100 : 0) |
+		(regs[0] & 0b00000100 ? 0b00001000 : 0) |
+		(regs[0] & 0b00001000 ? 0b00010000 : 0);
 }
 
-int getModeFlags(struct VDC *vdc) {
-	return
-		((vdc->regs[1] & 0b00010000) && 0b00000001) |
-		((vdc->regs[1] & 0b00001000) && 0b00000010) |
-		((vdc->regs[0] & 0b00000010) && 0b00000100) |
-		((vdc->regs[0] & 0b00000100) && 0b00001000) |
-		((vdc->regs[0] & 0b00001000) && 0b00010000);
+// 212 lines instead of 192
+int getLineMode(const uint8_t *regs) {
+	return regs[9] & 0b10000000;
 }
 
-struct Dimensions getScreenDimensions(struct VDC *vdc) {
-	switch(getModeFlags(vdc)) {
-		case 0b00001: return (struct Dimensions){ 40*6, 24*8 };
+struct Dimensions getScreenDimensions(const uint8_t *regs) {
+	switch(getModeFlags(regs)) {
+		case MODE_TEXT1: return (struct Dimensions){ 40*6, 24*8 };
+		case MODE_TEXT2: return (struct Dimensions){ 80*6, getLineMode(regs) ? 212 : 24*8 };
+		case MODE_GRAPHIC1:
+		case MODE_GRAPHIC2:
+		case MODE_GRAPHIC3: return (struct Dimensions){ 32*8, 24*8 };
 		default: return (struct Dimensions){ 1, 1 };
 	}	
 }
 
-void setScreenDimensions(struct VDC *vdc, struct Dimensions dimensions) {
-	al_resize_display(vdc->display, dimensions.x, dimensions.y);
+// whether text2 is showing its blink colours on this frame
+int getBlinkPhase(const uint8_t *regs, uint64_t frames) {
+	int on = (regs[13] >> 4) * BLINK_FRAMES;
+	int off = (regs[13] & 0x0f) * BLINK_FRAMES;
+	if(!on) return 0;
+	if(!off) return 1;
+	return frames % (on + off) < on;
 }
 
-void updateScreenDimensions(struct VDC *vdc) {
-	setScreenDimensions(vdc, getScreenDimensions(vdc));
+// nothing on screen can be trusted anymore, eg after loading a state
+void invalidateScreen(struct VDC *vdc) {
+	vdc->redraw = 1;
 }
 
-void initVDC(struct VDC *vdc) {
+void initVDC(struct VDC *vdc, int headless) {
 	vdc->port1Sequence = 0;
-	vdc->display = al_create_display(1, 1);
-	if(!vdc->display) {
-		fprintf(stderr, "Allegro display could not be created\n");
-		exit(1);
-	}
+	vdc->paletteSequence = 0;
+	vdc->vramAddress = 0;
+	memcpy(vdc->palette, defaultPalette, sizeof(vdc->palette));
+	vdc->redraw = 1;
+	vdc->renderer = headless ? NULL : newRenderer();
 }
 
 void destroyVDC(struct VDC *vdc) {
-	al_destroy_display(vdc->display);
+	if(vdc->renderer) destroyRenderer(vdc->renderer);
 }
 
-void drawTEXT1(struct VDC *vdc) {
+// which of the flags are holding INT low
+int vdcInterrupt(const struct VDC *vdc) {
+	return (vdc->flags & VDC_VBLANK && vdc->regs[1] & 0b00100000 ? VDC_VBLANK : 0)
+		| (vdc->flags & VDC_LINE && vdc->regs[0] & 0b00010000 ? VDC_LINE : 0);
+}
 
+// the first cycle after this one that the line interrupt's line starts at
+// lines count from the frame boundary, which is where vblank is. r19 is
+// compared with the line after vertical scrolling, so r23 moves it
+uint64_t nextLine(const struct VDC *vdc, uint64_t after) {
+	int line = (vdc->regs[19] - vdc->regs[23]) & 0xff;
+	uint64_t at = after / VDC_FRAME_CYCLES * VDC_FRAME_CYCLES + line * VDC_LINE_CYCLES;
+	return at > after ? at : at + VDC_FRAME_CYCLES;
 }
 
+// called at every frame boundary, drawing it is up to the render thread
 void draw(struct VDC *vdc) {
-	al_clear_to_color(al_map_rgb(0, 0, 0));
-	if(getScreenEnable(vdc)) {
-		int mode = getModeFlags(vdc);
-		switch(mode) {
-			case 0b00001:
-				drawTEXT1(vdc);
-				break;
-			default:
-				undefinedMode(mode);
-				break;
-		}	
+	vdc->frames++;
+	if(vdc->renderer) publishScreen(vdc->renderer, vdc);
+}
+
+
+
+/* PORTS */
+
+// the address, pointer and command registers don't change the picture
+int displayRegister(int reg) {
+	return reg < 14 || (reg >= 18 && reg < 32);
+}
+
+void setRegister(struct VDC *vdc, int reg, uint8_t data) {
+	if(reg >= VDC_REGS) return;
+	if(displayRegister(reg) && vdc->regs[reg] != data) vdc->redraw = 1;
+	vdc->regs[reg] = data;
+	if(reg == 16) vdc->paletteSequence = 0;
+	else if(reg == 44) transferCommand(vdc, data);
+	else if(reg == 46) startCommand(vdc);
+}
+
+// the status register r15 points at, without reading it
+uint8_t peekStatus(struct VDC *vdc) {
+	switch(vdc->regs[15] & 0x0f) {
+		case 0: return vdc->flags & VDC_VBLANK;
+		case 1: return 2 << 1 | (vdc->flags & VDC_LINE); // the v9958's id
+		case 2: return commandStatus(vdc);
+		case 7: return vdc->blitter.color;
+		case 8: return vdc->blitter.border;
+		case 9: return vdc->blitter.border >> 8 | 0xfe;
+		default: return 0; // no sprites, so no collision or 5th-sprite bits
 	}
-	al_flip_display();
 }
 
-void vdcWrite(struct VDC *vdc, uint8_t port, uint8_t data) {
-	if(port == 0)
-		0;
-	else if(port == 1)
+uint8_t readStatus(struct VDC *vdc) {
+	uint8_t data = peekStatus(vdc);
+	switch(vdc->regs[15] & 0x0f) {
+		case 0: vdc->flags &= ~VDC_VBLANK; break;
+		case 1: vdc->flags &= ~VDC_LINE; break;
+		case 7: readCommandColor(vdc); break;
+	}
+	return data;
+}
+
+// written by the cpu or the command engine, the snapshots and
+// the renderer both want to know
+void touchVRAM(struct VDC *vdc, uint32_t address, int length) {
+	for(uint32_t chunk = address & ~31; chunk < address + length; chunk += 32) {
+		vdc->vramDirty[chunk >> 8] = 1;
+		vdc->vramChanged[chunk >> 8] |= 1 << (chunk >> 5 & 7);
+	}
+}
+
+// the modes up to graphic3 only address 16k, the rest all of vram
+void incrementAddress(struct VDC *vdc) {
+	if(getModeFlags(vdc->regs) <= MODE_TEXT2)
+		vdc->vramAddress = (vdc->vramAddress & ~0x3fff)
+			| ((vdc->vramAddress + 1) & 0x3fff);
+	else vdc->vramAddress = (vdc->vramAddress + 1) & VRAM_MASK;
+}
+
+void prefetch(struct VDC *vdc) {
+	vdc->readAhead = vdc->vram[vdc->vramAddress];
+	incrementAddress(vdc);
+}
+
+// the command engine catches up first so the cpu sees
+// whatever it would have done by now
+void vdcWrite(struct VDC *vdc, uint64_t cycles, uint8_t port, uint8_t data) {
+	runCommand(vdc, cycles);
+	if(port == 0) { // vram
+		vdc->vram[vdc->vramAddress] = data;
+		touchVRAM(vdc, vdc->vramAddress, 1);
+		incrementAddress(vdc);
+	} else if(port == 1) { // register write or vram address, in two halves
 		if((vdc->port1Sequence = !vdc->port1Sequence)) vdc->dataLatch = data;
-		else vdc->regs[data & 0x3f] = vdc->dataLatch;
-	else if(port == 2)
-		0;
-	else if(port == 3)
-		0;
-	else fprintf(stderr, "Writing to undefined VDC port 0x02%x\n", port);
-	// this is jsut... a semi convenient place for this.. prob should do better tho
-	updateScreenDimensions(vdc);
+		else if(data & 0x80) setRegister(vdc, data & 0x3f, vdc->dataLatch);
+		else {
+			vdc->vramAddress = (vdc->regs[14] & 0x07) << 14
+				| (data & 0x3f) << 8 | vdc->dataLatch;
+			if(!(data & 0x40)) prefetch(vdc);
+		}
+	} else if(port == 2) { // palette, also in two halves
+		if((vdc->paletteSequence = !vdc->paletteSequence)) vdc->paletteLatch = data;
+		else {
+			vdc->palette[vdc->regs[16] & 0x0f] = (data & 0x07) << 8
+				| (vdc->paletteLatch & 0x77);
+			vdc->regs[16] = (vdc->regs[16] + 1) & 0x0f;
+			vdc->redraw = 1;
+		}
+	} else if(port == 3) { // the register r17 points at
+		int reg = vdc->regs[17] & 0x3f;
+		if(!(vdc->regs[17] & 0x80))
+			vdc->regs[17] = (vdc->regs[17] + 1) & 0x3f;
+		setRegister(vdc, reg, data);
+	} else fprintf(stderr, "Writing to undefined VDC port 0x02%x\n", port);
 }
 
-uint8_t vdcRead(struct VDC *vdc, int port) {
-	if(port == 0)
-		0;
-	else if(port == 1)
-		0;
-	else if(port == 2)
+uint8_t vdcRead(struct VDC *vdc, uint64_t cycles, int port) {
+	uint8_t data = 0;
+	runCommand(vdc, cycles);
+	if(port == 0) {
+		data = vdc->readAhead;
+		prefetch(vdc);
+	} else if(port == 1) {
+		vdc->port1Sequence = 0;
+		data = readStatus(vdc);
+	} else if(port == 2)
 		0;
 	else if(port == 3)
 		0;
 	else fprintf(stderr, "Reading from undefined VDC port 0x02%x\n", port);
-	return 0;
+	return data;
+}
+
+// see portQuiet(), as of a vdcRead() of port that gave value
+uint64_t vdcQuiet(struct VDC *vdc, int port, uint8_t value, uint64_t cycles) {
+	if(port == 2 || port == 3) return value ? cycles : NO_EVENT;
+	// vram reads move the address along
+	if(port != 1 || peekStatus(vdc) != value) return cycles;
+	switch(vdc->regs[15] & 0x0f) {
+		case 0: case 1: return NO_EVENT; // only lineEvent and frameEvent set them
+		case 2: return commandSteady(vdc);
+		case 7: return cycles; // lmcm moves on
+		case 8: case 9: return vdc->blitter.command == CMD_SRCH ? cycles : NO_EVENT;
+		default: return NO_EVENT;
+	}
 }
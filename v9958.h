@@ -1,19 +1,77 @@
+#ifndef V9958_H
+#define V9958_H
+
 #include <stdint.h>
-#include <allegro5/allegro.h>
+#include "blitter.h"
 
 #define VRAM_SIZE (1024*128)
+#define VRAM_MASK (VRAM_SIZE - 1)
+#define VRAM_PAGES (VRAM_SIZE / 256)
+
+// ntsc timing in cpu cycles
+#define VDC_LINE_CYCLES 228
+#define VDC_LINES 262
+#define VDC_FRAME_CYCLES (VDC_LINE_CYCLES * VDC_LINES)
+
+// screen modes by their M5..M1 bits, see getModeFlags()
+#define MODE_GRAPHIC1 0b00000
+#define MODE_TEXT1    0b00001
+#define MODE_GRAPHIC2 0b00100
+#define MODE_GRAPHIC3 0b01000
+#define MODE_TEXT2    0b01001
+#define MODE_GRAPHIC4 0b01100
+#define MODE_GRAPHIC5 0b10000
+#define MODE_GRAPHIC6 0b10100
+#define MODE_GRAPHIC7 0b11100
+
+#define VDC_REGS 47
+#define PALETTE_SIZE 16
+
+// status flags that interrupt the cpu while they're set and enabled,
+// reading the status register they're in clears them
+#define VDC_VBLANK 0x80 // s#0 bit 7, enabled by r#1 bit 5
+#define VDC_LINE   0x01 // s#1 bit 0, enabled by r#0 bit 4
+
+struct Renderer;
+
+struct Dimensions {
+	int x;
+	int y;
+};
 
 struct VDC {
-	uint8_t regs[47];
+	uint8_t regs[VDC_REGS];
 	uint8_t vram[VRAM_SIZE];
+	uint8_t vramDirty[VRAM_PAGES]; // 256 byte pages written since the last snapshot
+	uint8_t vramChanged[VRAM_PAGES]; // a bit per 32 bytes written since the last frame
 	uint8_t dataLatch;
 	int port1Sequence;
-	ALLEGRO_DISPLAY *display;
+	uint32_t vramAddress;
+	uint8_t readAhead;
+	uint8_t flags; // VDC_VBLANK and VDC_LINE, see vdcInterrupt()
+	uint16_t palette[PALETTE_SIZE]; // 0GGG 0RRR 0BBB
+	uint8_t paletteLatch;
+	int paletteSequence;
+	struct Blitter blitter;
+	uint64_t frames; // drawn so far, for blinking
+	int redraw; // the whole screen has to be rendered again
+	struct Renderer *renderer; // NULL when headless
 };
 
-void initVDC(struct VDC *);
+void initVDC(struct VDC *, int);
+int getModeFlags(const uint8_t *);
+int getScreenEnable(const uint8_t *);
+struct Dimensions getScreenDimensions(const uint8_t *);
+int getBlinkPhase(const uint8_t *, uint64_t);
+void touchVRAM(struct VDC *, uint32_t, int);
 void destroyVDC(struct VDC *);
 void draw(struct VDC *);
+void invalidateScreen(struct VDC *);
+int vdcInterrupt(const struct VDC *);
+uint64_t nextLine(const struct VDC *, uint64_t);
+
+void vdcWrite(struct VDC *, uint64_t, uint8_t, uint8_t);
+uint8_t vdcRead(struct VDC *, uint64_t, int);
+uint64_t vdcQuiet(struct VDC *, int, uint8_t, uint64_t);
 
-void vdcWrite(struct VDC *, uint8_t, uint8_t);
-uint8_t vdcRead(struct VDC *, int);
+#endif
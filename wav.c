@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "wav.h"
+
+void wavPut16(uint8_t *at, uint16_t value) {
+	at[0] = value;
+	at[1] = value >> 8;
+}
+
+void wavPut32(uint8_t *at, uint32_t value) {
+	wavPut16(at, value);
+	wavPut16(at + 2, value >> 16);
+}
+
+// the header for dataSize bytes of samples, where the file is up to
+void writeWavHeader(struct Wav *wav, uint32_t dataSize) {
+	uint8_t header[WAV_HEADER];
+	int blockAlign = wav->channels * 2;
+	memcpy(header, "RIFF", 4);
+	wavPut32(header + 4, dataSize + WAV_HEADER - 8); // everything after this
+	memcpy(header + 8, "WAVE", 4);
+	memcpy(header + 12, "fmt ", 4);
+	wavPut32(header + 16, 16);
+	wavPut16(header + 20, 1); // pcm
+	wavPut16(header + 22, wav->channels);
+	wavPut32(header + 24, wav->rate);
+	wavPut32(header + 28, wav->rate * blockAlign);
+	wavPut16(header + 32, blockAlign);
+	wavPut16(header + 34, 16);
+	memcpy(header + 36, "data", 4);
+	wavPut32(header + 40, dataSize);
+	if(fwrite(header, WAV_HEADER, 1, wav->fp) != 1) wav->failed = 1;
+}
+
+struct Wav *openWav(const char *filename, int rate, int channels) {
+	struct Wav *wav = calloc(1, sizeof(struct Wav));
+	if(wav) wav->buffer = malloc(WAV_BUFFER * 2);
+	if(!wav || !wav->buffer) {
+		fprintf(stderr, "Out of memory for the wav\n");
+		exit(1);
+	}
+	wav->fp = fopen(filename, "wb");
+	if(!wav->fp) {
+		fprintf(stderr, "Could not open wav %s\n", filename);
+		exit(1);
+	}
+	// the buffer is written whole, stdio's would only be copied through
+	setvbuf(wav->fp, NULL, _IONBF, 0);
+	wav->filename = filename;
+	wav->rate = rate;
+	wav->channels = channels;
+	// sizes of 0 until closeWav() knows them
+	writeWavHeader(wav, 0);
+	return wav;
+}
+
+void flushWav(struct Wav *wav) {
+	if(!wav->failed && wav->length
+			&& fwrite(wav->buffer, 2, wav->length, wav->fp) != (size_t)wav->length)
+		wav->failed = 1;
+	wav->written += wav->length;
+	wav->length = 0;
+}
+
+void writeWav(struct Wav *wav, const int16_t *samples, int count) {
+	for(int i = 0; i < count; i++) {
+		wavPut16(wav->buffer + wav->length * 2, samples[i]);
+		if(++wav->length == WAV_BUFFER) flushWav(wav);
+	}
+}
+
+// returns nonzero if any of it couldn't be written
+int closeWav(struct Wav *wav) {
+	flushWav(wav);
+	uint64_t size = wav->written * 2;
+	// a riff chunk can't say it's any bigger
+	if(size > UINT32_MAX - WAV_HEADER) {
+		fprintf(stderr, "Wav %s is too long, its header is wrong\n", wav->filename);
+		size = UINT32_MAX - WAV_HEADER;
+	}
+	if(fseek(wav->fp, 0, SEEK_SET)) wav->failed = 1;
+	else writeWavHeader(wav, size);
+	if(fclose(wav->fp)) wav->failed = 1;
+	int failed = wav->failed;
+	if(failed) fprintf(stderr, "Could not write wav %s\n", wav->filename);
+	free(wav->buffer);
+	free(wav);
+	return failed;
+}
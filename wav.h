@@ -0,0 +1,28 @@
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define WAV_BUFFER (1 << 20) // samples collected before they're written out
+#define WAV_HEADER 44        // bytes in a canonical pcm header
+
+// 16 bit samples going to a wav file, the sizes in the header are filled
+// in when it's closed. everything in the file is little endian whatever
+// the host is
+struct Wav {
+	FILE *fp;
+	const char *filename;
+	int rate;
+	int channels;
+	uint8_t *buffer;  // samples as they go in the file
+	int length;       // samples in it
+	uint64_t written; // samples written out before them
+	int failed;
+};
+
+struct Wav *openWav(const char *, int, int);
+void writeWav(struct Wav *, const int16_t *, int);
+int closeWav(struct Wav *);
+
+#endif